@@ -34,10 +34,27 @@
 
 #ifdef _KERNEL
 #include <types.h>
+#include <endian.h>
 #include <lib.h>
 #else
 #include <stdint.h>
 #include <string.h>
+#include <sys/endian.h>
+#endif
+
+#define WSIZE	sizeof(unsigned long)
+#define WMASK	(WSIZE - 1)
+#define WBITS	(WSIZE * 8)
+
+/*
+ * Build a word from the tail of word A and the head of word B, the
+ * next word in memory, skipping the first SH bits of A. Which end of
+ * a word comes first in memory depends on the byte order.
+ */
+#if _BYTE_ORDER == _BIG_ENDIAN
+#define MERGE(a, b, sh)	(((a) << (sh)) | ((b) >> (WBITS - (sh))))
+#else
+#define MERGE(a, b, sh)	(((a) >> (sh)) | ((b) << (WBITS - (sh))))
 #endif
 
 /*
@@ -47,39 +64,96 @@
 void *
 memcpy(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	unsigned char *d = dst;
+	const unsigned char *s = src;
 
 	/*
 	 * memcpy does not support overlapping buffers, so always do it
 	 * forwards. (Don't change this without adjusting memmove.)
 	 *
-	 * For speedy copying, optimize the common case where both pointers
-	 * and the length are word-aligned, and copy word-at-a-time instead
-	 * of byte-at-a-time. Otherwise, copy by bytes.
+	 * For anything but short copies, copy bytes until the
+	 * destination is word-aligned, then copy words: eight at a
+	 * time while there are that many, then one at a time, then
+	 * the remaining bytes.
 	 *
-	 * The alignment logic below should be portable. We rely on
-	 * the compiler to be reasonably intelligent about optimizing
-	 * the divides and modulos out. Fortunately, it is.
+	 * If the source isn't aligned the same way as the destination,
+	 * read aligned source words anyway and shift each pair
+	 * together into one destination word. This reads a few bytes
+	 * beyond either end of the source, but never outside the
+	 * words (and so pages) the source touches.
+	 *
+	 * Every source word is read before the destination word that
+	 * might overlap it is written, so copying downwards within
+	 * one buffer (as memmove does) is safe.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	if (len >= 4 * WSIZE) {
+		unsigned long *dw;
+
+		while ((uintptr_t)d & WMASK) {
+			*d++ = *s++;
+			len--;
+		}
+		dw = (unsigned long *)d;
+
+		if (((uintptr_t)s & WMASK) == 0) {
+			const unsigned long *sw = (const unsigned long *)s;
 
-		long *d = dst;
-		const long *s = src;
+			while (len >= 8 * WSIZE) {
+				dw[0] = sw[0];
+				dw[1] = sw[1];
+				dw[2] = sw[2];
+				dw[3] = sw[3];
+				dw[4] = sw[4];
+				dw[5] = sw[5];
+				dw[6] = sw[6];
+				dw[7] = sw[7];
+				dw += 8;
+				sw += 8;
+				len -= 8 * WSIZE;
+			}
+			while (len >= WSIZE) {
+				*dw++ = *sw++;
+				len -= WSIZE;
+			}
+			s = (const unsigned char *)sw;
+		}
+		else {
+			unsigned off = (uintptr_t)s & WMASK;
+			unsigned sh = off * 8;
+			const unsigned long *sw;
+			unsigned long a, b;
 
-		for (i=0; i<len/sizeof(long); i++) {
-			d[i] = s[i];
+			sw = (const unsigned long *)(s - off);
+			a = *sw++;
+			while (len >= 4 * WSIZE) {
+				b = sw[0];
+				dw[0] = MERGE(a, b, sh);
+				a = sw[1];
+				dw[1] = MERGE(b, a, sh);
+				b = sw[2];
+				dw[2] = MERGE(a, b, sh);
+				a = sw[3];
+				dw[3] = MERGE(b, a, sh);
+				dw += 4;
+				sw += 4;
+				len -= 4 * WSIZE;
+			}
+			while (len >= WSIZE) {
+				b = *sw++;
+				*dw++ = MERGE(a, b, sh);
+				a = b;
+				len -= WSIZE;
+			}
+			/* A is the word before SW; we're OFF bytes into it */
+			s = (const unsigned char *)(sw - 1) + off;
 		}
+		d = (unsigned char *)dw;
 	}
-	else {
-		char *d = dst;
-		const char *s = src;
 
-		for (i=0; i<len; i++) {
-			d[i] = s[i];
-		}
+	while (len > 0) {
+		*d++ = *s++;
+		len--;
 	}
 
 	return dst;
@@ -34,10 +34,23 @@
 
 #ifdef _KERNEL
 #include <types.h>
+#include <endian.h>
 #include <lib.h>
 #else
 #include <stdint.h>
 #include <string.h>
+#include <sys/endian.h>
+#endif
+
+/* See memcpy.c */
+#define WSIZE	sizeof(unsigned long)
+#define WMASK	(WSIZE - 1)
+#define WBITS	(WSIZE * 8)
+
+#if _BYTE_ORDER == _BIG_ENDIAN
+#define MERGE(a, b, sh)	(((a) << (sh)) | ((b) >> (WBITS - (sh))))
+#else
+#define MERGE(a, b, sh)	(((a) >> (sh)) | ((b) << (WBITS - (sh))))
 #endif
 
 /*
@@ -48,12 +61,13 @@
 void *
 memmove(void *dst, const void *src, size_t len)
 {
-	size_t i;
+	unsigned char *d;
+	const unsigned char *s;
 
 	/*
 	 * If the buffers don't overlap, it doesn't matter what direction
-	 * we copy in. If they do, it does, so just assume they always do.
-	 * We don't concern ourselves with the possibility that the region
+	 * we copy in, so copy forwards. If they do, it does. We don't
+	 * concern ourselves with the possibility that the region
 	 * to copy might roll over across the top of memory, because it's
 	 * not going to happen.
 	 *
@@ -75,7 +89,8 @@ memmove(void *dst, const void *src, size_t len)
          *                     |___|
 	 */
 
-	if ((uintptr_t)dst < (uintptr_t)src) {
+	if ((uintptr_t)dst < (uintptr_t)src ||
+	    (uintptr_t)dst >= (uintptr_t)src + len) {
 		/*
 		 * As author/maintainer of libc, take advantage of the
 		 * fact that we know memcpy copies forwards.
@@ -84,33 +99,82 @@ memmove(void *dst, const void *src, size_t len)
 	}
 
 	/*
-	 * Copy by words in the common case. Look in memcpy.c for more
-	 * information.
+	 * Copy backwards, by words in the same way memcpy copies
+	 * forwards; look in memcpy.c for more information. Here too
+	 * every source word is read before the destination word that
+	 * might overlap it is written.
 	 */
 
-	if ((uintptr_t)dst % sizeof(long) == 0 &&
-	    (uintptr_t)src % sizeof(long) == 0 &&
-	    len % sizeof(long) == 0) {
+	d = (unsigned char *)dst + len;
+	s = (const unsigned char *)src + len;
 
-		long *d = dst;
-		const long *s = src;
+	if (len >= 4 * WSIZE) {
+		unsigned long *dw;
 
-		/*
-		 * The reason we copy index i-1 and test i>0 is that
-		 * i is unsigned -- so testing i>=0 doesn't work.
-		 */
+		while ((uintptr_t)d & WMASK) {
+			*--d = *--s;
+			len--;
+		}
+		dw = (unsigned long *)d;
+
+		if (((uintptr_t)s & WMASK) == 0) {
+			const unsigned long *sw = (const unsigned long *)s;
 
-		for (i=len/sizeof(long); i>0; i--) {
-			d[i-1] = s[i-1];
+			while (len >= 8 * WSIZE) {
+				dw -= 8;
+				sw -= 8;
+				dw[7] = sw[7];
+				dw[6] = sw[6];
+				dw[5] = sw[5];
+				dw[4] = sw[4];
+				dw[3] = sw[3];
+				dw[2] = sw[2];
+				dw[1] = sw[1];
+				dw[0] = sw[0];
+				len -= 8 * WSIZE;
+			}
+			while (len >= WSIZE) {
+				*--dw = *--sw;
+				len -= WSIZE;
+			}
+			s = (const unsigned char *)sw;
 		}
-	}
-	else {
-		char *d = dst;
-		const char *s = src;
+		else {
+			unsigned off = (uintptr_t)s & WMASK;
+			unsigned sh = off * 8;
+			const unsigned long *sw;
+			unsigned long a, b;
 
-		for (i=len; i>0; i--) {
-			d[i-1] = s[i-1];
+			/* B is always the word at SW; we're OFF bytes into it */
+			sw = (const unsigned long *)(s - off);
+			b = *sw;
+			while (len >= 4 * WSIZE) {
+				dw -= 4;
+				sw -= 4;
+				a = sw[3];
+				dw[3] = MERGE(a, b, sh);
+				b = sw[2];
+				dw[2] = MERGE(b, a, sh);
+				a = sw[1];
+				dw[1] = MERGE(a, b, sh);
+				b = sw[0];
+				dw[0] = MERGE(b, a, sh);
+				len -= 4 * WSIZE;
+			}
+			while (len >= WSIZE) {
+				a = *--sw;
+				*--dw = MERGE(a, b, sh);
+				b = a;
+				len -= WSIZE;
+			}
+			s = (const unsigned char *)sw + off;
 		}
+		d = (unsigned char *)dw;
+	}
+
+	while (len > 0) {
+		*--d = *--s;
+		len--;
 	}
 
 	return dst;
@@ -31,9 +31,13 @@
 #include <types.h>
 #include <lib.h>
 #else
+#include <stdint.h>
 #include <string.h>
 #endif
 
+#define WSIZE	sizeof(unsigned long)
+#define WMASK	(WSIZE - 1)
+
 /*
  * C standard function - initialize a block of memory
  */
@@ -41,11 +45,55 @@
 void *
 memset(void *ptr, int ch, size_t len)
 {
-	char *p = ptr;
-	size_t i;
+	unsigned char *p = ptr;
+
+	/*
+	 * As in memcpy, for anything but short blocks set bytes until
+	 * the pointer is word-aligned, then store whole words of the
+	 * fill byte, eight at a time and then one at a time, then set
+	 * the remaining bytes.
+	 */
+
+	if (len >= 4 * WSIZE) {
+		unsigned long *pw;
+		unsigned long w;
+
+		while ((uintptr_t)p & WMASK) {
+			*p++ = ch;
+			len--;
+		}
+
+		w = (unsigned char)ch;
+		w |= w << 8;
+		w |= w << 16;
+		if (WSIZE > 4) {
+			/* (two shifts, as shifting by the word size is undefined) */
+			w |= (w << 16) << 16;
+		}
+
+		pw = (unsigned long *)p;
+		while (len >= 8 * WSIZE) {
+			pw[0] = w;
+			pw[1] = w;
+			pw[2] = w;
+			pw[3] = w;
+			pw[4] = w;
+			pw[5] = w;
+			pw[6] = w;
+			pw[7] = w;
+			pw += 8;
+			len -= 8 * WSIZE;
+		}
+		while (len >= WSIZE) {
+			*pw++ = w;
+			len -= WSIZE;
+		}
+		p = (unsigned char *)pw;
+	}
 
-	for (i=0; i<len; i++) {
-		p[i] = ch;
+	while (len > 0) {
+		*p++ = ch;
+		len--;
 	}
 
 	return ptr;
@@ -125,16 +125,22 @@ paddr_t ram_getfirstfree(void);
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown drops one page of an address space, or all of its
+ * pages (ts_vaddr == TLBSHOOTDOWN_ALL), from the target CPU's TLB and
+ * then sets *ts_done. The sender waits for that, so ts_as and ts_done
+ * may point into its stack frame.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;
+	vaddr_t ts_vaddr;
+	volatile int *ts_done;
 };
 
+#define TLBSHOOTDOWN_ALL ((vaddr_t)-1)
+
 #define TLBSHOOTDOWN_MAX 16
 
 
@@ -36,6 +36,8 @@
 #include <thread.h>
 #include <current.h>
 #include <copyinout.h>
+#include <cpu.h>
+#include <kstat.h>
 #include <syscall.h>
 
 
@@ -83,11 +85,13 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+	uint32_t start;
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
 	KASSERT(curthread->t_iplhigh_count == 0);
 
+	start = cpu_cycles();
 	callno = tf->tf_v0;
 
 	/*
@@ -138,10 +142,18 @@ syscall(struct trapframe *tf)
 			&retval);
 		break;
 
+	    case SYS_nice:
+		err = sys_nice(tf->tf_a0, &retval);
+		break;
+
 	    case SYS_getpid:
 		err = sys_getpid(&retval);
 		break;
 
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
 
 	    /* file calls */
 
@@ -178,6 +190,42 @@ syscall(struct trapframe *tf)
 			tf->tf_a2,
 			&retval);
 		break;
+	    case SYS_readv:
+		err = sys_readv(
+			tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			tf->tf_a2,
+			&retval);
+		break;
+	    case SYS_writev:
+		err = sys_writev(
+			tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			tf->tf_a2,
+			&retval);
+		break;
+	    case SYS_pread:
+	    case SYS_pwrite:
+		{
+			/*
+			 * As with mmap, the 64-bit position would need an
+			 * aligned register pair and a2 is taken by the
+			 * size, so it is passed on the stack.
+			 */
+			off_t pos;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &pos, sizeof(off_t));
+			if (err) {
+				break;
+			}
+			err = (callno == SYS_pread) ?
+				sys_pread(tf->tf_a0, (userptr_t)tf->tf_a1,
+					  tf->tf_a2, pos, &retval) :
+				sys_pwrite(tf->tf_a0, (userptr_t)tf->tf_a1,
+					   tf->tf_a2, pos, &retval);
+		}
+		break;
 	    case SYS_lseek:
 		{
 			/*
@@ -261,6 +309,28 @@ syscall(struct trapframe *tf)
 		}
 		break;
 
+	    case SYS_mmap:
+		{
+			/*
+			 * The offset is 64 bits and would need an aligned
+			 * register pair; a2 is taken by the fd, so it is
+			 * passed on the stack.
+			 */
+			off_t offset;
+
+			err = copyin((userptr_t)tf->tf_sp + 16,
+				     &offset, sizeof(off_t));
+			if (err) {
+				break;
+			}
+			err = sys_mmap(tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				       offset, &retval);
+		}
+		break;
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0);
+		break;
+
 
 
 	    default:
@@ -292,6 +362,8 @@ syscall(struct trapframe *tf)
 
 	tf->tf_epc += 4;
 
+	kstat_syscall(callno, start);
+
 	/* Make sure the syscall code didn't forget to lower spl */
 	KASSERT(curthread->t_curspl == 0);
 	/* ...or leak any spinlocks */
@@ -147,6 +147,50 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+/*
+ * Frames are never freed, so there is nothing to count. These exist
+ * for the sfs mmap page cache, which dumbvm never uses.
+ */
+void
+frame_incref(paddr_t paddr)
+{
+	(void)paddr;
+}
+
+unsigned
+frame_refcount(paddr_t paddr)
+{
+	(void)paddr;
+	return 1;
+}
+
+void
+frame_setcached(paddr_t paddr)
+{
+	(void)paddr;
+}
+
+/*
+ * No pre-zeroed pool here; zeroed pages are cleared on demand.
+ */
+bool
+frame_prezero(void)
+{
+	return false;
+}
+
+vaddr_t
+alloc_zeroed_kpage(void)
+{
+	vaddr_t addr;
+
+	addr = alloc_kpages(1);
+	if (addr != 0) {
+		page_zero(addr);
+	}
+	return addr;
+}
+
 #endif
 
 void
@@ -402,6 +446,38 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	/* dumbvm has no heap */
+	(void)as;
+	(void)amount;
+	(void)oldbreak;
+	return ENOSYS;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, size_t len, bool writeable,
+	off_t offset, vaddr_t *addr)
+{
+	/* nor mmap */
+	(void)as;
+	(void)v;
+	(void)len;
+	(void)writeable;
+	(void)offset;
+	(void)addr;
+	return ENOSYS;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr)
+{
+	(void)as;
+	(void)addr;
+	return ENOSYS;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -32,6 +32,9 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 
 vaddr_t firstfree;   /* first free virtual address; set by start.S */
 
@@ -43,6 +46,13 @@ static paddr_t lastpaddr;   /* one past end of last free physical page */
 typedef struct ft_entry {
         unsigned allocated:1; /* the corresponding frame is allocated */
         unsigned not_last:1; /* the frame is part of a multiframe allocation */
+        unsigned referenced:1; /* mapped into the TLB since the clock hand passed */
+        unsigned cached:1; /* one of the owners is a file's page cache */
+        unsigned refcount:28; /* number of owners sharing the frame (COW) */
+        uint32_t next_free; /* free list links (frame numbers, 0 = none) */
+        uint32_t prev_free;
+        struct addrspace *owner; /* reverse mapping of an evictable user */
+        vaddr_t owner_vaddr;     /* frame, NULL for kernel/shared frames */
 } ft_entry_t;
 
 
@@ -50,10 +60,56 @@ static ft_entry_t * frame_table = NULL; /* base of frame table */
 static uint32_t first_frame;
 static uint32_t last_frame;
 
+/*
+ * Free frames are kept on a doubly linked list threaded through the
+ * frame table, so single frames come off the head in O(1) and a
+ * multiframe allocation can unlink the frames it claims from
+ * anywhere in the list. Frame 0 always belongs to the kernel, so 0
+ * doubles as the list terminator.
+ */
+static uint32_t free_head;
+static uint32_t free_count;
+static uint32_t contig_cursor;  /* next-fit start for multiframe scans */
+static uint32_t clock_hand;     /* page replacement position */
+
 #define PAGE_BITS 12
 #define TRUE 1
 #define FALSE 0
 
+/*
+ * Per-CPU caches of single frames. A cached frame is marked allocated
+ * in the frame table (so multiframe scans skip it) with a refcount of
+ * 0; it gets its owner when handed out. Caches are only touched by
+ * their own CPU with interrupts off, so they need no lock; they are
+ * refilled from and flushed to the free list in batches.
+ */
+#define FRAME_CACHE_SIZE  16
+#define FRAME_CACHE_BATCH 8
+
+struct frame_cache {
+        unsigned fc_count;
+        uint32_t fc_frames[FRAME_CACHE_SIZE];
+};
+
+static struct frame_cache frame_caches[MAXCPUS];
+
+/*
+ * Pool of pre-zeroed single frames. Idle CPUs top it up one frame at
+ * a time through frame_prezero(), and alloc_zeroed_kpage() hands them
+ * out so the fault path doesn't have to clear pages itself. Pooled
+ * frames are marked allocated with a refcount of 0, like cached ones.
+ * The pool is only filled while more than ZERO_POOL_RESERVE frames are
+ * free, and gives its frames back when memory runs out. Protected by
+ * frame_table_spinlock.
+ */
+#define ZERO_POOL_SIZE    64    /* high watermark */
+#define ZERO_POOL_RESERVE 32    /* free frames the pool leaves alone */
+
+static uint32_t zero_pool[ZERO_POOL_SIZE];
+static unsigned zero_pool_count;
+static unsigned zero_pool_hits;         /* zeroed allocs served from the pool */
+static unsigned zero_pool_misses;       /* zeroed allocs that had to clear */
+
 
 /* frame_table protected by spinlock (interrupt disabling on
  * uniprocessor) as this implementation does not block.
@@ -130,6 +186,11 @@ ram_bootstrap(void)
                 /* Mark as allocated as individual pages */
                 frame_table[i].allocated = TRUE;
                 frame_table[i].not_last = FALSE;
+                frame_table[i].refcount = 1;
+                frame_table[i].cached = FALSE;
+                frame_table[i].next_free = 0;
+                frame_table[i].prev_free = 0;
+                frame_table[i].owner = NULL;
         }                                            
         
         /* 
@@ -138,8 +199,25 @@ ram_bootstrap(void)
         
         first_frame = firstpaddr >> PAGE_BITS;
         
-        for (i = first_frame; i < (lastpaddr >> PAGE_BITS); i++) {
+        free_head = 0;
+        free_count = 0;
+        contig_cursor = first_frame;
+        clock_hand = first_frame;
+
+        /* push in reverse so the list hands out low frames first */
+        for (i = (lastpaddr >> PAGE_BITS); i-- > first_frame; ) {
                 frame_table[i].allocated = FALSE;
+                frame_table[i].not_last = FALSE;
+                frame_table[i].refcount = 0;
+                frame_table[i].cached = FALSE;
+                frame_table[i].owner = NULL;
+                frame_table[i].prev_free = 0;
+                frame_table[i].next_free = free_head;
+                if (free_head != 0) {
+                        frame_table[free_head].prev_free = i;
+                }
+                free_head = i;
+                free_count++;
         }
 
         
@@ -189,59 +267,172 @@ ram_getfirstfree(void)
 }
 
 /*
- * This is a relatively inefficient first-fit allocator. Single pages
- * always fit. Multiframe allocations can suffer from external
- * fragmentation. It is intended to be easy to understand and robust,
- * not efficient.
+ * Free list primitives. Caller holds frame_table_spinlock.
  */
 
+static void free_list_push(uint32_t i)
+{
+        frame_table[i].allocated = FALSE;
+        frame_table[i].not_last = FALSE;
+        frame_table[i].refcount = 0;
+        frame_table[i].cached = FALSE;
+        frame_table[i].owner = NULL;
+        frame_table[i].prev_free = 0;
+        frame_table[i].next_free = free_head;
+        if (free_head != 0) {
+                frame_table[free_head].prev_free = i;
+        }
+        free_head = i;
+        free_count++;
+}
 
-static paddr_t alloc_one_frame(unsigned int npages)
+static void free_list_unlink(uint32_t i)
 {
-        unsigned int i;
+        uint32_t prev = frame_table[i].prev_free;
+        uint32_t next = frame_table[i].next_free;
 
-        /* 
-         * Just scan from the start of the frame_table array for an
-         * unallocated block
-         */
-        
-        KASSERT(npages == 1);
+        KASSERT(frame_table[i].allocated == FALSE);
 
-        spinlock_acquire(&frame_table_spinlock);
-        for (i =  first_frame; i < last_frame; i++) {
-                if (frame_table[i].allocated == FALSE) {
-                        frame_table[i].allocated = TRUE;
-                        frame_table[i].not_last = FALSE;
+        if (prev != 0) {
+                frame_table[prev].next_free = next;
+        }
+        else {
+                free_head = next;
+        }
+        if (next != 0) {
+                frame_table[next].prev_free = prev;
+        }
+        frame_table[i].allocated = TRUE;
+        frame_table[i].not_last = FALSE;
+        frame_table[i].refcount = 1;
+        free_count--;
+}
 
-                        spinlock_release(&frame_table_spinlock);
+/*
+ * Put every pre-zeroed frame back on the free list. Caller holds
+ * frame_table_spinlock.
+ */
+static void zero_pool_flush(void)
+{
+        while (zero_pool_count > 0) {
+                free_list_push(zero_pool[--zero_pool_count]);
+        }
+}
 
-                        return (paddr_t) (i << PAGE_BITS);
-                }
+/*
+ * Refill an empty per-CPU cache with up to FRAME_CACHE_BATCH frames.
+ * Called with interrupts off.
+ */
+static void frame_cache_refill(struct frame_cache *fc)
+{
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+        while (fc->fc_count < FRAME_CACHE_BATCH && free_head != 0) {
+                i = free_head;
+                free_list_unlink(i);
+                frame_table[i].refcount = 0;
+                fc->fc_frames[fc->fc_count++] = i;
         }
-        
-        /* Did not find an unallocated frame :-( */
+        spinlock_release(&frame_table_spinlock);
+}
 
+/*
+ * Return frames from a per-CPU cache to the free list, keeping KEEP
+ * of them. Called with interrupts off.
+ */
+static void frame_cache_flush(struct frame_cache *fc, unsigned keep)
+{
+        spinlock_acquire(&frame_table_spinlock);
+        while (fc->fc_count > keep) {
+                free_list_push(fc->fc_frames[--fc->fc_count]);
+        }
         spinlock_release(&frame_table_spinlock);
-        return (paddr_t) 0;
 }
 
-static paddr_t alloc_multiple_frames(unsigned int npages)
+/* This CPU's frame cache, or NULL during early boot. */
+static struct frame_cache *frame_cache_get(void)
 {
-        unsigned int i,j;
+        if (!CURCPU_EXISTS()) {
+                return NULL;
+        }
+        KASSERT(curcpu->c_number < MAXCPUS);
+        return &frame_caches[curcpu->c_number];
+}
 
+static paddr_t alloc_one_frame(unsigned int npages)
+{
+        struct frame_cache *fc;
+        uint32_t i = 0;
+        int spl;
 
-        /* scan from 'i' for the number of needed free frames. If an
-         * allocated frame is encountered, restart the scan from after
-         * that point.
-         */
-        
+        KASSERT(npages == 1);
+
+        /* fast path: this CPU's cache, no lock needed */
+        spl = splhigh();
+        fc = frame_cache_get();
+        if (fc != NULL) {
+                if (fc->fc_count == 0) {
+                        frame_cache_refill(fc);
+                }
+                if (fc->fc_count > 0) {
+                        i = fc->fc_frames[--fc->fc_count];
+                        frame_table[i].refcount = 1;
+                }
+        }
+        splx(spl);
 
+        if (i != 0) {
+                return (paddr_t) (i << PAGE_BITS);
+        }
+
+        /* no cache yet (early boot) or the free list ran dry */
         spinlock_acquire(&frame_table_spinlock);
+        if (free_head != 0) {
+                i = free_head;
+                free_list_unlink(i);
+        }
+        else if (zero_pool_count > 0) {
+                /* a zeroed frame is still a frame */
+                i = zero_pool[--zero_pool_count];
+                frame_table[i].refcount = 1;
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        /* i is still 0 if we did not find an unallocated frame :-( */
+        return (paddr_t) (i << PAGE_BITS);
+}
 
-        i = first_frame; j = 0;
+/*
+ * Next-fit scan for NPAGES contiguous free frames, starting from
+ * where the last multiframe allocation ended. Caller holds
+ * frame_table_spinlock. Returns the first frame number, or 0.
+ */
+static uint32_t find_contig_frames(unsigned int npages)
+{
+        uint32_t start, i, j, scanned, limit;
 
-        while (i < (last_frame - npages) && j < npages) {
+        if (free_count < npages) {
+                return 0;
+        }
+
+        limit = last_frame - first_frame;
+        start = contig_cursor;
+        if (start < first_frame || start + npages > last_frame) {
+                start = first_frame;
+        }
+
+        i = start; j = 0; scanned = 0;
+        while (scanned < limit && j < npages) {
+                if (i + npages > last_frame) {
+                        /* wrap around; a run cannot straddle the end */
+                        scanned += last_frame - i;
+                        i = first_frame;
+                        j = 0;
+                        continue;
+                }
                 if (frame_table[i+j].allocated == TRUE) {
+                        scanned += j + 1;
                         i = i + j + 1; /* continue scan after allocated frame */
                         j = 0;         /* restart the count */
                 }
@@ -250,13 +441,41 @@ static paddr_t alloc_multiple_frames(unsigned int npages)
                 }
         }
 
-        if  (j == npages) { /* we exited as we found the number of frames required. */
+        return (j == npages) ? i : 0;
+}
+
+static paddr_t alloc_multiple_frames(unsigned int npages)
+{
+        struct frame_cache *fc;
+        unsigned int i,j;
+        int spl;
+
+        spinlock_acquire(&frame_table_spinlock);
+
+        i = find_contig_frames(npages);
+        if (i == 0) {
+                /* frames parked in our cache may be in the way */
+                spinlock_release(&frame_table_spinlock);
+                spl = splhigh();
+                fc = frame_cache_get();
+                if (fc != NULL) {
+                        frame_cache_flush(fc, 0);
+                }
+                splx(spl);
+                spinlock_acquire(&frame_table_spinlock);
+
+                /* and so may the pre-zeroed pool */
+                zero_pool_flush();
+                i = find_contig_frames(npages);
+        }
+
+        if  (i != 0) { /* we found the number of frames required. */
                 for (j = i; j < i + npages - 1; j++) {
-                        frame_table[j].allocated = TRUE; /* mark frame allocated */
+                        free_list_unlink(j);             /* mark frame allocated */
                         frame_table[j].not_last = TRUE;  /* as a contiguous block */
                 }
-                frame_table[j].allocated = TRUE;
-                frame_table[j].not_last = FALSE;
+                free_list_unlink(j);
+                contig_cursor = j + 1;
 
                 spinlock_release(&frame_table_spinlock);
                 
@@ -271,8 +490,10 @@ static paddr_t alloc_multiple_frames(unsigned int npages)
 
 static void free_frames(vaddr_t vaddr)
 {
+        struct frame_cache *fc;
         paddr_t paddr;
         uint32_t i;
+        int spl;
 
         KASSERT(vaddr != (vaddr_t) NULL);
 
@@ -280,20 +501,156 @@ static void free_frames(vaddr_t vaddr)
 
         i = paddr >> PAGE_BITS;
 
+        /*
+         * Fast path: a single frame with one owner goes back to this
+         * CPU's cache. The unlocked refcount read is safe: only an
+         * owner can add owners, and we are the only one.
+         */
+        spl = splhigh();
+        fc = frame_cache_get();
+        if (fc != NULL && frame_table[i].allocated == TRUE &&
+            frame_table[i].not_last == FALSE &&
+            frame_table[i].refcount == 1) {
+                frame_table[i].refcount = 0;
+                frame_table[i].cached = FALSE;
+                frame_table[i].owner = NULL;
+                if (fc->fc_count == FRAME_CACHE_SIZE) {
+                        frame_cache_flush(fc, FRAME_CACHE_SIZE - FRAME_CACHE_BATCH);
+                }
+                fc->fc_frames[fc->fc_count++] = i;
+                splx(spl);
+                return;
+        }
+        splx(spl);
+
         spinlock_acquire(&frame_table_spinlock);
 
-        if (frame_table[i].allocated == FALSE) { /* check for double free error */
+        if (frame_table[i].allocated == FALSE ||
+            frame_table[i].refcount == 0) { /* check for double free error */
                 panic("Double free error!!");
         }
+
+        /* a shared frame just loses one owner */
+        if (frame_table[i].refcount > 1) {
+                KASSERT(frame_table[i].not_last == FALSE);
+                frame_table[i].refcount--;
+                spinlock_release(&frame_table_spinlock);
+                return;
+        }
         
-        while (frame_table[i].allocated == TRUE) { /* otherwise mark block free */
-                frame_table[i].allocated = FALSE;
-                if (frame_table[i].not_last == TRUE) {
-                        i++;
+        for (;;) { /* otherwise mark block free */
+                bool more = frame_table[i].not_last;
+
+                free_list_push(i);
+                if (!more) {
+                        break;
                 }
+                i++;
         }
         spinlock_release(&frame_table_spinlock);
 }
+
+/*
+ * Report frame usage for statistics and tests. Frames sitting in the
+ * per-CPU caches or the pre-zeroed pool count as free.
+ */
+void
+frame_getstats(unsigned *total, unsigned *nfree)
+{
+        unsigned cached = 0;
+        unsigned c;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (c = 0; c < MAXCPUS; c++) {
+                cached += frame_caches[c].fc_count;
+        }
+        *total = last_frame - first_frame;
+        *nfree = free_count + cached + zero_pool_count;
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Zero one free frame into the pre-zeroed pool, for the idle loop.
+ * The frame is cleared without the lock held. Returns false if the
+ * pool is full or free frames are short, so there was nothing to do.
+ */
+bool
+frame_prezero(void)
+{
+        uint32_t i;
+
+        spinlock_acquire(&frame_table_spinlock);
+        if (zero_pool_count == ZERO_POOL_SIZE ||
+            free_count <= ZERO_POOL_RESERVE) {
+                spinlock_release(&frame_table_spinlock);
+                return false;
+        }
+        i = free_head;
+        free_list_unlink(i);
+        frame_table[i].refcount = 0;
+        spinlock_release(&frame_table_spinlock);
+
+        page_zero(PADDR_TO_KVADDR((paddr_t) (i << PAGE_BITS)));
+
+        spinlock_acquire(&frame_table_spinlock);
+        if (zero_pool_count < ZERO_POOL_SIZE) {
+                zero_pool[zero_pool_count++] = i;
+        }
+        else {
+                /* another CPU filled the pool meanwhile */
+                free_list_push(i);
+        }
+        spinlock_release(&frame_table_spinlock);
+        return true;
+}
+
+/*
+ * Allocate one zeroed page: from the pre-zeroed pool if it has any,
+ * otherwise an ordinary page cleared here.
+ */
+vaddr_t
+alloc_zeroed_kpage(void)
+{
+        vaddr_t vaddr;
+        uint32_t i = 0;
+
+        spinlock_acquire(&frame_table_spinlock);
+        if (zero_pool_count > 0) {
+                i = zero_pool[--zero_pool_count];
+                frame_table[i].refcount = 1;
+                zero_pool_hits++;
+        }
+        else {
+                zero_pool_misses++;
+        }
+        spinlock_release(&frame_table_spinlock);
+
+        if (i != 0) {
+                return PADDR_TO_KVADDR((paddr_t) (i << PAGE_BITS));
+        }
+
+        vaddr = alloc_kpages(1);
+        if (vaddr != 0) {
+                page_zero(vaddr);
+        }
+        return vaddr;
+}
+
+/* Print pre-zeroed pool statistics (kernel menu) */
+void
+frame_printstats(void)
+{
+        unsigned count, hits, misses;
+
+        spinlock_acquire(&frame_table_spinlock);
+        count = zero_pool_count;
+        hits = zero_pool_hits;
+        misses = zero_pool_misses;
+        spinlock_release(&frame_table_spinlock);
+
+        kprintf("vm: pre-zeroed pool %u/%u frames, %u allocs served, "
+                "%u cleared on demand\n", count, ZERO_POOL_SIZE, hits, misses);
+}
         
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t
@@ -319,3 +676,146 @@ free_kpages(vaddr_t addr)
         free_frames(addr);
 }
 
+/*
+ * Reference counting for frames shared copy-on-write between address
+ * spaces. A frame starts with one owner when allocated; free_kpages()
+ * drops one owner and only releases the frame when the last one goes.
+ */
+void
+frame_incref(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].not_last == FALSE);
+        frame_table[i].refcount++;
+        /* a shared frame has no single owner to page it out for */
+        frame_table[i].owner = NULL;
+        spinlock_release(&frame_table_spinlock);
+}
+
+unsigned
+frame_refcount(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        unsigned count;
+
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        count = frame_table[i].refcount;
+        spinlock_release(&frame_table_spinlock);
+        return count;
+}
+
+/*
+ * Mark PADDR as held by a file's page cache, which keeps one reference
+ * of its own. The clock can then take the frame away from a single
+ * mapping: the PTE goes and the page stays cached. The mark goes when
+ * the frame is freed.
+ */
+void
+frame_setcached(paddr_t paddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        KASSERT(frame_table[i].not_last == FALSE);
+        frame_table[i].cached = TRUE;
+        spinlock_release(&frame_table_spinlock);
+}
+
+/*
+ * Record that user frame PADDR was just mapped at VADDR in AS. This
+ * sets the reference bit for the clock and, for frames mapped only
+ * there (unshared, or shared only with a page cache), the reverse
+ * mapping page replacement uses to find the owning PTE.
+ * Returns the frame's refcount, saving the TLB refill path a second
+ * trip through the lock.
+ */
+unsigned
+frame_touch(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+        uint32_t i = paddr >> PAGE_BITS;
+        unsigned count;
+
+        KASSERT(i >= first_frame && i < last_frame);
+
+        spinlock_acquire(&frame_table_spinlock);
+        KASSERT(frame_table[i].allocated == TRUE);
+        frame_table[i].referenced = TRUE;
+        if (frame_table[i].refcount - frame_table[i].cached == 1) {
+                frame_table[i].owner = as;
+                frame_table[i].owner_vaddr = vaddr;
+        }
+        else {
+                frame_table[i].owner = NULL;
+        }
+        count = frame_table[i].refcount;
+        spinlock_release(&frame_table_spinlock);
+        return count;
+}
+
+/*
+ * Clock (second chance) page replacement. Sweep the frame table for
+ * a user frame mapped in one place whose reference bit is clear: an
+ * unshared frame, or a page cache frame with one mapping, which the
+ * caller unmaps rather than pages out; with CACHEDONLY, only those
+ * (there's no swap to page out to). Referenced
+ * frames get their bit cleared and their TLB entry dropped, so the
+ * next access faults and sets the bit again.
+ *
+ * The chosen frame loses its reverse mapping, so it will not be
+ * picked twice; the caller pages it out and frees it, or hands it
+ * back with frame_touch(). Returns 0 if no frame can be evicted.
+ */
+paddr_t
+frame_pick_victim(bool cachedonly, struct addrspace **as, vaddr_t *vaddr)
+{
+        uint32_t i, scanned, nframes;
+        ft_entry_t *fe;
+
+        nframes = last_frame - first_frame;
+
+        spinlock_acquire(&frame_table_spinlock);
+        for (scanned = 0; scanned < 2 * nframes; scanned++) {
+                i = clock_hand;
+                clock_hand++;
+                if (clock_hand >= last_frame) {
+                        clock_hand = first_frame;
+                }
+
+                fe = &frame_table[i];
+                if (fe->allocated == FALSE || fe->owner == NULL ||
+                    fe->refcount - fe->cached != 1 ||
+                    fe->not_last == TRUE ||
+                    (cachedonly && fe->cached == FALSE)) {
+                        continue;
+                }
+                if (fe->referenced == TRUE) {
+                        /*
+                         * Drop the entry so the next access faults
+                         * and sets the bit again. This is only a
+                         * hint, and a shootdown can't wait under the
+                         * spinlock, so an entry on another cpu stays.
+                         */
+                        fe->referenced = FALSE;
+                        vm_tlb_unmap_local(fe->owner, fe->owner_vaddr);
+                        continue;
+                }
+
+                *as = fe->owner;
+                *vaddr = fe->owner_vaddr;
+                fe->owner = NULL;
+                spinlock_release(&frame_table_spinlock);
+                return (paddr_t) (i << PAGE_BITS);
+        }
+        spinlock_release(&frame_table_spinlock);
+        return 0;
+}
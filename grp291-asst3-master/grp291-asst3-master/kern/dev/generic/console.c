@@ -55,6 +55,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -109,19 +110,128 @@ flush_delay_buf(void)
 
 //////////////////////////////////////////////////
 
+/*
+ * Number of characters in the input and output rings.
+ */
+static
+unsigned
+con_gotcount(struct con_softc *cs)
+{
+	return (cs->cs_gotchars_head + CONSOLE_INPUT_BUFFER_SIZE
+		- cs->cs_gotchars_tail) % CONSOLE_INPUT_BUFFER_SIZE;
+}
+
+static
+unsigned
+con_sendcount(struct con_softc *cs)
+{
+	return (cs->cs_sendchars_head + CONSOLE_OUTPUT_BUFFER_SIZE
+		- cs->cs_sendchars_tail) % CONSOLE_OUTPUT_BUFFER_SIZE;
+}
+
+/*
+ * Take the next character out of the input ring.
+ */
+static
+int
+con_takechar(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_lock));
+	KASSERT(cs->cs_gotchars_head != cs->cs_gotchars_tail);
+
+	ch = cs->cs_gotchars[cs->cs_gotchars_tail];
+	cs->cs_gotchars_tail =
+		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	if (ch == '\r' || ch == '\n') {
+		KASSERT(cs->cs_gotlines > 0);
+		cs->cs_gotlines--;
+	}
+	return ch;
+}
+
+/*
+ * If the device is idle, hand it the next character from the output
+ * ring.
+ */
+static
+void
+con_kick(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_lock));
+
+	if (cs->cs_sending || cs->cs_sendchars_head == cs->cs_sendchars_tail) {
+		return;
+	}
+	ch = cs->cs_sendchars[cs->cs_sendchars_tail];
+	cs->cs_sendchars_tail =
+		(cs->cs_sendchars_tail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_sending = true;
+	cs->cs_send(cs->cs_devdata, ch);
+}
+
+//////////////////////////////////////////////////
+
 /*
  * Print a character, using polling instead of interrupts to wait for
  * I/O completion.
+ *
+ * Whatever is still in the output ring goes out first, so output
+ * stays in order. (Unless this cpu is already inside the console
+ * code, e.g. panicking there; then it would deadlock.)
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	bool drain;
+
+	drain = !spinlock_do_i_hold(&cs->cs_lock);
+	if (drain) {
+		spinlock_acquire(&cs->cs_lock);
+		while (cs->cs_sendchars_head != cs->cs_sendchars_tail) {
+			cs->cs_sendpolled(cs->cs_devdata,
+				cs->cs_sendchars[cs->cs_sendchars_tail]);
+			cs->cs_sendchars_tail = (cs->cs_sendchars_tail + 1)
+				% CONSOLE_OUTPUT_BUFFER_SIZE;
+		}
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
+	if (drain) {
+		spinlock_release(&cs->cs_lock);
+	}
 }
 
 //////////////////////////////////////////////////
 
+/*
+ * Queue LEN characters for output, waiting for room in the ring if
+ * necessary. Writers are only woken once the ring is half empty, so a
+ * big write sleeps once per half ring rather than once per character.
+ */
+static
+void
+con_send(struct con_softc *cs, const char *buf, size_t len)
+{
+	size_t i;
+
+	spinlock_acquire(&cs->cs_lock);
+	for (i=0; i<len; i++) {
+		while (con_sendcount(cs) == CONSOLE_OUTPUT_BUFFER_SIZE - 1) {
+			con_kick(cs);
+			wchan_sleep(cs->cs_wwchan, &cs->cs_lock);
+		}
+		cs->cs_sendchars[cs->cs_sendchars_head] = buf[i];
+		cs->cs_sendchars_head =
+			(cs->cs_sendchars_head + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	}
+	con_kick(cs);
+	spinlock_release(&cs->cs_lock);
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -129,8 +239,9 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	con_send(cs, &c, 1);
 }
 
 /*
@@ -140,12 +251,16 @@ static
 int
 getch_intr(struct con_softc *cs)
 {
-	unsigned char ret;
+	int ret;
 
-	P(cs->cs_rsem);
-	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
-	cs->cs_gotchars_tail =
-		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	spinlock_acquire(&cs->cs_lock);
+	while (cs->cs_gotchars_head == cs->cs_gotchars_tail) {
+		cs->cs_rwant = 1;
+		wchan_sleep(cs->cs_rwchan, &cs->cs_lock);
+	}
+	cs->cs_rwant = 0;
+	ret = con_takechar(cs);
+	spinlock_release(&cs->cs_lock);
 	return ret;
 }
 
@@ -153,10 +268,11 @@ getch_intr(struct con_softc *cs)
  * Called from underlying device when a read-ready interrupt occurs.
  *
  * Note: if gotchars_head == gotchars_tail, the buffer is empty. Thus
- * if gotchars_head+1 == gotchars_tail, the buffer is full. A slightly
- * tidier way to implement this check (that avoids wasting a slot,
- * too) would be with a second semaphore used with a nonblocking P,
- * but we don't have that in OS/161.
+ * if gotchars_head+1 == gotchars_tail, the buffer is full.
+ *
+ * The reader (if any) is only woken when it can make progress: at the
+ * end of a line, once there are as many characters as it asked for,
+ * or when the buffer fills up.
  */
 void
 con_input(void *vcs, int ch)
@@ -164,27 +280,45 @@ con_input(void *vcs, int ch)
 	struct con_softc *cs = vcs;
 	unsigned nexthead;
 
+	spinlock_acquire(&cs->cs_lock);
+
 	nexthead = (cs->cs_gotchars_head + 1) % CONSOLE_INPUT_BUFFER_SIZE;
 	if (nexthead == cs->cs_gotchars_tail) {
 		/* overflow; drop character */
+		spinlock_release(&cs->cs_lock);
 		return;
 	}
 
 	cs->cs_gotchars[cs->cs_gotchars_head] = ch;
 	cs->cs_gotchars_head = nexthead;
+	if (ch == '\r' || ch == '\n') {
+		cs->cs_gotlines++;
+	}
 
-	V(cs->cs_rsem);
+	if (cs->cs_gotlines > 0 || con_gotcount(cs) >= cs->cs_rwant ||
+	    con_gotcount(cs) == CONSOLE_INPUT_BUFFER_SIZE - 1) {
+		wchan_wakeall(cs->cs_rwchan, &cs->cs_lock);
+	}
+
+	spinlock_release(&cs->cs_lock);
 }
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Send the next character, if any.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_lock);
+	cs->cs_sending = false;
+	con_kick(cs);
+	if (con_sendcount(cs) <= CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+		wchan_wakeall(cs->cs_wwchan, &cs->cs_lock);
+	}
+	spinlock_release(&cs->cs_lock);
 }
 
 //////////////////////////////////////////////////
@@ -240,16 +374,104 @@ con_eachopen(struct device *dev, int openflags)
 	return 0;
 }
 
+/*
+ * Chunk size for moving data between the rings and the uio.
+ */
+#define CON_IOCHUNK 64
+
+/*
+ * Read: wait until there's a whole line, or enough to satisfy the
+ * request, and then take it in bulk. As before, a read stops at the
+ * end of a line.
+ */
+static
+int
+con_read(struct con_softc *cs, struct uio *uio)
+{
+	char buf[CON_IOCHUNK];
+	unsigned want, n;
+	bool gotline;
+	int ch, result;
+
+	gotline = false;
+	while (uio->uio_resid > 0 && !gotline) {
+		want = uio->uio_resid;
+		if (want > CONSOLE_INPUT_BUFFER_SIZE - 1) {
+			want = CONSOLE_INPUT_BUFFER_SIZE - 1;
+		}
+
+		spinlock_acquire(&cs->cs_lock);
+		while (cs->cs_gotlines == 0 && con_gotcount(cs) < want) {
+			cs->cs_rwant = want;
+			wchan_sleep(cs->cs_rwchan, &cs->cs_lock);
+		}
+		cs->cs_rwant = 0;
+
+		n = 0;
+		while (n < sizeof(buf) && n < uio->uio_resid &&
+		       cs->cs_gotchars_head != cs->cs_gotchars_tail) {
+			ch = con_takechar(cs);
+			if (ch == '\r') {
+				ch = '\n';
+			}
+			buf[n++] = ch;
+			if (ch == '\n') {
+				gotline = true;
+				break;
+			}
+		}
+		spinlock_release(&cs->cs_lock);
+
+		result = uiomove(buf, n, uio);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write: copy in a chunk at a time, turn newlines into CR-LF, and put
+ * the lot in the output ring.
+ */
+static
+int
+con_write(struct con_softc *cs, struct uio *uio)
+{
+	char inbuf[CON_IOCHUNK], outbuf[2 * CON_IOCHUNK];
+	size_t len, i, n;
+	int result;
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > sizeof(inbuf)) {
+			len = sizeof(inbuf);
+		}
+		result = uiomove(inbuf, len, uio);
+		if (result) {
+			return result;
+		}
+
+		n = 0;
+		for (i=0; i<len; i++) {
+			if (inbuf[i] == '\n') {
+				outbuf[n++] = '\r';
+			}
+			outbuf[n++] = inbuf[i];
+		}
+		con_send(cs, outbuf, n);
+	}
+	return 0;
+}
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
 {
+	struct con_softc *cs = dev->d_data;
 	int result;
-	char ch;
 	struct lock *lk;
 
-	(void)dev;  // unused
-
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
 	}
@@ -259,36 +481,14 @@ con_io(struct device *dev, struct uio *uio)
 
 	KASSERT(lk != NULL);
 	lock_acquire(lk);
-
-	while (uio->uio_resid > 0) {
-		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
-			if (ch=='\r') {
-				ch = '\n';
-			}
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				break;
-			}
-		}
-		else {
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
-		}
+	if (uio->uio_rw==UIO_READ) {
+		result = con_read(cs, uio);
+	}
+	else {
+		result = con_write(cs, uio);
 	}
 	lock_release(lk);
-	return 0;
+	return result;
 }
 
 static
@@ -343,7 +543,7 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct wchan *rwc, *wwc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -359,33 +559,39 @@ config_con(struct con_softc *cs, int unit)
 	}
 	KASSERT(the_console==NULL);
 
-	rsem = sem_create("console read", 0);
-	if (rsem == NULL) {
+	rwc = wchan_create("console read");
+	if (rwc == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
-		sem_destroy(rsem);
+	wwc = wchan_create("console write");
+	if (wwc == NULL) {
+		wchan_destroy(rwc);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(rwc);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(rwc);
+		wchan_destroy(wwc);
 		return ENOMEM;
 	}
 
-	cs->cs_rsem = rsem;
-	cs->cs_wsem = wsem;
+	spinlock_init(&cs->cs_lock);
+	cs->cs_rwchan = rwc;
+	cs->cs_wwchan = wwc;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	cs->cs_gotlines = 0;
+	cs->cs_rwant = 0;
+	cs->cs_sendchars_head = 0;
+	cs->cs_sendchars_tail = 0;
+	cs->cs_sending = false;
 
 	the_console = cs;
 	con_userlock_read = rlk;
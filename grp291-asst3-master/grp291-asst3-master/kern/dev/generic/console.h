@@ -30,14 +30,22 @@
 #ifndef _GENERIC_CONSOLE_H_
 #define _GENERIC_CONSOLE_H_
 
+#include <spinlock.h>
+
 /*
  * Device data for the hardware-independent system console.
  *
  * devdata, send, and sendpolled are provided by the underlying
  * device, and are to be initialized by the attach routine.
+ *
+ * Output goes through a ring that writers fill and the write-done
+ * interrupt drains, one character per interrupt. Input goes into
+ * another ring; readers are woken when a whole line is there or
+ * enough characters to satisfy them.
  */
 
-#define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_INPUT_BUFFER_SIZE 256
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -46,11 +54,18 @@ struct con_softc {
 	void (*cs_sendpolled)(void *devdata, int ch);
 
 	/* initialized by config routine */
-	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
+	struct spinlock cs_lock;	/* protects everything below */
+	struct wchan *cs_rwchan;	/* readers waiting for input */
+	struct wchan *cs_wwchan;	/* writers waiting for ring space */
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+	unsigned cs_gotlines;		/* line ends in cs_gotchars */
+	unsigned cs_rwant;		/* chars the waiting reader needs */
+	unsigned char cs_sendchars[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_sendchars_head;	/* next slot to put a char in */
+	unsigned cs_sendchars_tail;	/* next slot to send from */
+	bool cs_sending;		/* a char is out at the device */
 };
 
 /*
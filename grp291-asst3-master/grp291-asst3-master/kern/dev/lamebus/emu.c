@@ -854,9 +854,12 @@ emufs_namefile(struct vnode *v, struct uio *uio)
  */
 static
 int
-emufs_mmap(struct vnode *v)
+emufs_mmap(struct vnode *v, off_t offset, bool write, paddr_t *frame)
 {
 	(void)v;
+	(void)offset;
+	(void)write;
+	(void)frame;
 	return ENOSYS;
 }
 
@@ -949,6 +952,17 @@ emufs_void_op_isdir(struct vnode *v)
 	return EISDIR;
 }
 
+static
+int
+emufs_mmap_isdir(struct vnode *v, off_t offset, bool write, paddr_t *frame)
+{
+	(void)v;
+	(void)offset;
+	(void)write;
+	(void)frame;
+	return EISDIR;
+}
+
 static
 int
 emufs_uio_op_isdir(struct vnode *v, struct uio *uio)
@@ -1127,7 +1141,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_gettype = emufs_dir_gettype,
 	.vop_isseekable = emufs_isseekable,
 	.vop_fsync = emufs_void_op_isdir,
-	.vop_mmap = emufs_void_op_isdir,
+	.vop_mmap = emufs_mmap_isdir,
 	.vop_truncate = emufs_truncate_isdir,
 	.vop_namefile = emufs_namefile,
 
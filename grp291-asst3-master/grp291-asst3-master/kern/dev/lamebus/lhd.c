@@ -36,9 +36,12 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <cpu.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <kstat.h>
 #include <lamebus/lhd.h>
 #include "autoconf.h"
 
@@ -60,6 +63,9 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Size of the bounce buffer for transfers to/from user space, in sectors */
+#define LHD_BOUNCESECTS 16
+
 /*
  * Shortcut for reading a register.
  */
@@ -96,41 +102,188 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Requests are kept in a queue sorted by sector and served in C-LOOK
+ * order: the next one is the first at or past where the head is,
+ * and when there are none ahead the head goes back to the lowest.
+ * Each request covers a whole run of sectors, which the interrupt
+ * handler transfers one after another (the card buffer holds one
+ * sector) without the request going back through the queue.
+ *
+ * Data is copied to and from the card buffer in the interrupt
+ * handler, so requests always have kernel-space uios; lhd_io bounces
+ * transfers to user space through a kernel buffer.
+ */
+
+/*
+ * Start (or continue) the current request on its next sector.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct devreq *req = lh->lh_cur;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL && req->dr_nblocks > 0);
+
+	/*
+	 * Are we writing? If so, transfer the data to the on-card
+	 * buffer. (This can't fail for a kernel-space uio.)
+	 */
+	if (req->dr_uio->uio_rw == UIO_WRITE) {
+		(void)uiomove(lh->lh_buf, LHD_SECTSIZE, req->dr_uio);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->dr_block);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the card is idle, take the next request off the queue and start
+ * it.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_start(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq **pp, *req;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_cur != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		if ((*pp)->dr_block >= lh->lh_head) {
+			break;
+		}
+	}
+	if (*pp == NULL) {
+		/* Nothing ahead of the head; sweep again from the start */
+		pp = &lh->lh_queue;
+	}
+	req = *pp;
+	*pp = req->dr_next;
+	req->dr_next = NULL;
+
+	req->dr_started = cpu_cycles();
+	lh->lh_cur = req;
+	lhd_startsector(lh);
+}
+
+/*
+ * Add a request to the queue, and start it if the card is idle.
+ */
+static
+void
+lhd_submit(struct lhd_softc *lh, struct devreq *req)
+{
+	struct devreq **pp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	kstat_count(req->dr_uio->uio_rw == UIO_WRITE ?
+		    KSTAT_DISK_WRITE : KSTAT_DISK_READ);
+	req->dr_queued = cpu_cycles();
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		if ((*pp)->dr_block > req->dr_block) {
+			break;
+		}
+	}
+	req->dr_next = *pp;
+	*pp = req;
+
+	lh->lh_depth++;
+	if (lh->lh_depth > lh->lh_maxdepth) {
+		lh->lh_maxdepth = lh->lh_depth;
+	}
+	lh->lh_depthsum += lh->lh_depth;
+
+	lhd_start(lh);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, and then either go on to the next sector of the request
+ * or complete it and start the next request.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct devreq *req;
 	uint32_t val;
+	int err;
+
+	spinlock_acquire(&lh->lh_lock);
 
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
-	    case LHD_IDLE:
-	    case LHD_WORKING:
-		break;
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
-		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
+	    default:
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	lhd_wreg(lh, LHD_REG_STAT, 0);
+	err = lhd_code_to_errno(lh, val);
+
+	req = lh->lh_cur;
+	if (req == NULL) {
+		/* Nothing was running; ignore it */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	if (err == 0) {
+		/*
+		 * Are we reading? If so, transfer the data out of the
+		 * on-card buffer.
+		 */
+		if (req->dr_uio->uio_rw == UIO_READ) {
+			membar_load_load();
+			(void)uiomove(lh->lh_buf, LHD_SECTSIZE, req->dr_uio);
+		}
+		req->dr_block++;
+		req->dr_nblocks--;
+		lh->lh_nsects++;
+
+		if (req->dr_nblocks > 0) {
+			lhd_startsector(lh);
+			spinlock_release(&lh->lh_lock);
+			return;
+		}
 	}
+
+	/* The request is done (or failed). */
+	lh->lh_cur = NULL;
+	lh->lh_head = req->dr_block;
+
+	/*
+	 * Requests may be submitted on one cpu and finish on another,
+	 * whose cycle counters needn't agree, so these are rough.
+	 */
+	lh->lh_nreqs++;
+	lh->lh_waitcycles += req->dr_started - req->dr_queued;
+	lh->lh_svccycles += cpu_cycles() - req->dr_started;
+	lh->lh_depth--;
+
+	lhd_start(lh);
+	spinlock_release(&lh->lh_lock);
+
+	req->dr_done(req, err);
 }
 
 /*
@@ -180,21 +333,16 @@ lhd_reset(struct lhd_softc *lh)
 #endif
 
 /*
- * I/O function (for both reads and writes)
+ * Check that a transfer is sector-aligned and on the disk.
  */
 static
 int
-lhd_io(struct device *d, struct uio *uio)
+lhd_check(struct lhd_softc *lh, struct uio *uio)
 {
-	struct lhd_softc *lh = d->d_data;
-
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
-	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
 	if (sectoff != 0 || lenoff != 0) {
@@ -202,72 +350,211 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (uio->uio_offset < 0 || sector > lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - sector) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
-	}
+	return 0;
+}
+
+/*
+ * Completion of a synchronous request: wake up the waiting thread.
+ */
+struct lhd_waiter {
+	struct lhd_softc *w_lh;
+	bool w_done;
+	int w_result;
+};
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+static
+void
+lhd_wakeup(struct devreq *req, int result)
+{
+	struct lhd_waiter *w = req->dr_data;
+	struct lhd_softc *lh = w->w_lh;
+
+	spinlock_acquire(&lh->lh_lock);
+	w->w_result = result;
+	w->w_done = true;
+	wchan_wakeall(lh->lh_wchan, &lh->lh_lock);
+	spinlock_release(&lh->lh_lock);
+}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+/*
+ * Do a (checked) kernel-space transfer and wait for it.
+ */
+static
+int
+lhd_rw(struct lhd_softc *lh, struct uio *uio)
+{
+	struct devreq req;
+	struct lhd_waiter w;
+
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
+
+	req.dr_uio = uio;
+	req.dr_done = lhd_wakeup;
+	req.dr_data = &w;
+	req.dr_block = uio->uio_offset / LHD_SECTSIZE;
+	req.dr_nblocks = uio->uio_resid / LHD_SECTSIZE;
+	if (req.dr_nblocks == 0) {
+		return 0;
+	}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
-		}
+	w.w_lh = lh;
+	w.w_done = false;
+	w.w_result = 0;
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
+	spinlock_acquire(&lh->lh_lock);
+	lhd_submit(lh, &req);
+	while (!w.w_done) {
+		wchan_sleep(lh->lh_wchan, &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
 
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
+	return w.w_result;
+}
 
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+/*
+ * I/O function (for both reads and writes)
+ */
+static
+int
+lhd_io(struct device *d, struct uio *uio)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct iovec iov;
+	struct uio ku;
+	char *bounce;
+	size_t len;
+	int result;
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	result = lhd_check(lh, uio);
+	if (result) {
+		return result;
+	}
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return lhd_rw(lh, uio);
+	}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+	/*
+	 * The interrupt handler can't copy to or from user space, so
+	 * go through a kernel buffer a chunk at a time.
+	 */
+	bounce = kmalloc(LHD_BOUNCESECTS * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > LHD_BOUNCESECTS * LHD_SECTSIZE) {
+			len = LHD_BOUNCESECTS * LHD_SECTSIZE;
+		}
+		uio_kinit(&iov, &ku, bounce, len, uio->uio_offset,
+			  uio->uio_rw);
 
-		/* If we failed, return the error. */
+		if (uio->uio_rw == UIO_WRITE) {
+			result = uiomove(bounce, len, uio);
+			if (result) {
+				break;
+			}
+			result = lhd_rw(lh, &ku);
+		}
+		else {
+			result = lhd_rw(lh, &ku);
+			if (result) {
+				break;
+			}
+			result = uiomove(bounce, len, uio);
+		}
 		if (result) {
-			return result;
+			break;
 		}
 	}
+	kfree(bounce);
 
+	return result;
+}
+
+/*
+ * Asynchronous I/O function: queue the request and return.
+ */
+static
+int
+lhd_aio(struct device *d, struct devreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct uio *uio = req->dr_uio;
+	int result;
+
+	if (uio->uio_segflg != UIO_SYSSPACE) {
+		return EINVAL;
+	}
+	result = lhd_check(lh, uio);
+	if (result) {
+		return result;
+	}
+
+	req->dr_block = uio->uio_offset / LHD_SECTSIZE;
+	req->dr_nblocks = uio->uio_resid / LHD_SECTSIZE;
+	if (req->dr_nblocks == 0) {
+		req->dr_done(req, 0);
+		return 0;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	lhd_submit(lh, req);
+	spinlock_release(&lh->lh_lock);
 	return 0;
 }
 
+/*
+ * Print queue and service time statistics.
+ */
+static
+void
+lhd_printstats(struct device *d, const char *name)
+{
+	struct lhd_softc *lh = d->d_data;
+	unsigned nreqs, depth, maxdepth, submits, rpm;
+	uint64_t nsects, depthsum, waitcycles, svccycles, rate;
+
+	spinlock_acquire(&lh->lh_lock);
+	nreqs = lh->lh_nreqs;
+	nsects = lh->lh_nsects;
+	depth = lh->lh_depth;
+	maxdepth = lh->lh_maxdepth;
+	depthsum = lh->lh_depthsum;
+	waitcycles = lh->lh_waitcycles;
+	svccycles = lh->lh_svccycles;
+	rpm = lh->lh_rpm;
+	spinlock_release(&lh->lh_lock);
+
+	submits = nreqs + depth;
+	rate = cpu_cyclerate();
+	kprintf("%s: %u requests, %llu sectors; queue depth %u now, "
+		"%u max, %llu.%02llu average\n", name, nreqs,
+		(unsigned long long)nsects, depth, maxdepth,
+		submits ? (unsigned long long)(depthsum / submits) : 0,
+		submits ? (unsigned long long)
+			(depthsum * 100 / submits % 100) : 0);
+	kprintf("%s: average wait %llu us, service %llu us "
+		"(%u rpm, %u us average rotational delay)\n", name,
+		nreqs ? (unsigned long long)
+			(waitcycles / nreqs * 1000000 / rate) : 0,
+		nreqs ? (unsigned long long)
+			(svccycles / nreqs * 1000000 / rate) : 0,
+		rpm, rpm ? 30000000 / rpm : 0);
+}
+
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_aio = lhd_aio,
+	.devop_printstats = lhd_printstats,
 };
 
 /*
@@ -284,17 +571,27 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Get the rotation speed, for service time estimates. */
+	lh->lh_rpm = lhd_rdreg(lh, LHD_REG_RPM);
+
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_head = 0;
+
+	lh->lh_nreqs = 0;
+	lh->lh_nsects = 0;
+	lh->lh_depth = 0;
+	lh->lh_maxdepth = 0;
+	lh->lh_depthsum = 0;
+	lh->lh_waitcycles = 0;
+	lh->lh_svccycles = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
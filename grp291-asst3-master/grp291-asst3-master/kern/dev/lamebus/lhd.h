@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -51,9 +52,21 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	uint32_t lh_rpm;		/* Rotation speed (for estimates) */
+	struct spinlock lh_lock;	/* Protects the queue and the card */
+	struct wchan *lh_wchan;		/* Synchronous callers wait here */
+	struct devreq *lh_queue;	/* Waiting requests, by sector */
+	struct devreq *lh_cur;		/* Request the card is working on */
+	uint32_t lh_head;		/* Sector after the last one done */
+
+	/* Statistics (protected by lh_lock) */
+	unsigned lh_nreqs;		/* Requests completed */
+	uint64_t lh_nsects;		/* Sectors transferred */
+	unsigned lh_depth;		/* Requests queued or in progress */
+	unsigned lh_maxdepth;		/* Largest lh_depth seen */
+	uint64_t lh_depthsum;		/* Sum of lh_depth at each submit */
+	uint64_t lh_waitcycles;		/* Total cycles requests were queued */
+	uint64_t lh_svccycles;		/* Total cycles requests were serviced */
 
 	struct device lh_dev;		/* VFS device structure */
 };
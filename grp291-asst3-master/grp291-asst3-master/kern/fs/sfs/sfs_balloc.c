@@ -35,13 +35,13 @@
 #include <types.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
  * Zero out a disk block.
  */
-static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
@@ -53,27 +53,50 @@ sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 
 /*
  * Allocate a block.
+ *
+ * The search starts at GOAL, so that blocks of a file written in
+ * order end up next to each other on disk; callers pass the block
+ * after the file's previous one, or after its inode. With no goal
+ * (0) it starts where the last allocation left off, which keeps new
+ * files together and saves rescanning the full start of the freemap.
+ *
+ * If CLEAR is false the caller is going to overwrite the whole block,
+ * so it is not zeroed first.
+ *
+ * The block is cleared after the freemap lock is dropped; it's ours
+ * once it is marked, so nobody else can be using it.
  */
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, bool clear, daddr_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	if (goal == 0 || goal >= sfs->sfs_sb.sb_nblocks) {
+		goal = sfs->sfs_alloccursor;
+	}
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	sfs->sfs_alloccursor = *diskblock + 1;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: balloc: invalid block %u\n",
 		      sfs->sfs_sb.sb_volname, *diskblock);
 	}
 
+	if (!clear) {
+		return 0;
+	}
+
 	/* Clear block before returning it */
 	result = sfs_clearblock(sfs, *diskblock);
 	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		sfs_bfree(sfs, *diskblock);
 	}
 	return result;
 }
@@ -84,8 +107,10 @@ sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -94,10 +119,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: %s: sfs_bused called on out of range block %u\n",
 		      sfs->sfs_sb.sb_volname, diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
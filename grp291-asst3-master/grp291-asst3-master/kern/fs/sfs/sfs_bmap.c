@@ -35,39 +35,90 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Pick where to look for a new block for the file: right after the
+ * block before it in the file if that's known, otherwise right after
+ * the inode.
+ */
+static
+daddr_t
+sfs_bmap_goal(struct sfs_vnode *sv, uint32_t fileblock, uint32_t *ids)
+{
+	uint32_t prev;
+
+	if (fileblock > 0 && fileblock <= SFS_NDIRECT &&
+	    sv->sv_i.sfi_direct[fileblock-1] != 0) {
+		return sv->sv_i.sfi_direct[fileblock-1] + 1;
+	}
+	if (fileblock > SFS_NDIRECT && ids != NULL) {
+		prev = (fileblock - SFS_NDIRECT - 1) % SFS_DBPERIDB;
+		if (prev != SFS_DBPERIDB - 1 && ids[prev] != 0) {
+			return ids[prev] + 1;
+		}
+	}
+	return sv->sv_ino + 1;
+}
+
+/*
+ * Allocate a data block for sfs_bmap. With FRESHBUF the block isn't
+ * zeroed; instead we get its buffer here, before the block goes into
+ * the file, so a file never maps a block still holding some other
+ * file's old data. If there's no buffer to be had the block is given
+ * back.
+ */
+static
+int
+sfs_bmap_alloc(struct sfs_fs *sfs, daddr_t goal, struct sfs_buf **freshbuf,
+	       daddr_t *diskblock)
+{
+	int result;
+
+	result = sfs_balloc(sfs, goal, freshbuf == NULL, diskblock);
+	if (result || freshbuf == NULL) {
+		return result;
+	}
+	result = sfs_bget(sfs, *diskblock, false, freshbuf);
+	if (result) {
+		sfs_bfree(sfs, *diskblock);
+		*freshbuf = NULL;
+	}
+	return result;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * New blocks are normally zeroed. A caller that is about to overwrite
+ * the whole block can pass FRESHBUF instead; then a new block is not
+ * zeroed, and *FRESHBUF is its buffer (contents undefined, so the
+ * caller must fill all of it before releasing it dirty), or NULL if
+ * no block was allocated.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-	 daddr_t *diskblock)
+	 struct sfs_buf **freshbuf, daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *ids;
 	daddr_t block;
 	daddr_t idblock;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	if (freshbuf != NULL) {
+		*freshbuf = NULL;
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +133,10 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_bmap_alloc(sfs,
+						sfs_bmap_goal(sv, fileblock,
+							      NULL),
+						freshbuf, &block);
 			if (result) {
 				return result;
 			}
@@ -143,7 +197,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * the indirect block. Thus, we need to allocate an
 		 * indirect block.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		result = sfs_balloc(sfs,
+				    sfs_bmap_goal(sv, SFS_NDIRECT, NULL),
+				    true, &idblock);
 		if (result) {
 			return result;
 		}
@@ -153,38 +209,39 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+
+	/*
+	 * Get the indirect block from the buffer cache. (If we just
+	 * allocated it, sfs_balloc cleared it there.)
+	 */
+	result = sfs_bget(sfs, idblock, true, &idbuf);
+	if (result) {
+		return result;
 	}
+	ids = (uint32_t *)idbuf->b_data;
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/* Get the block out of the indirect block */
+	block = ids[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		result = sfs_bmap_alloc(sfs,
+					sfs_bmap_goal(sv,
+						      fileblock + SFS_NDIRECT,
+						      ids),
+					freshbuf, &block);
 		if (result) {
+			sfs_brelse(idbuf, false);
 			return result;
 		}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
-		}
+		/* Remember the block we allocated; the buffer is now dirty */
+		ids[idoff] = block;
+		sfs_brelse(idbuf, true);
+	}
+	else {
+		sfs_brelse(idbuf, false);
 	}
 
 	/* Hand back the result and return. */
@@ -203,16 +260,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 int
 sfs_itrunc(struct sfs_vnode *sv, off_t len)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *ids;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
@@ -223,9 +273,7 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -252,43 +300,37 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	if (blocklen < highblock && idblock != 0) {
 		/* We're past the proposed EOF; may need to free stuff */
 
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+		/* Get the indirect block */
+		result = sfs_bget(sfs, idblock, true, &idbuf);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+		ids = (uint32_t *)idbuf->b_data;
 
 		hasnonzero = 0;
 		iddirty = 0;
 		for (j=0; j<SFS_DBPERIDB; j++) {
 			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
+			if (blocklen < baseblock+j && ids[j] != 0) {
+				sfs_bfree(sfs, ids[j]);
+				ids[j] = 0;
 				iddirty = 1;
 			}
 			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
+			if (ids[j]!=0) {
 				hasnonzero=1;
 			}
 		}
 
+		/* If we changed it, the buffer is dirty */
+		sfs_brelse(idbuf, iddirty);
+
 		if (!hasnonzero) {
 			/* The whole indirect block is empty now; free it */
 			sfs_bfree(sfs, idblock);
 			sv->sv_i.sfi_indirect = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
 	}
 
 	/* Set the file size */
@@ -297,7 +339,6 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -99,6 +99,9 @@ sfs_dir_nentries(struct sfs_vnode *sv)
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
+ *
+ * Unless an empty slot is wanted, the name cache is checked first,
+ * and the outcome of a full search is entered into it.
  */
 int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
@@ -106,6 +109,22 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 {
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
+	uint32_t foundino = SFS_NOINO;
+	int foundslot = -1;
+
+	if (emptyslot == NULL &&
+	    sfs_ncache_lookup(sv, name, &foundino, &foundslot)) {
+		if (foundino == SFS_NOINO) {
+			return ENOENT;
+		}
+		if (slot != NULL) {
+			*slot = foundslot;
+		}
+		if (ino != NULL) {
+			*ino = foundino;
+		}
+		return 0;
+	}
 
 	nentries = sfs_dir_nentries(sv);
 
@@ -133,6 +152,8 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 				KASSERT(found==0);
 
 				found = 1;
+				foundslot = i;
+				foundino = tsd.sfd_ino;
 				if (slot != NULL) {
 					*slot = i;
 				}
@@ -143,6 +164,8 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		}
 	}
 
+	sfs_ncache_enter(sv, name, foundino, foundslot);
+
 	return found ? 0 : ENOENT;
 }
 
@@ -186,7 +209,14 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* The name cache has a negative entry for it; update that. */
+	sfs_ncache_enter(sv, name, ino, emptyslot);
+	return 0;
 }
 
 /*
@@ -195,14 +225,31 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
-	struct sfs_direntry sd;
+	struct sfs_direntry sd, old;
+	int result;
+
+	/* Get the name being removed, for the name cache */
+	result = sfs_readdir(sv, slot, &old);
+	if (result) {
+		return result;
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+
+	/* The name is gone now */
+	if (old.sfd_ino != SFS_NOINO) {
+		old.sfd_name[sizeof(old.sfd_name)-1] = 0;
+		sfs_ncache_enter(sv, old.sfd_name, SFS_NOINO, -1);
+	}
+	return 0;
 }
 
 /*
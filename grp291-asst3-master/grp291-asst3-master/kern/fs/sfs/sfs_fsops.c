@@ -39,6 +39,7 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -107,19 +108,48 @@ sfs_freemapio(struct sfs_fs *sfs, enum uio_rw rw)
 
 /*
  * Sync routine for the vnode table.
+ *
+ * VOP_FSYNC takes the vnode lock, which must not be waited for while
+ * holding sfs_vnlock; so take a reference to each loaded vnode first
+ * and sync them after letting go of the table.
  */
 static
 int
 sfs_sync_vnodes(struct sfs_fs *sfs)
 {
-	unsigned i, num;
+	struct sfs_vnode *sv, **svs;
+	unsigned i, n;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes == 0) {
+		lock_release(sfs->sfs_vnlock);
+		return 0;
+	}
+	svs = kmalloc(sfs->sfs_nvnodes * sizeof(struct sfs_vnode *));
+	if (svs == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	n = 0;
+	for (i=0; i<SFS_VHASH_SIZE; i++) {
+		for (sv = sfs->sfs_vnodes[i]; sv != NULL; sv = sv->sv_hashnext) {
+			if (sv->sv_loading) {
+				/* not read in yet, so nothing to sync */
+				continue;
+			}
+			VOP_INCREF(&sv->sv_absvn);
+			svs[n++] = sv;
+		}
 	}
+	KASSERT(n <= sfs->sfs_nvnodes);
+	lock_release(sfs->sfs_vnlock);
+
+	/* Go over the loaded vnodes, syncing as we go. */
+	for (i=0; i<n; i++) {
+		VOP_FSYNC(&svs[i]->sv_absvn);
+		VOP_DECREF(&svs[i]->sv_absvn);
+	}
+	kfree(svs);
 	return 0;
 }
 
@@ -132,13 +162,16 @@ sfs_sync_freemap(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 
 	return 0;
 }
@@ -152,14 +185,17 @@ sfs_sync_superblock(struct sfs_fs *sfs)
 {
 	int result;
 
+	lock_acquire(sfs->sfs_freemaplock);
 	if (sfs->sfs_superdirty) {
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -174,8 +210,6 @@ sfs_sync(struct fs *fs)
 	struct sfs_fs *sfs;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -211,25 +245,27 @@ sfs_sync(struct fs *fs)
 	/* If any vnodes need to be written, write them. */
 	result = sfs_sync_vnodes(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the free block map needs to be written, write it. */
 	result = sfs_sync_freemap(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	result = sfs_sync_superblock(sfs);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
-	vfs_biglock_release();
+	/* Now push everything out of the buffer cache. */
+	result = sfs_bflush(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
 	return 0;
 }
 
@@ -243,13 +279,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* The volume name never changes while mounted */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -262,8 +294,12 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	KASSERT(sfs->sfs_nvnodes == 0);
+	sfs_ncache_purge(sfs, SFS_NOINO);
 	KASSERT(sfs->sfs_device == NULL);
+	lock_destroy(sfs->sfs_freemaplock);
+	cv_destroy(sfs->sfs_vncv);
+	lock_destroy(sfs->sfs_vnlock);
 	kfree(sfs);
 }
 
@@ -277,19 +313,32 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (A lookup
+	 * in progress holds a reference to the directory it started
+	 * from, and can only start from here with the vfs big lock,
+	 * which vfs_unmount holds; so none can be loaded meanwhile.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Write back and forget our blocks in the buffer cache */
+	result = sfs_bflush(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+	sfs_binval(sfs->sfs_device);
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -297,7 +346,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -321,6 +369,7 @@ struct sfs_fs *
 sfs_fs_create(void)
 {
 	struct sfs_fs *sfs;
+	unsigned i;
 
 	/*
 	 * Make sure our on-disk structures aren't messed up
@@ -335,6 +384,20 @@ sfs_fs_create(void)
 		goto fail;
 	}
 
+	/* locks */
+	sfs->sfs_vnlock = lock_create("sfs vnode table");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_object;
+	}
+	sfs->sfs_vncv = cv_create("sfs vnode load");
+	if (sfs->sfs_vncv == NULL) {
+		goto cleanup_vnlock;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vncv;
+	}
+
 	/*
 	 * Fill in fields
 	 */
@@ -351,17 +414,22 @@ sfs_fs_create(void)
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		goto cleanup_object;
+	for (i=0; i<SFS_VHASH_SIZE; i++) {
+		sfs->sfs_vnodes[i] = NULL;
 	}
+	sfs->sfs_nvnodes = 0;
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_alloccursor = 0;
 
 	return sfs;
 
+cleanup_vncv:
+	cv_destroy(sfs->sfs_vncv);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -388,7 +456,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
+	/* vfs_mount holds the big lock, so this runs one at a time */
+	KASSERT(vfs_biglock_do_i_hold());
 
 	/* We don't pass any options through mount */
 	(void)options;
@@ -402,28 +471,39 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		kprintf("sfs: Cannot mount on device with blocksize %zu\n",
 			dev->d_blocksize);
 		return ENXIO;
 	}
 
+	/* Set up the caches shared by all volumes, if not done yet */
+	result = sfs_bcache_init();
+	if (result) {
+		return result;
+	}
+	result = sfs_ncache_init();
+	if (result) {
+		return result;
+	}
+
 	sfs = sfs_fs_create();
 	if (sfs == NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
 	/* Set the device so we can use sfs_readblock() */
 	sfs->sfs_device = dev;
 
+	/* Don't trust anything cached from the device before this */
+	sfs_binval(dev);
+
 	/* Load superblock */
 	result = sfs_readblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 			       sizeof(sfs->sfs_sb));
 	if (result) {
+		sfs_binval(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -434,9 +514,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n",
 			sfs->sfs_sb.sb_magic,
 			SFS_MAGIC);
+		sfs_binval(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
@@ -451,23 +531,22 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
+		sfs_binval(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_freemapio(sfs, UIO_READ);
 	if (result) {
+		sfs_binval(dev);
 		sfs->sfs_device = NULL;
 		sfs_fs_destroy(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -35,10 +35,25 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Loaded vnodes are kept in a hash table on the inode number, so
+ * looking one up does not depend on how many files are open.
+ */
+static
+unsigned
+sfs_vhash(uint32_t ino)
+{
+	return ino % SFS_VHASH_SIZE;
+}
+
+/*
+ * The vnode table is protected by sfs_vnlock.
+ */
 
 /*
  * Write an on-disk inode structure back out to disk.
@@ -70,34 +85,40 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode **pp;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * Nobody else has a reference, so nobody else can be holding
+	 * the vnode lock either. sfs_loadvnode can still pick the vnode
+	 * up again until it's out of the table, but needs the vnode lock
+	 * to do anything with it; so the writing back below can be done
+	 * with just that, and sfs_vnlock taken afterwards only to check
+	 * the refcount and unlink the vnode. That keeps loads of other
+	 * files from waiting on this disk I/O.
 	 */
-	spinlock_acquire(&v->vn_countlock);
-	if (v->vn_refcount != 1) {
+	lock_acquire(sv->sv_lock);
 
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
-		return EBUSY;
+	/*
+	 * Mappings hold references, so nothing is mapped any more;
+	 * write back and drop the mmap page cache.
+	 */
+	result = sfs_mpage_sync(sv, 0, SFS_MPAGE_ALL, true);
+	if (result) {
+		lock_release(sv->sv_lock);
+		return result;
 	}
-	spinlock_release(&v->vn_countlock);
+	KASSERT(sv->sv_nmpages == 0);
 
-	/* If there are no on-disk references to the file either, erase it. */
+	/*
+	 * If there are no on-disk references to the file either, erase
+	 * it. Anyone who picks the vnode up meanwhile can't get to it
+	 * by name, so isn't going to look at the contents.
+	 */
 	if (sv->sv_i.sfi_linkcount == 0) {
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 	}
@@ -105,35 +126,60 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
-		sfs_bfree(sfs, sv->sv_ino);
+	lock_acquire(sfs->sfs_vnlock);
+
+	/*
+	 * Make sure someone else hasn't picked up the vnode since the
+	 * decision was made to reclaim it.
+	 */
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	pp = &sfs->sfs_vnodes[sfs_vhash(sv->sv_ino)];
+	while (*pp != sv) {
+		if (*pp == NULL) {
+			panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
+			      sfs->sfs_sb.sb_volname, sv->sv_ino);
 		}
+		pp = &(*pp)->sv_hashnext;
 	}
-	if (ix == num) {
-		panic("sfs: %s: reclaim vnode %u not in vnode pool\n",
-		      sfs->sfs_sb.sb_volname, sv->sv_ino);
+	*pp = sv->sv_hashnext;
+	sfs->sfs_nvnodes--;
+
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * If there are no on-disk references, discard the inode. It's
+	 * out of the table, so if the block is reused for a new inode
+	 * that gets loaded fresh.
+	 */
+	if (sv->sv_i.sfi_linkcount==0) {
+		if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+			sfs_ncache_purge(sfs, sv->sv_ino);
+		}
+		sfs_bfree(sfs, sv->sv_ino);
 	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
 
-	vnode_cleanup(&sv->sv_absvn);
+	lock_release(sv->sv_lock);
 
-	vfs_biglock_release();
+	vnode_cleanup(&sv->sv_absvn);
+	lock_destroy(sv->sv_lock);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
@@ -142,41 +188,74 @@ sfs_reclaim(struct vnode *v)
 	return 0;
 }
 
+/*
+ * Take a vnode that failed to load back out of the table, and wake
+ * anyone waiting for it so they try the load themselves. Called with
+ * sfs_vnlock held.
+ */
+static
+void
+sfs_unloadvnode(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_loading);
+
+	pp = &sfs->sfs_vnodes[sfs_vhash(sv->sv_ino)];
+	while (*pp != sv) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->sv_hashnext;
+	}
+	*pp = sv->sv_hashnext;
+	sfs->sfs_nvnodes--;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+}
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * The inode is read without holding sfs_vnlock: the new vnode goes
+ * into the table first, marked sv_loading, and anyone else looking
+ * for the same inode waits on sfs_vncv until it's ready.
  */
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops;
-	unsigned i, num;
+	unsigned bucket;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: %s: Found inode %u in unallocated block\n",
-			      sfs->sfs_sb.sb_volname, sv->sv_ino);
-		}
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	bucket = sfs_vhash(ino);
+ again:
+	for (sv = sfs->sfs_vnodes[bucket]; sv != NULL; sv = sv->sv_hashnext) {
 		if (sv->sv_ino==ino) {
 			/* Found */
 
+			if (sv->sv_loading) {
+				/* someone else is reading it in; wait */
+				cv_wait(sfs->sfs_vncv, sfs->sfs_vnlock);
+				goto again;
+			}
+
+			/* Every inode in memory must be in an allocated block */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: %s: Found inode %u in unallocated "
+				      "block\n", sfs->sfs_sb.sb_volname,
+				      sv->sv_ino);
+			}
+
 			/* forcetype is only allowed when creating objects */
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_absvn);
+			lock_release(sfs->sfs_vnlock);
 			*ret = sv;
 			return 0;
 		}
@@ -186,6 +265,13 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -195,16 +281,33 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      "unallocated block\n", sfs->sfs_sb.sb_volname, ino);
 	}
 
-	/* Read the block the inode is in */
+	/* Put it in the table as a placeholder while we read it */
+	sv->sv_ino = ino;
+	sv->sv_loading = true;
+	sv->sv_hashnext = sfs->sfs_vnodes[bucket];
+	sfs->sfs_vnodes[bucket] = sv;
+	sfs->sfs_nvnodes++;
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Read the block the inode is in. Reopening a file soon after
+	 * its vnode was reclaimed is cheap only while that block is
+	 * still in the buffer cache; nothing keeps it there.
+	 */
 	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
 	if (result) {
-		kfree(sv);
-		return result;
+		goto fail;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* Nothing mapped yet */
+	sv->sv_mpages = NULL;
+	sv->sv_nmpages = 0;
+	sv->sv_maxmpages = 0;
+	sv->sv_ranext = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out by sfs_balloc and
@@ -235,24 +338,26 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
-		return result;
+		goto fail;
 	}
 
-	/* Set the other fields in our vnode structure */
-	sv->sv_ino = ino;
-
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	/* Ready; let anyone waiting for it have it */
+	lock_acquire(sfs->sfs_vnlock);
+	sv->sv_loading = false;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
 	return 0;
+
+ fail:
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_unloadvnode(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+	return result;
 }
 
 /*
@@ -269,7 +374,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, true, &ino);
 	if (result) {
 		return result;
 	}
@@ -296,25 +401,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: %s: getroot: Cannot load root vnode\n",
 			sfs->sfs_sb.sb_volname);
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: %s: getroot: not directory (type %u)\n",
 			sfs->sfs_sb.sb_volname, sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
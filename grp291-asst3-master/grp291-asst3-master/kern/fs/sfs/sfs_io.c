@@ -36,6 +36,11 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <synch.h>
+#include <thread.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -62,8 +67,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -101,34 +104,865 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	return result;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Buffer cache
+
 /*
- * Read a block.
+ * Blocks of every mounted sfs are cached in up to SFS_NBUF buffers,
+ * found through a hash on (device, block) and recycled in LRU order.
+ * Writes only dirty a buffer; dirty buffers go to disk when they are
+ * recycled, on sfs_sync, and every SFS_SYNC_SECS seconds from the
+ * syncer thread. A buffer is pinned while a caller works on its data,
+ * so it can't be recycled under them.
+ *
+ * The cache has its own lock, sfs_block, which protects everything
+ * here except the contents of the buffers; those belong to whoever
+ * holds the lock for the block's owner (the file's vnode lock, or the
+ * freemap lock). Disk I/O is done without sfs_block held: the buffer
+ * is marked busy, and anyone else who wants it waits until it isn't.
+ * Waiting is on a generation count bumped whenever I/O finishes, which
+ * the completion of asynchronous read-ahead can do from interrupt
+ * context.
+ */
+
+#define SFS_NBUF	256	/* buffers to cache blocks in */
+#define SFS_NBUCKETS	64	/* hash chains */
+#define SFS_SYNC_SECS	5	/* syncer period */
+
+static struct lock *sfs_block;	/* protects the cache */
+static struct sfs_buf *sfs_bhash[SFS_NBUCKETS];
+static struct sfs_buf sfs_blru;	/* list head; b_lrunext is most recent */
+static unsigned sfs_nbufs;
+
+/* for waiting for busy buffers */
+static struct spinlock sfs_bwait_lock = SPINLOCK_INITIALIZER;
+static struct wchan *sfs_bwchan;
+static unsigned sfs_bgen;	/* protected by sfs_bwait_lock */
+
+/* statistics */
+static unsigned sfs_bhits;
+static unsigned sfs_bmisses;
+static unsigned sfs_breadaheads;
+static unsigned sfs_bwritebacks;
+
+static
+unsigned
+sfs_bbucket(struct device *dev, daddr_t block)
+{
+	return (block ^ ((uintptr_t)dev >> 4)) % SFS_NBUCKETS;
+}
+
+static
+struct sfs_buf *
+sfs_blookup(struct device *dev, daddr_t block)
+{
+	struct sfs_buf *buf;
+
+	KASSERT(lock_do_i_hold(sfs_block));
+
+	for (buf = sfs_bhash[sfs_bbucket(dev, block)]; buf != NULL;
+	     buf = buf->b_hashnext) {
+		if (buf->b_dev == dev && buf->b_block == block) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_bhash_insert(struct sfs_buf *buf)
+{
+	unsigned bucket = sfs_bbucket(buf->b_dev, buf->b_block);
+
+	buf->b_hashnext = sfs_bhash[bucket];
+	sfs_bhash[bucket] = buf;
+}
+
+static
+void
+sfs_bhash_remove(struct sfs_buf *buf)
+{
+	struct sfs_buf **pp;
+
+	pp = &sfs_bhash[sfs_bbucket(buf->b_dev, buf->b_block)];
+	while (*pp != buf) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = buf->b_hashnext;
+	buf->b_hashnext = NULL;
+}
+
+/*
+ * Move BUF to the front (most recently used end) or the back of the
+ * LRU list.
+ */
+static
+void
+sfs_blru_move(struct sfs_buf *buf, bool front)
+{
+	if (buf->b_lrunext != NULL) {
+		buf->b_lrunext->b_lruprev = buf->b_lruprev;
+		buf->b_lruprev->b_lrunext = buf->b_lrunext;
+	}
+	if (front) {
+		buf->b_lruprev = &sfs_blru;
+		buf->b_lrunext = sfs_blru.b_lrunext;
+	}
+	else {
+		buf->b_lruprev = sfs_blru.b_lruprev;
+		buf->b_lrunext = &sfs_blru;
+	}
+	buf->b_lruprev->b_lrunext = buf;
+	buf->b_lrunext->b_lruprev = buf;
+}
+
+/*
+ * Give BUF a block to hold and make it findable.
+ */
+static
+void
+sfs_bassign(struct sfs_buf *buf, struct sfs_fs *sfs, daddr_t block)
+{
+	KASSERT(!buf->b_valid);
+
+	buf->b_fs = sfs;
+	buf->b_dev = sfs->sfs_device;
+	buf->b_block = block;
+	buf->b_valid = true;
+	buf->b_dirty = false;
+	sfs_bhash_insert(buf);
+}
+
+/*
+ * Drop BUF from the cache. Its data is no longer valid.
+ */
+static
+void
+sfs_bdrop(struct sfs_buf *buf)
+{
+	KASSERT(!buf->b_busy);
+
+	if (buf->b_valid) {
+		sfs_bhash_remove(buf);
+	}
+	buf->b_valid = false;
+	buf->b_dirty = false;
+	sfs_blru_move(buf, false);
+}
+
+/*
+ * Give back an unused buffer from sfs_bgetfree.
+ */
+static
+void
+sfs_bputfree(struct sfs_buf *buf)
+{
+	KASSERT(buf->b_pins == 1 && !buf->b_valid);
+	buf->b_pins = 0;
+	sfs_blru_move(buf, false);
+}
+
+/*
+ * Get the current I/O generation; the caller may then drop sfs_block
+ * and sfs_bgen_wait for it to change.
  */
+static
+unsigned
+sfs_bgen_get(void)
+{
+	unsigned gen;
+
+	spinlock_acquire(&sfs_bwait_lock);
+	gen = sfs_bgen;
+	spinlock_release(&sfs_bwait_lock);
+	return gen;
+}
+
+/*
+ * Record that some I/O finished and wake up waiters.
+ */
+static
+void
+sfs_bgen_bump(void)
+{
+	spinlock_acquire(&sfs_bwait_lock);
+	sfs_bgen++;
+	wchan_wakeall(sfs_bwchan, &sfs_bwait_lock);
+	spinlock_release(&sfs_bwait_lock);
+}
+
+/*
+ * Wait, without sfs_block, for the I/O generation to move past GEN.
+ */
+static
+void
+sfs_bgen_wait(unsigned gen)
+{
+	KASSERT(!lock_do_i_hold(sfs_block));
+
+	spinlock_acquire(&sfs_bwait_lock);
+	while (sfs_bgen == gen) {
+		wchan_sleep(sfs_bwchan, &sfs_bwait_lock);
+	}
+	spinlock_release(&sfs_bwait_lock);
+}
+
+/*
+ * Write a dirty buffer back to disk. sfs_block is dropped during the
+ * write. The buffer is marked clean first, so if someone changes it
+ * meanwhile their sfs_brelse makes it dirty again.
+ */
+static
 int
-sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_bwrite(struct sfs_buf *buf)
 {
 	struct iovec iov;
 	struct uio ku;
+	int result;
 
-	KASSERT(len == SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sfs_block));
+	KASSERT(buf->b_valid && buf->b_dirty && !buf->b_busy);
+
+	buf->b_busy = true;
+	buf->b_dirty = false;
+	buf->b_pins++;
+	lock_release(sfs_block);
+
+	SFSUIO(&iov, &ku, buf->b_data, buf->b_block, UIO_WRITE);
+	result = sfs_rwblock(buf->b_fs, &ku);
+
+	lock_acquire(sfs_block);
+	buf->b_pins--;
+	buf->b_busy = false;
+	if (result) {
+		buf->b_dirty = true;
+	}
+	else {
+		sfs_bwritebacks++;
+	}
+	sfs_bgen_bump();
+	return result;
+}
+
+/*
+ * Get a buffer to fill: a new one while the cache is below SFS_NBUF,
+ * otherwise the least recently used one nobody is using, written back
+ * first if need be. It comes back pinned and out of the hash. This
+ * may drop sfs_block, so the caller must check again that nobody
+ * else cached the block it wants meanwhile.
+ */
+static
+int
+sfs_bgetfree(struct sfs_buf **ret)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_block));
+
+ again:
+	buf = NULL;
+	if (sfs_nbufs >= SFS_NBUF) {
+		for (buf = sfs_blru.b_lruprev; buf != &sfs_blru;
+		     buf = buf->b_lruprev) {
+			if (buf->b_pins == 0 && !buf->b_busy) {
+				break;
+			}
+		}
+		if (buf == &sfs_blru) {
+			/*
+			 * Everything is in use; grow past the limit.
+			 * sfs_bshrink frees the extra buffers again.
+			 */
+			buf = NULL;
+		}
+	}
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	if (buf == NULL) {
+		buf = kmalloc(sizeof(struct sfs_buf));
+		if (buf == NULL) {
+			return ENOMEM;
+		}
+		buf->b_data = kmalloc(SFS_BLOCKSIZE);
+		if (buf->b_data == NULL) {
+			kfree(buf);
+			return ENOMEM;
+		}
+		buf->b_valid = false;
+		buf->b_dirty = false;
+		buf->b_busy = false;
+		buf->b_pins = 0;
+		buf->b_hashnext = NULL;
+		buf->b_lrunext = buf->b_lruprev = NULL;
+		sfs_nbufs++;
+	}
+	else if (buf->b_dirty) {
+		result = sfs_bwrite(buf);
+		if (result) {
+			return result;
+		}
+		/* we let go of the lock; look again */
+		goto again;
+	}
+
+	if (buf->b_valid) {
+		sfs_bhash_remove(buf);
+		buf->b_valid = false;
+	}
+	buf->b_pins = 1;
+	sfs_blru_move(buf, true);
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Asynchronous read-ahead. On devices with devop_aio, prefetched
+ * blocks are read without waiting: their buffers stay busy and pinned
+ * until the read finishes. The completion callback runs in interrupt
+ * context, so all it does is mark the request done and bump the I/O
+ * generation; the buffers are finished off (or dropped, on error) by
+ * sfs_raio_reap with sfs_block held.
+ */
+struct sfs_raio {
+	struct devreq ra_req;
+	struct iovec ra_iov[SFS_RAMAX];
+	struct uio ra_uio;
+	struct sfs_buf *ra_bufs[SFS_RAMAX];
+	unsigned ra_count;
+	bool ra_done;			/* protected by sfs_bwait_lock */
+	int ra_result;			/* protected by sfs_bwait_lock */
+	struct sfs_raio *ra_next;
+};
+
+static struct sfs_raio *sfs_raios;	/* in flight or not yet reaped */
+
+static
+void
+sfs_raio_done(struct devreq *req, int result)
+{
+	struct sfs_raio *ra = req->dr_data;
+
+	spinlock_acquire(&sfs_bwait_lock);
+	ra->ra_result = result;
+	ra->ra_done = true;
+	sfs_bgen++;
+	wchan_wakeall(sfs_bwchan, &sfs_bwait_lock);
+	spinlock_release(&sfs_bwait_lock);
+}
+
+/*
+ * Finish off completed read-ahead requests.
+ */
+static
+void
+sfs_raio_reap(void)
+{
+	struct sfs_raio **pp, *ra;
+	struct sfs_buf *buf;
+	unsigned i;
+	bool done;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_block));
+
+	pp = &sfs_raios;
+	while (*pp != NULL) {
+		ra = *pp;
+		spinlock_acquire(&sfs_bwait_lock);
+		done = ra->ra_done;
+		result = ra->ra_result;
+		spinlock_release(&sfs_bwait_lock);
+		if (!done) {
+			pp = &ra->ra_next;
+			continue;
+		}
+
+		for (i = 0; i < ra->ra_count; i++) {
+			buf = ra->ra_bufs[i];
+			buf->b_busy = false;
+			buf->b_pins--;
+			if (result) {
+				sfs_bdrop(buf);
+			}
+		}
+		*pp = ra->ra_next;
+		kfree(ra);
+	}
 }
 
 /*
- * Write a block.
+ * Get the buffer for BLOCK, pinned. If DOREAD is false the caller is
+ * about to overwrite the whole block, so a miss does not read it.
  */
 int
-sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+sfs_bget(struct sfs_fs *sfs, daddr_t block, bool doread, struct sfs_buf **ret)
 {
+	struct sfs_buf *buf;
 	struct iovec iov;
 	struct uio ku;
+	unsigned gen;
+	int result;
+
+	lock_acquire(sfs_block);
+
+ again:
+	gen = sfs_bgen_get();
+	sfs_raio_reap();
+
+	buf = sfs_blookup(sfs->sfs_device, block);
+	if (buf != NULL && buf->b_busy) {
+		/* Being read or written; wait for it (a read may fail) */
+		lock_release(sfs_block);
+		sfs_bgen_wait(gen);
+		lock_acquire(sfs_block);
+		goto again;
+	}
+	if (buf != NULL) {
+		sfs_bhits++;
+		buf->b_pins++;
+		sfs_blru_move(buf, true);
+		lock_release(sfs_block);
+		*ret = buf;
+		return 0;
+	}
+
+	result = sfs_bgetfree(&buf);
+	if (result) {
+		lock_release(sfs_block);
+		return result;
+	}
+	if (sfs_blookup(sfs->sfs_device, block) != NULL) {
+		/* Someone else got it in while we were writing back */
+		sfs_bputfree(buf);
+		goto again;
+	}
+	sfs_bassign(buf, sfs, block);
+
+	if (doread) {
+		sfs_bmisses++;
+		buf->b_busy = true;
+		lock_release(sfs_block);
+
+		SFSUIO(&iov, &ku, buf->b_data, block, UIO_READ);
+		result = sfs_rwblock(sfs, &ku);
+
+		lock_acquire(sfs_block);
+		buf->b_busy = false;
+		sfs_bgen_bump();
+		if (result) {
+			buf->b_pins--;
+			sfs_bdrop(buf);
+			lock_release(sfs_block);
+			return result;
+		}
+	}
+
+	lock_release(sfs_block);
+	*ret = buf;
+	return 0;
+}
+
+/*
+ * Check if BLOCK is in the cache.
+ */
+static
+bool
+sfs_bcached(struct sfs_fs *sfs, daddr_t block)
+{
+	bool ret;
+
+	lock_acquire(sfs_block);
+	ret = sfs_blookup(sfs->sfs_device, block) != NULL;
+	lock_release(sfs_block);
+	return ret;
+}
+
+/*
+ * If sfs_bgetfree grew the cache past SFS_NBUF, free unused clean
+ * buffers from the LRU end until it is back at the limit. Dirty ones
+ * are left until the syncer has written them back.
+ */
+static
+void
+sfs_bshrink(void)
+{
+	struct sfs_buf *buf, *prev;
+
+	KASSERT(lock_do_i_hold(sfs_block));
+
+	for (buf = sfs_blru.b_lruprev;
+	     buf != &sfs_blru && sfs_nbufs > SFS_NBUF; buf = prev) {
+		prev = buf->b_lruprev;
+		if (buf->b_pins > 0 || buf->b_busy || buf->b_dirty) {
+			continue;
+		}
+		if (buf->b_valid) {
+			sfs_bhash_remove(buf);
+		}
+		buf->b_lruprev->b_lrunext = buf->b_lrunext;
+		buf->b_lrunext->b_lruprev = buf->b_lruprev;
+		kfree(buf->b_data);
+		kfree(buf);
+		sfs_nbufs--;
+	}
+}
+
+/*
+ * Unpin a buffer, marking it dirty if the caller changed it.
+ */
+void
+sfs_brelse(struct sfs_buf *buf, bool dirty)
+{
+	lock_acquire(sfs_block);
+	KASSERT(buf->b_pins > 0);
+	buf->b_pins--;
+	if (dirty) {
+		buf->b_dirty = true;
+	}
+	if (sfs_nbufs > SFS_NBUF) {
+		sfs_bshrink();
+	}
+	lock_release(sfs_block);
+}
+
+/*
+ * Unpin a buffer whose contents the caller failed to fill in, and
+ * drop it from the cache. The caller holds the vnode lock of the
+ * file the block belongs to, so nobody else can have it pinned, and
+ * sfs_bflush leaves pinned buffers alone, so it can't be mid-write.
+ */
+void
+sfs_bdiscard(struct sfs_buf *buf)
+{
+	lock_acquire(sfs_block);
+	KASSERT(buf->b_pins == 1);
+	KASSERT(!buf->b_busy);
+	buf->b_pins--;
+	sfs_bdrop(buf);
+	if (sfs_nbufs > SFS_NBUF) {
+		sfs_bshrink();
+	}
+	lock_release(sfs_block);
+}
+
+/*
+ * Start an asynchronous read of COUNT blocks from BLOCK into the
+ * (busy, pinned) buffers BUFS. Returns an error if the request can't
+ * be started.
+ */
+static
+int
+sfs_bprefetch_async(struct sfs_fs *sfs, daddr_t block,
+		    struct sfs_buf **bufs, unsigned count)
+{
+	struct sfs_raio *ra;
+	unsigned i;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_block));
+
+	if (sfs->sfs_device->d_ops->devop_aio == NULL) {
+		return ENOSYS;
+	}
+	ra = kmalloc(sizeof(struct sfs_raio));
+	if (ra == NULL) {
+		return ENOMEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		ra->ra_bufs[i] = bufs[i];
+		ra->ra_iov[i].iov_kbase = bufs[i]->b_data;
+		ra->ra_iov[i].iov_len = SFS_BLOCKSIZE;
+	}
+	ra->ra_count = count;
+	ra->ra_uio.uio_iov = ra->ra_iov;
+	ra->ra_uio.uio_iovcnt = count;
+	ra->ra_uio.uio_offset = (off_t)block * SFS_BLOCKSIZE;
+	ra->ra_uio.uio_resid = count * SFS_BLOCKSIZE;
+	ra->ra_uio.uio_segflg = UIO_SYSSPACE;
+	ra->ra_uio.uio_rw = UIO_READ;
+	ra->ra_uio.uio_space = NULL;
+	ra->ra_req.dr_uio = &ra->ra_uio;
+	ra->ra_req.dr_done = sfs_raio_done;
+	ra->ra_req.dr_data = ra;
+	ra->ra_done = false;
+	ra->ra_result = 0;
+
+	ra->ra_next = sfs_raios;
+	sfs_raios = ra;
+
+	result = DEVOP_AIO(sfs->sfs_device, &ra->ra_req);
+	if (result) {
+		sfs_raios = ra->ra_next;
+		kfree(ra);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Read up to SFS_RAMAX blocks from BLOCK onwards into the cache with
+ * a single device request, stopping at the first one already cached.
+ * The read is asynchronous if the device allows it.
+ */
+static
+void
+sfs_bprefetch(struct sfs_fs *sfs, daddr_t block, unsigned n)
+{
+	struct sfs_buf *bufs[SFS_RAMAX];
+	struct iovec iov[SFS_RAMAX];
+	struct uio ku;
+	unsigned i, count;
+	int result;
+
+	KASSERT(n <= SFS_RAMAX);
+
+	lock_acquire(sfs_block);
+	sfs_raio_reap();
+
+	for (count = 0; count < n; count++) {
+		if (sfs_blookup(sfs->sfs_device, block + count) != NULL) {
+			break;
+		}
+		if (sfs_bgetfree(&bufs[count])) {
+			break;
+		}
+		if (sfs_blookup(sfs->sfs_device, block + count) != NULL) {
+			sfs_bputfree(bufs[count]);
+			break;
+		}
+		/* Busy until read, so nobody uses it before then */
+		sfs_bassign(bufs[count], sfs, block + count);
+		bufs[count]->b_busy = true;
+		iov[count].iov_kbase = bufs[count]->b_data;
+		iov[count].iov_len = SFS_BLOCKSIZE;
+	}
+	if (count == 0) {
+		lock_release(sfs_block);
+		return;
+	}
+
+	sfs_breadaheads += count;
+	if (sfs_bprefetch_async(sfs, block, bufs, count) == 0) {
+		lock_release(sfs_block);
+		return;
+	}
+	lock_release(sfs_block);
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = count;
+	ku.uio_offset = (off_t)block * SFS_BLOCKSIZE;
+	ku.uio_resid = count * SFS_BLOCKSIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_READ;
+	ku.uio_space = NULL;
+	result = sfs_rwblock(sfs, &ku);
+
+	lock_acquire(sfs_block);
+	for (i = 0; i < count; i++) {
+		bufs[i]->b_busy = false;
+		bufs[i]->b_pins--;
+		if (result) {
+			sfs_bdrop(bufs[i]);
+		}
+	}
+	sfs_bgen_bump();
+	lock_release(sfs_block);
+}
+
+/*
+ * Write back the dirty buffers of device DEV, or of every device if
+ * DEV is NULL. Keeps going after an error and returns the first one.
+ *
+ * Buffers someone has pinned are being changed; they will be dirty
+ * again when released, so they are left for the next flush.
+ *
+ * The walk goes from the least recently used end. sfs_bwrite drops
+ * sfs_block, but the buffer being written is pinned and so stays in
+ * place, and its neighbor can be picked up from it afterwards.
+ * Buffers that get used meanwhile move to the other end, which is
+ * still ahead of us, so none is missed; only a buffer used again
+ * during the flush is seen twice.
+ */
+int
+sfs_bflush(struct device *dev)
+{
+	struct sfs_buf *buf;
+	int result, firsterr = 0;
+
+	lock_acquire(sfs_block);
+	for (buf = sfs_blru.b_lruprev; buf != &sfs_blru;
+	     buf = buf->b_lruprev) {
+		if (buf->b_dirty && !buf->b_busy && buf->b_pins == 0 &&
+		    (dev == NULL || buf->b_dev == dev)) {
+			result = sfs_bwrite(buf);
+			if (result && firsterr == 0) {
+				firsterr = result;
+			}
+		}
+	}
+	if (sfs_nbufs > SFS_NBUF) {
+		/* buffers left over from growing may be clean now */
+		sfs_bshrink();
+	}
+	lock_release(sfs_block);
+	return firsterr;
+}
+
+/*
+ * Forget every cached block of DEV, e.g. when it is mounted or
+ * unmounted, since it may be written through its raw device while no
+ * file system is on it. Dirty buffers are discarded, so flush first.
+ */
+void
+sfs_binval(struct device *dev)
+{
+	struct sfs_buf *buf, *next;
+	unsigned i, gen;
+
+	lock_acquire(sfs_block);
+ again:
+	gen = sfs_bgen_get();
+	sfs_raio_reap();
+
+	for (i = 0; i < SFS_NBUCKETS; i++) {
+		for (buf = sfs_bhash[i]; buf != NULL; buf = next) {
+			next = buf->b_hashnext;
+			if (buf->b_dev != dev) {
+				continue;
+			}
+			if (buf->b_busy) {
+				/* let the I/O finish first */
+				lock_release(sfs_block);
+				sfs_bgen_wait(gen);
+				lock_acquire(sfs_block);
+				goto again;
+			}
+			KASSERT(buf->b_pins == 0);
+			sfs_bdrop(buf);
+		}
+	}
+	lock_release(sfs_block);
+}
+
+/*
+ * Syncer thread: push dirty buffers out every SFS_SYNC_SECS seconds,
+ * so a crash loses at most that much written data.
+ */
+static
+void
+sfs_syncer(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(SFS_SYNC_SECS);
+		sfs_bflush(NULL);
+	}
+}
+
+/*
+ * Set up the buffer cache and start the syncer thread, the first time
+ * a volume is mounted. (Mounts are serialized by the vfs layer.)
+ */
+int
+sfs_bcache_init(void)
+{
+	struct lock *lk;
+	int result;
+
+	if (sfs_block != NULL) {
+		return 0;
+	}
+
+	lk = lock_create("sfs buffer cache");
+	if (lk == NULL) {
+		return ENOMEM;
+	}
+	sfs_bwchan = wchan_create("sfs buffer");
+	if (sfs_bwchan == NULL) {
+		lock_destroy(lk);
+		return ENOMEM;
+	}
+	sfs_blru.b_lrunext = sfs_blru.b_lruprev = &sfs_blru;
+	sfs_block = lk;
+
+	result = thread_fork("sfs syncer", NULL, sfs_syncer, NULL, 0);
+	if (result) {
+		/* not fatal; buffers still go out on sync */
+		kprintf("sfs: cannot start syncer thread: %s\n",
+			strerror(result));
+	}
+	return 0;
+}
+
+/*
+ * Print buffer cache statistics (for the kernel menu).
+ */
+void
+sfs_bcache_printstats(void)
+{
+	unsigned hits, misses, lookups;
+
+	if (sfs_block == NULL) {
+		kprintf("sfs: buffer cache not in use yet\n");
+		return;
+	}
+
+	lock_acquire(sfs_block);
+	hits = sfs_bhits;
+	misses = sfs_bmisses;
+	lookups = hits + misses;
+	kprintf("sfs: buffer cache: %u buffers, %u hits, %u misses "
+		"(%u%% hit rate)\n", sfs_nbufs, hits, misses,
+		lookups ? hits * 100 / lookups : 0);
+	kprintf("sfs: buffer cache: %u blocks read ahead, %u written back\n",
+		sfs_breadaheads, sfs_bwritebacks);
+	lock_release(sfs_block);
+}
+
+/*
+ * Read a block.
+ */
+int
+sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_buf *buf;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = sfs_bget(sfs, block, true, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buf->b_data, SFS_BLOCKSIZE);
+	sfs_brelse(buf, false);
+	return 0;
+}
+
+/*
+ * Write a block. It reaches the disk when the buffer is flushed.
+ */
+int
+sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_buf *buf;
+	int result;
+
+	KASSERT(len == SFS_BLOCKSIZE);
+
+	result = sfs_bget(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	memcpy(buf->b_data, data, SFS_BLOCKSIZE);
+	sfs_brelse(buf, true);
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -150,16 +984,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -169,14 +995,11 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
 
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, NULL, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -184,40 +1007,24 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache and perform the
+	 * requested operation into/out of it. A write just leaves
+	 * the buffer dirty.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_bget(sfs, diskblock, true, &buf);
 	if (result) {
 		return result;
 	}
-
-	/*
-	 * If it was a write, write back the modified block.
-	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
-	}
-
-	return 0;
+	result = uiomove(buf->b_data+skipstart, len, uio);
+	sfs_brelse(buf, uio->uio_rw == UIO_WRITE);
+	return result;
 }
 
 /*
@@ -228,20 +1035,23 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf, *freshbuf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
+	bool cached;
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/*
+	 * Look up the disk block number. A write overwrites the whole
+	 * block, so a newly allocated one needn't be zeroed first;
+	 * sfs_bmap hands back its buffer instead.
+	 */
+	result = sfs_bmap(sv, fileblock, doalloc,
+			  doalloc ? &freshbuf : NULL, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -258,31 +1068,77 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * A new block still holds some old file's data; if copying in
+	 * fails partway, zero the rest rather than let that show.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (doalloc && freshbuf != NULL) {
+		result = uiomove(freshbuf->b_data, SFS_BLOCKSIZE, uio);
+		if (result) {
+			bzero(freshbuf->b_data, SFS_BLOCKSIZE);
+		}
+		sfs_brelse(freshbuf, true);
+		return result;
+	}
 
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * Go through the buffer cache. A write covers the whole block,
+	 * so there's no need to read it in first; but if copying in
+	 * fails partway the buffer then holds garbage, so throw it out
+	 * unless it had valid contents to begin with.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
+	cached = sfs_bcached(sfs, diskblock);
+	result = sfs_bget(sfs, diskblock, uio->uio_rw == UIO_READ, &buf);
+	if (result) {
+		return result;
+	}
+	result = uiomove(buf->b_data, SFS_BLOCKSIZE, uio);
+	if (result && uio->uio_rw == UIO_WRITE && !cached) {
+		sfs_bdiscard(buf);
+		return result;
+	}
+	sfs_brelse(buf, uio->uio_rw == UIO_WRITE);
+	return result;
+}
 
-	result = sfs_rwblock(sfs, uio);
+/*
+ * Sequential read-ahead: pull up to SFS_RAMAX blocks of the file from
+ * FILEBLOCK onwards into the buffer cache, issuing one device request
+ * per run of consecutive disk blocks. Errors are ignored; the blocks
+ * just get read again when they are actually needed.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	uint32_t endblock, i;
+	daddr_t diskblock, runstart = 0;
+	unsigned runlen = 0;
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	endblock = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	if (endblock > fileblock + SFS_RAMAX) {
+		endblock = fileblock + SFS_RAMAX;
+	}
 
-	return result;
+	for (i = fileblock; i < endblock; i++) {
+		if (sfs_bmap(sv, i, false, NULL, &diskblock)) {
+			break;
+		}
+		if (runlen > 0 && diskblock != runstart + runlen) {
+			sfs_bprefetch(sfs, runstart, runlen);
+			runlen = 0;
+		}
+		if (diskblock == 0) {
+			continue;
+		}
+		if (runlen == 0) {
+			runstart = diskblock;
+		}
+		runlen++;
+	}
+	if (runlen > 0) {
+		sfs_bprefetch(sfs, runstart, runlen);
+	}
 }
 
 /*
@@ -295,8 +1151,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
+	uint32_t firstblock;
+	bool sequential = false;
 
 	origresid = uio->uio_resid;
+	firstblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -317,6 +1176,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 			KASSERT(uio->uio_resid > extraresid);
 			uio->uio_resid -= extraresid;
 		}
+
+		/*
+		 * Reading on from where the last read of this file
+		 * stopped (or from the start) looks sequential, so
+		 * read ahead once this read is done.
+		 */
+		sequential = (firstblock == 0 || firstblock == sv->sv_ranext);
 	}
 
 	/*
@@ -373,6 +1239,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
  out:
 
+	if (uio->uio_rw == UIO_READ && uio->uio_resid != origresid) {
+		sv->sv_ranext = DIVROUNDUP(uio->uio_offset, SFS_BLOCKSIZE);
+		if (result == 0 && sequential) {
+			sfs_readahead(sv, sv->sv_ranext);
+		}
+	}
+
 	/* If writing and we did anything, adjust file length */
 	if (uio->uio_resid != origresid &&
 	    uio->uio_rw == UIO_WRITE &&
@@ -411,28 +1284,17 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	uint32_t vnblock;
 	uint32_t blockoffset;
 	daddr_t diskblock;
+	struct sfs_buf *buf;
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
 	blockoffset = actualpos % SFS_BLOCKSIZE;
 
 	/* Get the disk block number */
 	doalloc = (rw == UIO_WRITE);
-	result = sfs_bmap(sv, vnblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, vnblock, doalloc, NULL, &diskblock);
 	if (result) {
 		return result;
 	}
@@ -446,26 +1308,21 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block from the buffer cache */
+	result = sfs_bget(sfs, diskblock, true, &buf);
 	if (result) {
 		return result;
 	}
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, buf->b_data + blockoffset, len);
+		sfs_brelse(buf, false);
 	}
 	else {
-		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* Update the selected region; it gets written back later */
+		memcpy(buf->b_data + blockoffset, data, len);
+		sfs_brelse(buf, true);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
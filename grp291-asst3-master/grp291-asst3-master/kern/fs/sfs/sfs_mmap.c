@@ -0,0 +1,218 @@
+/*
+ * SFS filesystem
+ *
+ * Page cache for mmap.
+ *
+ * Each page of a file that is mapped into a user address space is
+ * cached in one frame, and every mapping of the page shares it. The
+ * cache holds a reference to the frame and each page table entry
+ * mapping it holds another, so a frame whose reference count is 1 is
+ * no longer mapped anywhere.
+ *
+ * A page is marked dirty once it is mapped writable. Dirty pages are
+ * written back by fsync (and so by sync, munmap and reclaim), and by
+ * read and write before they touch the same part of the file. A page
+ * that is still mapped may be written again, so it stays dirty; a
+ * page nobody maps any more is written back one last time and then
+ * dropped from the cache.
+ *
+ * The cache is protected by the file's vnode lock.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vm.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * Find the slot for page PAGENO in the cache: its index if it is
+ * cached, otherwise the index it would be inserted at.
+ */
+static
+unsigned
+sfs_mpage_search(struct sfs_vnode *sv, uint32_t pageno)
+{
+	unsigned lo = 0, hi = sv->sv_nmpages;
+
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (sv->sv_mpages[mid].mp_pageno < pageno) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Read or write the part of page PAGENO that lies within the file,
+ * through the kernel mapping of FRAME. Writes never extend the file.
+ */
+static
+int
+sfs_mpage_io(struct sfs_vnode *sv, uint32_t pageno, paddr_t frame,
+	     enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t pos, size;
+	size_t len;
+	int result;
+
+	pos = (off_t)pageno * PAGE_SIZE;
+	size = sv->sv_i.sfi_size;
+	if (pos >= size) {
+		return 0;
+	}
+	len = (size - pos > PAGE_SIZE) ? PAGE_SIZE : size - pos;
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(frame), len, pos, rw);
+	result = sfs_io(sv, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Get the page at OFFSET for vop_mmap. On a miss the zeroed frame the
+ * caller passed in becomes the cache's copy of the page.
+ */
+int
+sfs_mpage_get(struct sfs_vnode *sv, off_t offset, bool write, paddr_t *frame)
+{
+	uint32_t pageno;
+	unsigned pos;
+	struct sfs_mpage *mp;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+	pageno = offset / PAGE_SIZE;
+
+	pos = sfs_mpage_search(sv, pageno);
+	if (pos == sv->sv_nmpages || sv->sv_mpages[pos].mp_pageno != pageno) {
+		/* Not cached; read it into the caller's frame */
+		result = sfs_mpage_io(sv, pageno, *frame, UIO_READ);
+		if (result) {
+			return result;
+		}
+
+		if (sv->sv_nmpages == sv->sv_maxmpages) {
+			unsigned max;
+			struct sfs_mpage *pages;
+
+			max = sv->sv_maxmpages ? sv->sv_maxmpages * 2 : 8;
+			pages = kmalloc(max * sizeof(struct sfs_mpage));
+			if (pages == NULL) {
+				return ENOMEM;
+			}
+			if (sv->sv_nmpages > 0) {
+				memcpy(pages, sv->sv_mpages,
+				       sv->sv_nmpages * sizeof(struct sfs_mpage));
+			}
+			kfree(sv->sv_mpages);
+			sv->sv_mpages = pages;
+			sv->sv_maxmpages = max;
+		}
+		memmove(&sv->sv_mpages[pos + 1], &sv->sv_mpages[pos],
+			(sv->sv_nmpages - pos) * sizeof(struct sfs_mpage));
+		sv->sv_nmpages++;
+		sv->sv_mpages[pos].mp_pageno = pageno;
+		sv->sv_mpages[pos].mp_frame = *frame;
+		sv->sv_mpages[pos].mp_dirty = false;
+		frame_setcached(*frame);
+	}
+
+	mp = &sv->sv_mpages[pos];
+	if (write) {
+		mp->mp_dirty = true;
+	}
+	frame_incref(mp->mp_frame);
+	*frame = mp->mp_frame;
+	return 0;
+}
+
+/*
+ * Write back the dirty cached pages overlapping LEN bytes at POS. If
+ * DROP is set, cached pages that are no longer mapped are released
+ * too (those are always clean after the write-back). Page replacement
+ * unmaps cached pages but can't take them out of the cache, so this
+ * is also how the VM gets their frames back (see fault_shared).
+ */
+int
+sfs_mpage_sync(struct sfs_vnode *sv, off_t pos, off_t len, bool drop)
+{
+	struct sfs_mpage *mp;
+	bool mapped;
+	unsigned i;
+	int result;
+
+	i = sfs_mpage_search(sv, pos / PAGE_SIZE);
+	while (i < sv->sv_nmpages) {
+		mp = &sv->sv_mpages[i];
+		if ((off_t)mp->mp_pageno * PAGE_SIZE >= pos + len) {
+			break;
+		}
+		mapped = frame_refcount(mp->mp_frame) > 1;
+
+		if (mp->mp_dirty) {
+			result = sfs_mpage_io(sv, mp->mp_pageno, mp->mp_frame,
+					      UIO_WRITE);
+			if (result) {
+				return result;
+			}
+			mp->mp_dirty = mapped;
+		}
+
+		if (drop && !mapped) {
+			free_kpages(PADDR_TO_KVADDR(mp->mp_frame));
+			sv->sv_nmpages--;
+			memmove(&sv->sv_mpages[i], &sv->sv_mpages[i + 1],
+				(sv->sv_nmpages - i) * sizeof(struct sfs_mpage));
+			continue;
+		}
+		i++;
+	}
+
+	if (sv->sv_nmpages == 0) {
+		kfree(sv->sv_mpages);
+		sv->sv_mpages = NULL;
+		sv->sv_maxmpages = 0;
+	}
+	return 0;
+}
+
+/*
+ * Reload the cached pages overlapping LEN bytes at POS after write()
+ * has changed that part of the file, so mappings see the new data.
+ * The caller wrote back any dirty pages there first.
+ */
+int
+sfs_mpage_refresh(struct sfs_vnode *sv, off_t pos, off_t len)
+{
+	struct sfs_mpage *mp;
+	unsigned i;
+	int result;
+
+	for (i = sfs_mpage_search(sv, pos / PAGE_SIZE);
+	     i < sv->sv_nmpages; i++) {
+		mp = &sv->sv_mpages[i];
+		if ((off_t)mp->mp_pageno * PAGE_SIZE >= pos + len) {
+			break;
+		}
+		result = sfs_mpage_io(sv, mp->mp_pageno, mp->mp_frame,
+				      UIO_READ);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
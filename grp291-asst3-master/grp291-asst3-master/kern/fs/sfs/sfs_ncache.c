@@ -0,0 +1,233 @@
+/*
+ * SFS filesystem
+ *
+ * Directory name lookup cache.
+ *
+ * Remembers the outcome of recent name lookups in directories, for
+ * all mounted volumes: either the inode number and slot a name was
+ * found at, or that it was not there at all (a negative entry). Hits
+ * save scanning the directory, which for a name that doesn't exist
+ * means reading every slot.
+ *
+ * Entries are keyed by volume, directory inode number and name, and
+ * kept up to date by sfs_dir_link and sfs_dir_unlink (and so rename,
+ * which is built from them). The cache holds no vnode references.
+ *
+ * The cache has its own lock, created when the first volume is
+ * mounted. Callers hold the directory's vnode lock, so an entry can't
+ * go stale between looking it up and acting on it.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+#define SFS_NCACHE_SIZE		128	/* entries */
+#define SFS_NCACHE_BUCKETS	64	/* hash chains */
+
+struct sfs_nentry {
+	struct sfs_fs *ne_fs;			/* volume */
+	uint32_t ne_dir;			/* directory inode number */
+	uint32_t ne_ino;			/* SFS_NOINO if not there */
+	int ne_slot;				/* slot, if there */
+	char ne_name[SFS_NAMELEN];		/* name looked up */
+	struct sfs_nentry *ne_hashnext;		/* hash chain */
+	struct sfs_nentry *ne_lrunext;		/* toward least recent */
+	struct sfs_nentry *ne_lruprev;		/* toward most recent */
+};
+
+static struct lock *sfs_nlock;		/* protects the cache */
+static struct sfs_nentry *sfs_nhash[SFS_NCACHE_BUCKETS];
+static struct sfs_nentry sfs_nlru;	/* list head; ne_lrunext is newest */
+static unsigned sfs_nentries;
+
+static
+unsigned
+sfs_nbucket(struct sfs_fs *sfs, uint32_t dir, const char *name)
+{
+	uint32_t hash = dir ^ ((uintptr_t)sfs >> 4);
+
+	while (*name) {
+		hash = hash * 31 + (unsigned char)*name++;
+	}
+	return hash % SFS_NCACHE_BUCKETS;
+}
+
+static
+struct sfs_nentry *
+sfs_nfind(struct sfs_fs *sfs, uint32_t dir, const char *name)
+{
+	struct sfs_nentry *ne;
+
+	for (ne = sfs_nhash[sfs_nbucket(sfs, dir, name)]; ne != NULL;
+	     ne = ne->ne_hashnext) {
+		if (ne->ne_fs == sfs && ne->ne_dir == dir &&
+		    !strcmp(ne->ne_name, name)) {
+			return ne;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Unlink an entry from the LRU list.
+ */
+static
+void
+sfs_nlru_remove(struct sfs_nentry *ne)
+{
+	ne->ne_lrunext->ne_lruprev = ne->ne_lruprev;
+	ne->ne_lruprev->ne_lrunext = ne->ne_lrunext;
+}
+
+/*
+ * Put an entry at the most recently used end of the LRU list.
+ */
+static
+void
+sfs_nlru_front(struct sfs_nentry *ne)
+{
+	ne->ne_lruprev = &sfs_nlru;
+	ne->ne_lrunext = sfs_nlru.ne_lrunext;
+	ne->ne_lrunext->ne_lruprev = ne;
+	sfs_nlru.ne_lrunext = ne;
+}
+
+/*
+ * Take an entry out of the cache entirely.
+ */
+static
+void
+sfs_nremove(struct sfs_nentry *ne)
+{
+	struct sfs_nentry **pp;
+
+	pp = &sfs_nhash[sfs_nbucket(ne->ne_fs, ne->ne_dir, ne->ne_name)];
+	while (*pp != ne) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->ne_hashnext;
+	}
+	*pp = ne->ne_hashnext;
+	sfs_nlru_remove(ne);
+	sfs_nentries--;
+	kfree(ne);
+}
+
+/*
+ * Look up NAME in directory SV. Returns true on a hit, handing back
+ * the inode number (SFS_NOINO if the name is known not to exist) and
+ * slot.
+ */
+bool
+sfs_ncache_lookup(struct sfs_vnode *sv, const char *name,
+		  uint32_t *ino, int *slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_nentry *ne;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	lock_acquire(sfs_nlock);
+	ne = sfs_nfind(sfs, sv->sv_ino, name);
+	if (ne == NULL) {
+		lock_release(sfs_nlock);
+		return false;
+	}
+
+	sfs_nlru_remove(ne);
+	sfs_nlru_front(ne);
+	*ino = ne->ne_ino;
+	*slot = ne->ne_slot;
+	lock_release(sfs_nlock);
+	return true;
+}
+
+/*
+ * Record that NAME in directory SV is inode INO at slot SLOT, or that
+ * it does not exist if INO is SFS_NOINO. Replaces anything recorded
+ * for the name before.
+ */
+void
+sfs_ncache_enter(struct sfs_vnode *sv, const char *name,
+		 uint32_t ino, int slot)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_nentry *ne;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (strlen(name) + 1 > SFS_NAMELEN) {
+		/* can't be in a directory; not worth remembering */
+		return;
+	}
+
+	lock_acquire(sfs_nlock);
+	ne = sfs_nfind(sfs, sv->sv_ino, name);
+	if (ne != NULL) {
+		sfs_nlru_remove(ne);
+	}
+	else {
+		if (sfs_nentries >= SFS_NCACHE_SIZE) {
+			sfs_nremove(sfs_nlru.ne_lruprev);
+		}
+		ne = kmalloc(sizeof(struct sfs_nentry));
+		if (ne == NULL) {
+			/* it's only a cache */
+			lock_release(sfs_nlock);
+			return;
+		}
+		ne->ne_fs = sfs;
+		ne->ne_dir = sv->sv_ino;
+		strcpy(ne->ne_name, name);
+
+		ne->ne_hashnext = sfs_nhash[sfs_nbucket(sfs, sv->sv_ino, name)];
+		sfs_nhash[sfs_nbucket(sfs, sv->sv_ino, name)] = ne;
+		sfs_nentries++;
+	}
+
+	ne->ne_ino = ino;
+	ne->ne_slot = slot;
+	sfs_nlru_front(ne);
+	lock_release(sfs_nlock);
+}
+
+/*
+ * Forget everything about directory DIR on SFS, or about every
+ * directory on SFS if DIR is SFS_NOINO; for when a directory goes
+ * away or the volume is unmounted.
+ */
+void
+sfs_ncache_purge(struct sfs_fs *sfs, uint32_t dir)
+{
+	struct sfs_nentry *ne, *next;
+
+	lock_acquire(sfs_nlock);
+	for (ne = sfs_nlru.ne_lrunext; ne != &sfs_nlru; ne = next) {
+		next = ne->ne_lrunext;
+		if (ne->ne_fs == sfs && (dir == SFS_NOINO || ne->ne_dir == dir)) {
+			sfs_nremove(ne);
+		}
+	}
+	lock_release(sfs_nlock);
+}
+
+/*
+ * Set up the cache, the first time a volume is mounted. (Mounts are
+ * serialized by the vfs layer.)
+ */
+int
+sfs_ncache_init(void)
+{
+	if (sfs_nlock != NULL) {
+		return 0;
+	}
+	sfs_nlock = lock_create("sfs name cache");
+	if (sfs_nlock == NULL) {
+		return ENOMEM;
+	}
+	sfs_nlru.ne_lrunext = sfs_nlru.ne_lruprev = &sfs_nlru;
+	return 0;
+}
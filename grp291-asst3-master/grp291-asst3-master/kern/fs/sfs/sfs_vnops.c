@@ -38,6 +38,7 @@
 #include <stat.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -91,41 +92,143 @@ sfs_eachopendir(struct vnode *v, int openflags)
 }
 
 /*
- * Called for read(). sfs_io() does the work.
+ * Do I/O on a kernel-space uio with the vnode lock held. Mapped pages
+ * of the file may be newer than the disk, so write those back first;
+ * after a write, reload them so neither the write nor the mappings
+ * lose data.
  */
 static
 int
-sfs_read(struct vnode *v, struct uio *uio)
+sfs_lockedio(struct sfs_vnode *sv, struct uio *uio)
 {
-	struct sfs_vnode *sv = v->vn_data;
+	off_t pos = uio->uio_offset;
+	off_t len = uio->uio_resid;
 	int result;
 
-	KASSERT(uio->uio_rw==UIO_READ);
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
+	if (sv->sv_nmpages > 0) {
+		result = sfs_mpage_sync(sv, pos, len, false);
+		if (result) {
+			lock_release(sv->sv_lock);
+			return result;
+		}
+	}
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	if (result == 0 && uio->uio_rw == UIO_WRITE && sv->sv_nmpages > 0) {
+		result = sfs_mpage_refresh(sv, pos, len);
+	}
+	lock_release(sv->sv_lock);
 
 	return result;
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Do I/O on a user-space uio. The data goes through a kernel bounce
+ * buffer SFS_BOUNCESIZE bytes at a time, and the vnode lock is only
+ * held for the file side of each chunk, never while copying to or
+ * from user memory. A fault on the user buffer can need to read this
+ * or another file (a lazily loaded page of an executable, or a page
+ * mapped with mmap), which would self-deadlock or deadlock crosswise
+ * if we still held the lock.
+ *
+ * This means a large read or write is atomic only per chunk with
+ * respect to other I/O on the same file.
  */
 static
 int
-sfs_write(struct vnode *v, struct uio *uio)
+sfs_userio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *bounce;
+	size_t len, got;
+	off_t pos;
+	int result = 0;
+
+	bounce = kmalloc(SFS_BOUNCESIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > SFS_BOUNCESIZE) {
+			len = SFS_BOUNCESIZE;
+		}
+		pos = uio->uio_offset;
+
+		if (uio->uio_rw == UIO_WRITE) {
+			result = uiomove(bounce, len, uio);
+			if (result) {
+				break;
+			}
+			uio_kinit(&iov, &ku, bounce, len, pos, UIO_WRITE);
+			result = sfs_lockedio(sv, &ku);
+			if (result) {
+				break;
+			}
+			/* sfs_io only stops short of the end on error */
+			KASSERT(ku.uio_resid == 0);
+		}
+		else {
+			uio_kinit(&iov, &ku, bounce, len, pos, UIO_READ);
+			result = sfs_lockedio(sv, &ku);
+			if (result) {
+				break;
+			}
+			got = len - ku.uio_resid;
+			result = uiomove(bounce, got, uio);
+			if (result || got < len) {
+				/* error, or end of file */
+				break;
+			}
+		}
+	}
+
+	kfree(bounce);
+	return result;
+}
+
+/*
+ * Called for read() and write(). Kernel buffers can't fault, so
+ * those go straight to the file.
+ */
+static
+int
+sfs_rw(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
 
-	KASSERT(uio->uio_rw==UIO_WRITE);
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return sfs_lockedio(sv, uio);
+	}
+	return sfs_userio(sv, uio);
+}
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+/*
+ * Called for read(). sfs_io() does the work.
+ */
+static
+int
+sfs_read(struct vnode *v, struct uio *uio)
+{
+	KASSERT(uio->uio_rw==UIO_READ);
 
-	return result;
+	return sfs_rw(v, uio);
+}
+
+/*
+ * Called for write(). sfs_io() does the work.
+ */
+static
+int
+sfs_write(struct vnode *v, struct uio *uio)
+{
+	KASSERT(uio->uio_rw==UIO_WRITE);
+
+	return sfs_rw(v, uio);
 }
 
 /*
@@ -164,8 +267,10 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	lock_release(sv->sv_lock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -185,16 +290,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes once the vnode is loaded; no lock needed */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: %s: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -224,22 +326,38 @@ sfs_fsync(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_acquire(sv->sv_lock);
+	/* Mapped pages first, since writing them may change the inode */
+	result = sfs_mpage_sync(sv, 0, SFS_MPAGE_ALL, true);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	lock_release(sv->sv_lock);
 
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Pages come from the file's mmap page cache in
+ * sfs_mmap.c.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v, off_t offset, bool write, paddr_t *frame)
 {
-	(void)v;
-	return ENOSYS;
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	if (frame == NULL) {
+		/* Any file can be mapped */
+		return 0;
+	}
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_mpage_get(sv, offset, write, frame);
+	lock_release(sv->sv_lock);
+
+	return result;
 }
 
 /*
@@ -250,8 +368,13 @@ int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	lock_release(sv->sv_lock);
 
-	return sfs_itrunc(sv, len);
+	return result;
 }
 
 /*
@@ -289,18 +412,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -308,18 +431,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -329,20 +452,22 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_absvn;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -361,26 +486,27 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
-
 	/* Hard links to directories aren't allowed. */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
+	lock_acquire(sv->sv_lock);
+
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -396,28 +522,37 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
+	if (victim == sv) {
+		/* can't lock it twice, and can't remove it anyway */
+		lock_release(sv->sv_lock);
+		VOP_DECREF(&victim->sv_absvn);
+		return EINVAL;
+	}
 
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_absvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -438,15 +573,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -467,8 +602,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -480,14 +617,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	lock_release(sv->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -503,11 +643,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 		panic("sfs: %s: rename: Cannot recover\n",
 		      sfs->sfs_sb.sb_volname);
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -525,15 +667,12 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* Nothing here changes the directory, so no lock is needed */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -541,7 +680,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_absvn);
 	*ret = &sv->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -559,22 +697,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_absvn;
 
-	vfs_biglock_release();
 	return 0;
 }
 
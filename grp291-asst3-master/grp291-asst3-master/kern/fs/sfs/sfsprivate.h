@@ -37,19 +37,45 @@
 extern const struct vnode_ops sfs_fileops;
 extern const struct vnode_ops sfs_dirops;
 
+/*
+ * Buffer cache entry (in sfs_io.c). B_DEV and B_BLOCK name the cached
+ * block; B_FS is the volume it was read through, used to write it back.
+ */
+struct sfs_buf {
+	struct device *b_dev;		/* device the block is on */
+	struct sfs_fs *b_fs;		/* volume for write-back */
+	daddr_t b_block;		/* block number on the device */
+	bool b_valid;			/* holds a block (and is hashed) */
+	bool b_dirty;			/* needs writing back */
+	bool b_busy;			/* being read or written */
+	unsigned b_pins;		/* callers using b_data */
+	struct sfs_buf *b_hashnext;	/* hash chain */
+	struct sfs_buf *b_lrunext;	/* LRU list, toward least recent */
+	struct sfs_buf *b_lruprev;	/* LRU list, toward most recent */
+	char *b_data;			/* SFS_BLOCKSIZE bytes */
+};
+
+/* Most blocks read ahead (or prefetched) at once */
+#define SFS_RAMAX 8
+
+/* Bytes of user I/O done per vnode lock hold (sfs_userio) */
+#define SFS_BOUNCESIZE (8 * SFS_BLOCKSIZE)
+
 /* Macro for initializing a uio structure */
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
 
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_clearblock(struct sfs_fs *sfs, daddr_t block);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, bool clear,
+	       daddr_t *diskblock);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
-		daddr_t *diskblock);
+	     struct sfs_buf **freshbuf, daddr_t *diskblock);
 int sfs_itrunc(struct sfs_vnode *sv, off_t len);
 
 /* Functions in sfs_dir.c */
@@ -71,11 +97,33 @@ int sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret);
 int sfs_getroot(struct fs *fs, struct vnode **ret);
 
 /* Functions in sfs_io.c */
+int sfs_bget(struct sfs_fs *sfs, daddr_t block, bool doread,
+	     struct sfs_buf **ret);
+void sfs_brelse(struct sfs_buf *buf, bool dirty);
+void sfs_bdiscard(struct sfs_buf *buf);
+int sfs_bflush(struct device *dev);
+void sfs_binval(struct device *dev);
+int sfs_bcache_init(void);
 int sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len);
 int sfs_io(struct sfs_vnode *sv, struct uio *uio);
 int sfs_metaio(struct sfs_vnode *sv, off_t pos, void *data, size_t len,
 	       enum uio_rw rw);
 
+/* Functions in sfs_mmap.c */
+#define SFS_MPAGE_ALL ((off_t)1 << 62)	/* sfs_mpage_sync length for all */
+int sfs_mpage_get(struct sfs_vnode *sv, off_t offset, bool write,
+		  paddr_t *frame);
+int sfs_mpage_sync(struct sfs_vnode *sv, off_t pos, off_t len, bool drop);
+int sfs_mpage_refresh(struct sfs_vnode *sv, off_t pos, off_t len);
+
+/* Functions in sfs_ncache.c */
+bool sfs_ncache_lookup(struct sfs_vnode *sv, const char *name,
+		       uint32_t *ino, int *slot);
+void sfs_ncache_enter(struct sfs_vnode *sv, const char *name,
+		      uint32_t ino, int slot);
+void sfs_ncache_purge(struct sfs_fs *sfs, uint32_t dir);
+int sfs_ncache_init(void);
+
 
 #endif /* _SFSPRIVATE_H_ */
@@ -39,17 +39,33 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct cpu;
 
 // we need to keep track of the base, size and permisions
-// base is the base address of the region
+// base is the base address of the region (page aligned)
 // size is the number of pages in the region
 // flag is a value based on #defines in elf.h line 191-193
-// next is next
-struct region_list {
+// vnode, file_* describe the ELF segment the region is demand loaded
+// from: file_size bytes at file_offset go to file_vaddr onwards, the
+// rest of the region is zero-filled. vnode is NULL for anonymous memory.
+// A region with SHARED_FLAG is an mmap of the file: its pages come from
+// the file's page cache and writes go back to the file.
+struct region {
         vaddr_t base;
         size_t size;
         int flag;
-        struct region_list *next;
+        struct vnode *vnode;
+        off_t file_offset;
+        vaddr_t file_vaddr;
+        size_t file_size;
+};
+
+// a populated page table leaf: its index in the directory and the
+// range [lo, hi) of its PTEs that have ever been set
+struct pt_leaf {
+        uint16_t dir;
+        uint16_t lo;
+        uint16_t hi;
 };
 
 /*
@@ -73,25 +89,71 @@ struct addrspace {
 #else
         /* Put stuff here for your VM system */
         vaddr_t stack;
-        struct region_list *head;
-        
-        // pagetable
-        paddr_t ***pagetable;
+
+        // regions, sorted by base and never overlapping
+        struct region *regions;
+        unsigned nregions;
+        unsigned maxregions;
+
+        // the heap sits after the last ELF segment and is kept out of
+        // the region array, since sbrk resizes it. heap_break is the
+        // byte-granular break; heap.size covers it in whole pages.
+        struct region heap;
+        vaddr_t heap_break;
+
+        // two level page table: pt_dir[PT_DIR_INDEX(va)] is a page of
+        // PT_LEAF_SIZE PTEs, or NULL. pt_leaves lists the populated
+        // leaves sorted by directory index, so copying and destroying
+        // only visit the mapped parts of the table.
+        paddr_t **pt_dir;
+        struct pt_leaf *pt_leaves;
+        unsigned pt_nleaves;
+        unsigned pt_maxleaves;
+
+        // TLB address space ID, the CPU it was handed out on and that
+        // CPU's generation it belongs to
+        uint32_t asid;
+        uint32_t asid_gen;
+        struct cpu *asid_cpu;
 #endif
 };
 
-#define PT_ROOT_SIZE 256
-#define PT_NODE_SIZE 64
+#define PT_DIR_SIZE 1024
+#define PT_LEAF_SIZE 1024
 #define PAGE_SIZE 4096
 #define READ_FLAG 0x4
 #define WRITE_FLAG 0x2
 #define EXEC_FLAG  0x1
-#define LOAD_FLAG 0x8
-#define STACK_PAGE 16
+#define SHARED_FLAG 0x8
+// user stack pages; must be well over ARG_MAX so a full argv still
+// leaves the program some stack
+#define STACK_PAGE 32
+
+// a leaf holds the PTEs of 4MB of address space and fills one page
+#define PT_DIR_INDEX(va) ((va) >> 22)
+#define PT_LEAF_INDEX(va) (((va) >> 12) & (PT_LEAF_SIZE - 1))
 
-#define ROOT_PAGE 0xff000000
-#define SEC_LVL_PAGE 0xfc0000
-#define LEAF_PAGE 0x3f000
+// a leaf PTE holds either a frame address or, with PTE_SWAPPED set,
+// the swap slot the page was written to. Bits 1-3 hold the page's
+// protection (READ/WRITE/EXEC_FLAG from its region) in both cases,
+// so a mapped PTE is never 0.
+#define PTE_SWAPPED 0x1
+#define PTE_FRAME 0xfffff000
+#define PTE_PROT_SHIFT 1
+#define PTE_PROT_MASK (0x7 << PTE_PROT_SHIFT)
+#define PTE_IS_SWAPPED(pte) (((pte) & PTE_SWAPPED) != 0)
+#define PTE_SWAP_SLOT(pte) ((pte) >> 12)
+#define PTE_MAKE_SWAPPED(slot) (((paddr_t)(slot) << 12) | PTE_SWAPPED)
+#define PTE_MAKE_PROT(flag) (((paddr_t)(flag) & 0x7) << PTE_PROT_SHIFT)
+#define PTE_PROT(pte) (((pte) & PTE_PROT_MASK) >> PTE_PROT_SHIFT)
+// a frame mapped from a file page cache: shared on purpose, so writes
+// do not break the share
+#define PTE_SHARED 0x10
+// on a swapped PTE: the page is being written to or read from its
+// slot with vm_lock dropped. Nothing else may change the PTE or use
+// the slot until the transfer ends; wait with swap_wait.
+#define PTE_BUSY 0x20
+#define PTE_FLAGS (PTE_PROT_MASK | PTE_SHARED)
 /*
  * Functions in addrspace.c:
  *
@@ -119,6 +181,10 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_backing - make the region containing VADDR demand load
+ *                its contents from a file the first time each page
+ *                is touched.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -129,6 +195,15 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_sbrk   - move the heap break by AMOUNT bytes and hand back the
+ *                old break. Shrinking releases the pages given up.
+ *
+ *    as_mmap   - map LEN bytes of file V from OFFSET at an address of
+ *                the kernel's choosing, shared with other mappings.
+ *
+ *    as_munmap - remove the mapping made by as_mmap at ADDR, writing
+ *                back what was changed.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -144,9 +219,17 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_backing(struct addrspace *as, vaddr_t vaddr,
+                                    struct vnode *v, off_t offset,
+                                    size_t filesize);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, struct vnode *v, size_t len,
+                          bool writeable, off_t offset, vaddr_t *addr);
+int               as_munmap(struct addrspace *as, vaddr_t addr);
 
 
 /*
@@ -159,4 +242,27 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
 
 
+/*
+ * Page table functions in vm.c
+ *    get_frame - the leaf PTE for PAGE_ADDR, or 0 if there is none.
+ *    add_PTE   - set the leaf PTE for PAGE_ADDR, allocating a leaf.
+ *    pt_alloc_leaf - a zeroed page for a leaf, evicting if need be.
+ *    pt_unmap_range - release the pages in [START, END) and drop their
+ *                PTEs and TLB entries; emptied leaves are freed.
+ *    find_region - the region containing ADDR, or NULL.
+ *
+ * vm_lock serialises page table changes against page replacement,
+ * which edits the page tables of other address spaces. Swap I/O runs
+ * without it, with the PTE marked PTE_BUSY meanwhile.
+ */
+
+paddr_t get_frame(vaddr_t page_addr, struct addrspace *as);
+int add_PTE(vaddr_t page_addr, paddr_t frame_addr, struct addrspace *as);
+paddr_t *pt_alloc_leaf(void);
+void pt_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end);
+struct region *find_region(struct addrspace *as, vaddr_t addr);
+
+extern struct lock *vm_lock;
+
+
 #endif /* _ADDRSPACE_H_ */
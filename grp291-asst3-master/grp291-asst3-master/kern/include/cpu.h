@@ -34,6 +34,13 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <platform/maxcpus.h>  /* for MAXCPUS */
+
+/*
+ * Number of run queue levels in the scheduler (see schedule() in
+ * thread.c). Level 0 has the highest priority.
+ */
+#define CPU_NRUNQUEUES 4
 
 
 /*
@@ -67,7 +74,7 @@ struct cpu {
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[CPU_NRUNQUEUES]; /* Run queues, by level */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -117,6 +124,14 @@ void cpu_hatch(unsigned software_number);
  */
 void cpu_identify(char *buf, size_t max);
 
+/*
+ * Cheap timestamps. cpu_cycles reads the current CPU's free-running
+ * cycle counter, which wraps; cpu_cyclerate is how many cycles it
+ * counts per second.
+ */
+uint32_t cpu_cycles(void);
+uint32_t cpu_cyclerate(void);
+
 /*
  * Hardware-level interrupt on/off, for the current CPU.
  *
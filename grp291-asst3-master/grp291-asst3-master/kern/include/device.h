@@ -34,7 +34,6 @@
  * Devices.
  */
 
-
 struct uio;  /* in <uio.h> */
 
 /*
@@ -51,16 +50,43 @@ struct device {
 	void *d_data;		/* device-specific data */
 };
 
+/*
+ * Asynchronous I/O request, for devices that have devop_aio.
+ *
+ * The submitter fills in the first three fields. The uio must be in
+ * kernel space, and it and the request must stay valid until DR_DONE
+ * is called with the result. DR_DONE may be called from the device's
+ * interrupt handler, so it must not sleep. The rest belongs to the
+ * driver.
+ */
+struct devreq {
+	struct uio *dr_uio;		/* transfer (UIO_SYSSPACE) */
+	void (*dr_done)(struct devreq *, int result);
+	void *dr_data;			/* for the submitter */
+
+	struct devreq *dr_next;		/* driver's queue */
+	uint32_t dr_block;		/* next block to transfer */
+	uint32_t dr_nblocks;		/* blocks left to transfer */
+	uint32_t dr_queued;		/* cpu_cycles() when submitted */
+	uint32_t dr_started;		/* ...and when the device took it */
+};
+
 /*
  * Device operations.
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_aio - start a read or write and return without waiting
+ *                  (optional; NULL if the device can't)
+ *      devop_printstats - print statistics, prefixing lines with the
+ *                  given device name (optional; NULL if it keeps none)
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_aio)(struct device *, struct devreq *);
+	void (*devop_printstats)(struct device *, const char *name);
 };
 
 /*
@@ -69,6 +95,7 @@ struct device_ops {
 #define DEVOP_EACHOPEN(d, f)	((d)->d_ops->devop_eachopen(d, f))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_AIO(d, r)		((d)->d_ops->devop_aio(d, r))
 
 
 /* Create vnode for a vfs-level device. */
@@ -0,0 +1,30 @@
+#ifndef _KCACHE_H_
+#define _KCACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A kcache hands out objects of one type and keeps a few freed ones
+ * around, still constructed, for the next allocation. This suits
+ * things that are allocated and freed all the time and are expensive
+ * to set up, such as structures that contain a cv, or are large, such
+ * as thread stacks.
+ *
+ * The constructor, if any, runs when an object is first made and the
+ * destructor when it is finally given back to kmalloc; objects handed
+ * back with kcache_free must be in their constructed state. The
+ * constructor returns 0 or an errno value.
+ */
+
+struct kcache;	/* Opaque. */
+
+struct kcache *kcache_create(const char *name, size_t size,
+			     int (*ctor)(void *obj), void (*dtor)(void *obj));
+void *kcache_alloc(struct kcache *kc);
+void kcache_free(struct kcache *kc, void *obj);
+void kcache_destroy(struct kcache *kc);
+
+/* Print hit/miss counts (kernel menu) */
+void kcache_printstats(struct kcache *kc);
+
+#endif /* _KCACHE_H_ */
@@ -0,0 +1,53 @@
+#ifndef _KERN_KSTAT_H_
+#define _KERN_KSTAT_H_
+
+/*
+ * Kernel statistics, as read from the kstat: device.
+ *
+ * Each read of kstat: returns a fresh snapshot of struct kstat from
+ * its start, summed over all cpus; writing anything to it resets the
+ * counters. Times are in cycles of the cpu cycle counter, of which
+ * there are ks_cyclerate per second.
+ *
+ * Syscall latencies are kept as log2 histograms: bucket 0 counts
+ * calls that took fewer than 2^KSTAT_HISTSHIFT cycles, and bucket i
+ * after that calls that took 2^(KSTAT_HISTSHIFT+i-1) up to
+ * 2^(KSTAT_HISTSHIFT+i) cycles. The last bucket takes everything
+ * longer. Calls that never return (_exit, a successful execv) are
+ * not recorded.
+ */
+
+#define KSTAT_NSYSCALLS		128	/* syscall numbers tracked */
+#define KSTAT_NBUCKETS		24	/* histogram buckets per syscall */
+#define KSTAT_HISTSHIFT		8	/* log2 cycles of bucket 0 */
+
+/* Event counters */
+#define KSTAT_FAULT_READ	0	/* full page faults, by fault type */
+#define KSTAT_FAULT_WRITE	1
+#define KSTAT_FAULT_READONLY	2
+#define KSTAT_FAULT_ZERO	3	/* faults that zero-filled a page */
+#define KSTAT_FAULT_FILE	4	/* ...loaded a page from a file */
+#define KSTAT_FAULT_SWAPIN	5	/* ...read a page back from swap */
+#define KSTAT_FAULT_COW		6	/* ...copied a copy-on-write page */
+#define KSTAT_FAULT_SHARED	7	/* ...mapped a shared page */
+#define KSTAT_TLB_REFILL	8	/* TLB misses refilled from the PTE */
+#define KSTAT_DISK_READ		9	/* disk read requests */
+#define KSTAT_DISK_WRITE	10	/* disk write requests */
+#define KSTAT_CSWITCH		11	/* context switches */
+#define KSTAT_FAULT_ZEROPAGE	12	/* faults that mapped the zero frame */
+#define KSTAT_TLB_SHOOTDOWN	13	/* TLB shootdowns sent to other cpus */
+#define KSTAT_FAULT_ZEROCOPY	14	/* writes that copied the zero frame */
+#define KSTAT_TLB_REFILL_CYCLES	15	/* cycles spent in TLB refills */
+#define KSTAT_FAULT_CYCLES	16	/* cycles spent in full page faults */
+#define KSTAT_NCOUNTERS		17
+
+struct kstat {
+	__u32 ks_cyclerate;			/* cycles per second */
+	__u32 ks_ncpus;				/* cpus summed over */
+	__u64 ks_counters[KSTAT_NCOUNTERS];	/* event counts */
+	__u64 ks_cycles[KSTAT_NSYSCALLS];	/* total cycles per syscall */
+	__u32 ks_calls[KSTAT_NSYSCALLS];	/* calls per syscall */
+	__u32 ks_hist[KSTAT_NSYSCALLS][KSTAT_NBUCKETS];
+};
+
+#endif /* _KERN_KSTAT_H_ */
@@ -0,0 +1,36 @@
+#ifndef _KSTAT_H_
+#define _KSTAT_H_
+
+/*
+ * Kernel statistics: syscall latency histograms and event counters.
+ *
+ * Each cpu keeps its own struct kstat, indexed by cpu number, that
+ * only it updates, with interrupts off, so updates take no locks and no
+ * shared cache lines. Readers sum them up without stopping anyone,
+ * so a snapshot taken while things are running is only approximately
+ * consistent.
+ *
+ * Syscall times come from the cpu cycle counter: take cpu_cycles()
+ * on entry and hand it to kstat_syscall on the way out.
+ */
+
+#include <kern/kstat.h>
+
+/* Set up counters for cpu CPUNUM (cpu_create) */
+void kstat_cpu_init(unsigned cpunum);
+
+/* Attach the kstat: device */
+void kstat_bootstrap(void);
+
+void kstat_syscall(int callno, uint32_t start);
+void kstat_count(unsigned which);
+void kstat_add(unsigned which, uint32_t n);
+
+/* Sum up all cpus' counters, or clear them */
+void kstat_snapshot(struct kstat *ks);
+void kstat_reset(void);
+
+/* Print the counters (kernel menu) */
+void kstat_print(void);
+
+#endif /* _KSTAT_H_ */
@@ -48,16 +48,61 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * A page of a file mapped by mmap, cached in a frame shared by all
+ * mappings of it.
+ */
+struct sfs_mpage {
+	uint32_t mp_pageno;             /* page number within the file */
+	paddr_t mp_frame;               /* frame holding the page */
+	bool mp_dirty;                  /* true if mapped writable */
+};
+
+/*
+ * Locking.
+ *
+ * SFS does not use the vfs big lock. Instead:
+ *
+ *    sv_lock          one per vnode: the inode (sv_i, sv_dirty), the
+ *                     file's contents and block map, the mmap page
+ *                     cache, and for a directory its entries
+ *    sfs_vnlock       one per volume: the vnode table
+ *    sfs_freemaplock  one per volume: the freemap and the superblock
+ *    buffer cache     global, in sfs_io.c
+ *    name cache       global, in sfs_ncache.c
+ *
+ * and they are acquired in that order: a directory's vnode lock
+ * before the lock of a vnode in it, any vnode lock before the vnode
+ * table lock, and so on. Nothing is ever held while acquiring a
+ * vnode lock except the lock of its directory. No vnode lock is ever
+ * held while copying to or from user space: page faults can read
+ * files (VOP_READ for a lazily loaded page, VOP_MMAP for a mapped
+ * one), so file reads and writes go through a bounce buffer (see
+ * sfs_userio).
+ *
+ * Mount, unmount and sync are still serialized by the vfs layer,
+ * which calls them with the big lock held.
+ */
+
 /*
  * In-memory inode
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
+	struct lock *sv_lock;           /* protects everything below */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_mpage *sv_mpages;    /* mmap page cache, by page number */
+	unsigned sv_nmpages;            /* pages in sv_mpages */
+	unsigned sv_maxmpages;          /* allocated size of sv_mpages */
+	uint32_t sv_ranext;             /* block after the last read */
+	struct sfs_vnode *sv_hashnext;  /* vnode table (sfs_vnlock) */
+	bool sv_loading;                /* inode being read (sfs_vnlock) */
 };
 
+#define SFS_VHASH_SIZE  64              /* vnode table hash chains */
+
 /*
  * In-memory info for a whole fs volume
  */
@@ -66,9 +111,14 @@ struct sfs_fs {
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* protects the next three */
+	struct sfs_vnode *sfs_vnodes[SFS_VHASH_SIZE]; /* loaded vnodes */
+	unsigned sfs_nvnodes;           /* vnodes in sfs_vnodes */
+	struct cv *sfs_vncv;            /* waits for sv_loading to clear */
+	struct lock *sfs_freemaplock;   /* protects freemap, cursor, superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	daddr_t sfs_alloccursor;        /* where sfs_balloc looks next */
 };
 
 /*
@@ -76,5 +126,10 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Print buffer cache statistics (for the menu)
+ */
+void sfs_bcache_printstats(void);
+
 
 #endif /* _SFS_H_ */
@@ -0,0 +1,42 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for demand paging.
+ *
+ * User pages evicted by the clock in the frame table are written to
+ * page-sized slots on a raw disk, and their PTE is replaced with a
+ * swapped entry (see addrspace.h) naming the slot. Slots are
+ * reference counted because fork shares them like frames.
+ *
+ * The swap disk must not also be mounted as a filesystem.
+ */
+
+#define SWAP_DEVICE "lhd0raw:"
+
+struct addrspace;
+
+void swap_bootstrap(void);
+
+/*
+ * The caller holds vm_lock for these. They let it go during the disk
+ * transfer and take it back, with the PTE marked PTE_BUSY meanwhile.
+ */
+
+/* Page a user frame out to make room */
+int swap_evict(void);
+
+/* Read the swapped page at VADDR in AS into the frame at PADDR and map it */
+int swap_in(struct addrspace *as, vaddr_t vaddr, paddr_t paddr);
+
+/* Wait for some page in transit (PTE_BUSY) to settle */
+void swap_wait(void);
+
+/* Share/release a slot referenced from a page table */
+void swap_incref(unsigned slot);
+void swap_free(unsigned slot);
+
+/* Print swap statistics (kernel menu) */
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
@@ -102,6 +102,21 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * Scheduler fields; see schedule() in thread.c. Only touched
+	 * by the thread itself, or while it is off cpu by whoever
+	 * holds the lock of the list it is on.
+	 */
+	unsigned t_priority;		/* run queue level, 0 highest */
+	unsigned t_ticks;		/* hardclocks used at this level */
+	int t_nice;			/* 0 to NICE_MAX; higher is nicer */
+
+	/* CPU accounting, in hardclocks (see thread_printstats) */
+	unsigned t_cputicks;		/* time spent running */
+	unsigned t_created;		/* when created */
+	unsigned t_firstrun;		/* when first run */
+	bool t_hasrun;			/* t_firstrun is valid */
+
 	/*
 	 * Public fields
 	 */
@@ -163,6 +178,27 @@ void thread_yield(void);
  */
 void schedule(void);
 
+/*
+ * Charge the current thread for a clock tick. Returns true if it has
+ * used up its time slice or should make way for a higher-priority
+ * thread, and so ought to yield. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
+/*
+ * Add INCR to the current thread's nice value (clamped to 0 to
+ * NICE_MAX) and return the new value. Nicer threads start, and are
+ * boosted back to, lower run queue levels.
+ */
+#define NICE_MAX 19
+int thread_nice(int incr);
+
+/*
+ * Print (and optionally reset) the accounting totals for threads that
+ * have exited: turnaround, response, and CPU time. (Kernel menu.)
+ */
+void thread_printstats(bool reset);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
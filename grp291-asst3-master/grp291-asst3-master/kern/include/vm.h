@@ -39,6 +39,8 @@
 
 #include <machine/vm.h>
 
+struct addrspace;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -55,6 +57,45 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Allocate a zeroed kernel page, from the pool idle CPUs keep topped
+ * up with frame_prezero when there is one (unsw.c)
+ */
+vaddr_t alloc_zeroed_kpage(void);
+bool frame_prezero(void);
+
+/* Zero or copy one page, by page-aligned kernel address (pagecopy.c) */
+void page_zero(vaddr_t kvaddr);
+void page_copy(vaddr_t dst, vaddr_t src);
+
+/* Share/inspect user frames for copy-on-write (unsw.c) */
+void frame_incref(paddr_t paddr);
+unsigned frame_refcount(paddr_t paddr);
+
+/* Frame usage in pages, for statistics and tests (unsw.c) */
+void frame_getstats(unsigned *total, unsigned *nfree);
+void frame_printstats(void);
+
+/* Reverse mapping and clock page replacement (unsw.c) */
+void frame_setcached(paddr_t paddr);
+unsigned frame_touch(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+paddr_t frame_pick_victim(bool cachedonly, struct addrspace **as,
+			  vaddr_t *vaddr);
+
+/*
+ * TLB management by address space ID (vm.c). vm_tlb_unmap and
+ * vm_tlb_unmap_all shoot the entries down on whichever CPU holds them
+ * and wait, so they may not be called with a spinlock held;
+ * vm_tlb_unmap_local only touches this CPU's TLB.
+ */
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_unmap(struct addrspace *as, vaddr_t vaddr);
+void vm_tlb_unmap_all(struct addrspace *as);
+void vm_tlb_unmap_local(struct addrspace *as, vaddr_t vaddr);
+
+/* Print fault statistics (kernel menu) */
+void vm_printstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
@@ -131,6 +131,42 @@ bitmap_translate(unsigned bitno, unsigned *ix, WORD_TYPE *mask)
         *mask = ((WORD_TYPE)1) << offset;
 }
 
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        unsigned i, n;
+        unsigned ix;
+        WORD_TYPE mask;
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+
+        i = goal;
+        for (n = 0; n < b->nbits; ) {
+                bitmap_translate(i, &ix, &mask);
+                if (mask == 1 && b->v[ix] == WORD_ALLBITS &&
+                    i + BITS_PER_WORD <= b->nbits) {
+                        /* skip a full word at once */
+                        i += BITS_PER_WORD;
+                        n += BITS_PER_WORD;
+                }
+                else {
+                        if ((b->v[ix] & mask) == 0) {
+                                b->v[ix] |= mask;
+                                *index = i;
+                                return 0;
+                        }
+                        i++;
+                        n++;
+                }
+                if (i >= b->nbits) {
+                        i = 0;
+                }
+        }
+        return ENOSPC;
+}
+
 void
 bitmap_mark(struct bitmap *b, unsigned index)
 {
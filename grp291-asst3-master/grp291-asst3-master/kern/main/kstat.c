@@ -0,0 +1,316 @@
+/*
+ * Kernel statistics.
+ *
+ * See kstat.h and kern/kstat.h.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <kstat.h>
+
+static struct kstat *kstat_cpus[MAXCPUS];
+static unsigned kstat_ncpus;
+
+static const char *const kstat_names[KSTAT_NCOUNTERS] = {
+	"read faults",
+	"write faults",
+	"readonly faults",
+	"zero-fill faults",
+	"file faults",
+	"swap-in faults",
+	"copy-on-write faults",
+	"shared faults",
+	"TLB refills",
+	"disk reads",
+	"disk writes",
+	"context switches",
+	"zero-page faults",
+	"TLB shootdowns",
+	"zero-page copies",
+	"TLB refill cycles",
+	"full fault cycles",
+};
+
+/*
+ * Set up the counters for a new cpu. Cpus are created one at a time
+ * during boot, so this needs no lock.
+ */
+void
+kstat_cpu_init(unsigned cpunum)
+{
+	struct kstat *ks;
+
+	KASSERT(cpunum < MAXCPUS);
+	ks = kmalloc(sizeof(*ks));
+	if (ks == NULL) {
+		panic("kstat: Out of memory\n");
+	}
+	bzero(ks, sizeof(*ks));
+	kstat_cpus[cpunum] = ks;
+	if (cpunum >= kstat_ncpus) {
+		kstat_ncpus = cpunum + 1;
+	}
+}
+
+/*
+ * Histogram bucket for a call that took CYCLES cycles.
+ */
+static
+unsigned
+kstat_bucket(uint32_t cycles)
+{
+	unsigned b;
+
+	cycles >>= KSTAT_HISTSHIFT;
+	for (b = 0; cycles != 0 && b < KSTAT_NBUCKETS - 1; b++) {
+		cycles >>= 1;
+	}
+	return b;
+}
+
+/*
+ * Record a syscall that started at cycle START. If the thread slept
+ * and came back on another cpu the two cycle counters needn't agree,
+ * so such calls are timed only roughly.
+ */
+void
+kstat_syscall(int callno, uint32_t start)
+{
+	struct kstat *ks;
+	uint32_t cycles;
+	int spl;
+
+	if (callno < 0 || callno >= KSTAT_NSYSCALLS) {
+		return;
+	}
+
+	spl = splhigh();
+	cycles = cpu_cycles() - start;
+	ks = kstat_cpus[curcpu->c_number];
+	if (ks != NULL) {
+		ks->ks_calls[callno]++;
+		ks->ks_cycles[callno] += cycles;
+		ks->ks_hist[callno][kstat_bucket(cycles)]++;
+	}
+	splx(spl);
+}
+
+/*
+ * Count one event.
+ */
+void
+kstat_count(unsigned which)
+{
+	kstat_add(which, 1);
+}
+
+/*
+ * Add N to a counter, e.g. cycles spent on something.
+ */
+void
+kstat_add(unsigned which, uint32_t n)
+{
+	struct kstat *ks;
+	int spl;
+
+	KASSERT(which < KSTAT_NCOUNTERS);
+
+	spl = splhigh();
+	ks = kstat_cpus[curcpu->c_number];
+	if (ks != NULL) {
+		ks->ks_counters[which] += n;
+	}
+	splx(spl);
+}
+
+void
+kstat_snapshot(struct kstat *ks)
+{
+	const struct kstat *c;
+	unsigned i, j, k;
+
+	bzero(ks, sizeof(*ks));
+	ks->ks_cyclerate = cpu_cyclerate();
+	for (i = 0; i < kstat_ncpus; i++) {
+		c = kstat_cpus[i];
+		if (c == NULL) {
+			continue;
+		}
+		ks->ks_ncpus++;
+		for (j = 0; j < KSTAT_NCOUNTERS; j++) {
+			ks->ks_counters[j] += c->ks_counters[j];
+		}
+		for (j = 0; j < KSTAT_NSYSCALLS; j++) {
+			if (c->ks_calls[j] == 0) {
+				continue;
+			}
+			ks->ks_calls[j] += c->ks_calls[j];
+			ks->ks_cycles[j] += c->ks_cycles[j];
+			for (k = 0; k < KSTAT_NBUCKETS; k++) {
+				ks->ks_hist[j][k] += c->ks_hist[j][k];
+			}
+		}
+	}
+}
+
+void
+kstat_reset(void)
+{
+	unsigned i;
+
+	for (i = 0; i < kstat_ncpus; i++) {
+		if (kstat_cpus[i] != NULL) {
+			bzero(kstat_cpus[i], sizeof(struct kstat));
+		}
+	}
+}
+
+/*
+ * Convert cycles to microseconds.
+ */
+static
+unsigned long long
+kstat_usec(uint64_t cycles, uint32_t rate)
+{
+	return (unsigned long long)(cycles * 1000000ULL / rate);
+}
+
+void
+kstat_print(void)
+{
+	struct kstat *ks;
+	unsigned i, j;
+
+	ks = kmalloc(sizeof(*ks));
+	if (ks == NULL) {
+		kprintf("kstat: Out of memory\n");
+		return;
+	}
+	kstat_snapshot(ks);
+
+	kprintf("kstat: %u cpus, %u cycles/sec\n",
+		ks->ks_ncpus, ks->ks_cyclerate);
+	for (i = 0; i < KSTAT_NCOUNTERS; i++) {
+		kprintf("%22s: %llu\n", kstat_names[i],
+			(unsigned long long)ks->ks_counters[i]);
+	}
+
+	for (i = 0; i < KSTAT_NSYSCALLS; i++) {
+		if (ks->ks_calls[i] == 0) {
+			continue;
+		}
+		kprintf("syscall %3u: %u calls, avg %llu us\n", i,
+			ks->ks_calls[i],
+			kstat_usec(ks->ks_cycles[i] / ks->ks_calls[i],
+				   ks->ks_cyclerate));
+		kprintf("            ");
+		for (j = 0; j < KSTAT_NBUCKETS; j++) {
+			if (ks->ks_hist[i][j] == 0) {
+				continue;
+			}
+			if (j == KSTAT_NBUCKETS - 1) {
+				kprintf(" >:%u", ks->ks_hist[i][j]);
+			}
+			else {
+				kprintf(" <%llu:%u", kstat_usec(
+					1ULL << (KSTAT_HISTSHIFT + j),
+					ks->ks_cyclerate), ks->ks_hist[i][j]);
+			}
+		}
+		kprintf(" (us)\n");
+	}
+
+	kfree(ks);
+}
+
+/*
+ * The kstat: device. Every read returns a snapshot from its start,
+ * so a program can read it over and over on one file handle; any
+ * write resets the counters.
+ */
+static
+int
+kstat_eachopen(struct device *dev, int openflags)
+{
+	(void)dev;
+	(void)openflags;
+
+	return 0;
+}
+
+static
+int
+kstat_io(struct device *dev, struct uio *uio)
+{
+	struct kstat *ks;
+	size_t len;
+	int result;
+
+	(void)dev;
+
+	if (uio->uio_rw == UIO_WRITE) {
+		kstat_reset();
+		uio->uio_resid = 0;
+		return 0;
+	}
+
+	ks = kmalloc(sizeof(*ks));
+	if (ks == NULL) {
+		return ENOMEM;
+	}
+	kstat_snapshot(ks);
+
+	/* The offset is ignored; every read starts at the beginning */
+	len = uio->uio_resid < sizeof(*ks) ? uio->uio_resid : sizeof(*ks);
+	result = uiomove(ks, len, uio);
+
+	kfree(ks);
+	return result;
+}
+
+static
+int
+kstat_ioctl(struct device *dev, int op, userptr_t data)
+{
+	(void)dev;
+	(void)op;
+	(void)data;
+
+	return EINVAL;
+}
+
+static const struct device_ops kstat_devops = {
+	.devop_eachopen = kstat_eachopen,
+	.devop_io = kstat_io,
+	.devop_ioctl = kstat_ioctl,
+};
+
+void
+kstat_bootstrap(void)
+{
+	struct device *dev;
+	int result;
+
+	dev = kmalloc(sizeof(*dev));
+	if (dev == NULL) {
+		panic("kstat: Could not add kstat device: out of memory\n");
+	}
+
+	dev->d_ops = &kstat_devops;
+	dev->d_blocks = 0;
+	dev->d_blocksize = 1;
+	dev->d_devnumber = 0; /* assigned by vfs_adddev */
+	dev->d_data = NULL;
+
+	result = vfs_adddev("kstat", dev, 0);
+	if (result) {
+		panic("kstat: Could not add kstat device: %s\n",
+		      strerror(result));
+	}
+}
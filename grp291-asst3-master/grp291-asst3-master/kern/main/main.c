@@ -47,6 +47,7 @@
 #include <vfs.h>
 #include <device.h>
 #include <pid.h>
+#include <kstat.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -114,6 +115,7 @@ boot(void)
 	pid_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	kstat_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
@@ -129,7 +131,6 @@ boot(void)
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	kprintf_bootstrap();
-	exec_bootstrap();
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -43,10 +43,17 @@
 #include <vfs.h>
 #include <sfs.h>
 #include <pid.h>
+#include <kstat.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
+
+#if !OPT_DUMBVM
+#include <vm.h>
+#include <swap.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -471,6 +478,92 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if !OPT_DUMBVM
+static
+int
+cmd_swapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	swap_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		thread_printstats(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		thread_printstats(true);
+	}
+	else {
+		kprintf("Usage: schedstat [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_kstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kstat_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kstat_reset();
+	}
+	else {
+		kprintf("Usage: kstat [reset]\n");
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_devstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vfs_printdevstats();
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_bcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_bcache_printstats();
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -566,6 +659,9 @@ static const char *testmenu[] = {
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
+	"[km5] Frame allocator benchmark     ",
+	"[km6] kmalloc benchmark             ",
+	"[mt]  Block copy benchmark          ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -606,6 +702,16 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+#if !OPT_DUMBVM
+	"[swap] Swap statistics              ",
+	"[vmstat] VM fault statistics        ",
+#endif
+#if OPT_SFS
+	"[bcache] SFS buffer cache stats     ",
+#endif
+	"[devstat] Device statistics         ",
+	"[schedstat] Scheduler statistics    ",
+	"[kstat] Kernel event statistics     ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +763,16 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+#if !OPT_DUMBVM
+	{ "swap",       cmd_swapstats },
+	{ "vmstat",     cmd_vmstats },
+#endif
+#if OPT_SFS
+	{ "bcache",     cmd_bcachestats },
+#endif
+	{ "devstat",    cmd_devstats },
+	{ "schedstat",  cmd_schedstats },
+	{ "kstat",      cmd_kstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -667,6 +783,9 @@ static struct {
 	{ "km2",	kmallocstress },
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
+	{ "km5",	kmalloctest5 },
+	{ "km6",	kmalloctest6 },
+	{ "mt",		memtest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
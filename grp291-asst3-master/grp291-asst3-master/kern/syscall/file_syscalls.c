@@ -37,6 +37,8 @@
 #include <kern/limits.h>
 #include <kern/seek.h>
 #include <kern/stat.h>
+#include <kern/iovec.h>
+#include <limits.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -105,19 +107,25 @@ sys_open(const_userptr_t upath, int flags, mode_t mode, int *retval)
 }
 
 /*
- * Common logic for read and write.
+ * Common logic for all the read and write calls.
  *
- * Look up the fd, then use VOP_READ or VOP_WRITE.
+ * Look up the fd, then use VOP_READ or VOP_WRITE on the user buffers
+ * in IOV. If POS is NULL the I/O happens at the file's seek position,
+ * which is locked while it's in use and then advanced. Otherwise it
+ * happens at *POS and the seek position is neither used nor locked,
+ * so any number of pread/pwrite calls on one open file can run at
+ * once.
  */
 static
 int
-sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
-	      int badaccmode, ssize_t *retval)
+sys_readwrite(int fd, struct iovec *iov, unsigned iovcnt, const off_t *upos,
+	      enum uio_rw rw, int badaccmode, ssize_t *retval)
 {
 	struct openfile *file;
 	bool locked;
 	off_t pos;
-	struct iovec iov;
+	size_t size;
+	unsigned i;
 	struct uio useruio;
 	int result;
 
@@ -128,8 +136,20 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 	}
 
 	/* Only lock the seek position if we're really using it. */
-	locked = VOP_ISSEEKABLE(file->of_vnode);
-	if (locked) {
+	locked = false;
+	if (upos != NULL) {
+		if (!VOP_ISSEEKABLE(file->of_vnode)) {
+			result = ESPIPE;
+			goto fail;
+		}
+		if (*upos < 0) {
+			result = EINVAL;
+			goto fail;
+		}
+		pos = *upos;
+	}
+	else if (VOP_ISSEEKABLE(file->of_vnode)) {
+		locked = true;
 		lock_acquire(file->of_offsetlock);
 		pos = file->of_offset;
 	}
@@ -142,8 +162,18 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 		goto fail;
 	}
 
-	/* set up a uio with the buffer, its size, and the current offset */
-	uio_uinit(&iov, &useruio, buf, size, pos, rw);
+	/* set up a uio with the buffers, their size, and the offset */
+	size = 0;
+	for (i=0; i<iovcnt; i++) {
+		size += iov[i].iov_len;
+	}
+	useruio.uio_iov = iov;
+	useruio.uio_iovcnt = iovcnt;
+	useruio.uio_offset = pos;
+	useruio.uio_resid = size;
+	useruio.uio_segflg = UIO_USERSPACE;
+	useruio.uio_rw = rw;
+	useruio.uio_space = proc_getas();
 
 	/* do the read or write */
 	result = (rw == UIO_READ) ?
@@ -183,7 +213,11 @@ fail:
 int
 sys_read(int fd, userptr_t buf, size_t size, int *retval)
 {
-	return sys_readwrite(fd, buf, size, UIO_READ, O_WRONLY, retval);
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return sys_readwrite(fd, &iov, 1, NULL, UIO_READ, O_WRONLY, retval);
 }
 
 /*
@@ -192,7 +226,115 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 int
 sys_write(int fd, userptr_t buf, size_t size, int *retval)
 {
-	return sys_readwrite(fd, buf, size, UIO_WRITE, O_RDONLY, retval);
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return sys_readwrite(fd, &iov, 1, NULL, UIO_WRITE, O_RDONLY, retval);
+}
+
+/*
+ * pread() - use sys_readwrite at the given position
+ */
+int
+sys_pread(int fd, userptr_t buf, size_t size, off_t pos, int *retval)
+{
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return sys_readwrite(fd, &iov, 1, &pos, UIO_READ, O_WRONLY, retval);
+}
+
+/*
+ * pwrite() - use sys_readwrite at the given position
+ */
+int
+sys_pwrite(int fd, userptr_t buf, size_t size, off_t pos, int *retval)
+{
+	struct iovec iov;
+
+	iov.iov_ubase = buf;
+	iov.iov_len = size;
+	return sys_readwrite(fd, &iov, 1, &pos, UIO_WRITE, O_RDONLY, retval);
+}
+
+/*
+ * Up to this many iovecs are copied in on the stack; longer arrays
+ * (up to IOV_MAX) are kmalloc'd.
+ */
+#define RW_SMALLIOV	8
+
+/*
+ * Common logic for readv and writev: copy in the iovec array, check
+ * that the total length fits in the return value, and hand the lot
+ * to sys_readwrite as one uio.
+ */
+static
+int
+sys_readwritev(int fd, const_userptr_t uiov, int iovcnt, enum uio_rw rw,
+	       int badaccmode, ssize_t *retval)
+{
+	struct iovec smalliov[RW_SMALLIOV];
+	struct iovec *iov;
+	size_t size;
+	int i;
+	int result;
+
+	if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+		return EINVAL;
+	}
+
+	if (iovcnt <= RW_SMALLIOV) {
+		iov = smalliov;
+	}
+	else {
+		iov = kmalloc(iovcnt * sizeof(*iov));
+		if (iov == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	result = copyin(uiov, iov, iovcnt * sizeof(*iov));
+	if (result) {
+		goto out;
+	}
+
+	/* the total must not wrap, or overflow ssize_t */
+	size = 0;
+	for (i=0; i<iovcnt; i++) {
+		size += iov[i].iov_len;
+		if (size < iov[i].iov_len || (ssize_t)size < 0) {
+			result = EINVAL;
+			goto out;
+		}
+	}
+
+	result = sys_readwrite(fd, iov, iovcnt, NULL, rw, badaccmode, retval);
+
+out:
+	if (iov != smalliov) {
+		kfree(iov);
+	}
+	return result;
+}
+
+/*
+ * readv() - use sys_readwritev
+ */
+int
+sys_readv(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return sys_readwritev(fd, iov, iovcnt, UIO_READ, O_WRONLY, retval);
+}
+
+/*
+ * writev() - use sys_readwritev
+ */
+int
+sys_writev(int fd, const_userptr_t iov, int iovcnt, int *retval)
+{
+	return sys_readwritev(fd, iov, iovcnt, UIO_WRITE, O_RDONLY, retval);
 }
 
 /*
@@ -37,6 +37,7 @@
 #include <kern/limits.h>
 #include <kern/seek.h>
 #include <kern/stat.h>
+#include <kern/unistd.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -47,6 +48,7 @@
 #include <vnode.h>
 #include <openfile.h>
 #include <filetable.h>
+#include <addrspace.h>
 #include <syscall.h>
 
 /*
@@ -427,3 +429,49 @@ sys_ftruncate(int fd, off_t len)
 	filetable_put(curproc->p_filetable, fd, file);
 	return err;
 }
+
+/*
+ * mmap - map the file shared with as_mmap. A writable mapping writes
+ * back to the file, so it needs the file open for both reading and
+ * writing.
+ */
+int
+sys_mmap(size_t len, int prot, int fd, off_t offset, int *retval)
+{
+	struct openfile *file;
+	vaddr_t addr;
+	int err;
+
+	if ((prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+		return EINVAL;
+	}
+
+	err = filetable_get(curproc->p_filetable, fd, &file);
+	if (err) {
+		return err;
+	}
+
+	if (file->of_accmode == O_WRONLY ||
+	    ((prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+		filetable_put(curproc->p_filetable, fd, file);
+		return EACCES;
+	}
+
+	err = as_mmap(proc_getas(), file->of_vnode, len,
+		      (prot & PROT_WRITE) != 0, offset, &addr);
+	filetable_put(curproc->p_filetable, fd, file);
+	if (err) {
+		return err;
+	}
+	*retval = (int)addr;
+	return 0;
+}
+
+/*
+ * munmap - call as_munmap
+ */
+int
+sys_munmap(userptr_t addr)
+{
+	return as_munmap(proc_getas(), (vaddr_t)addr);
+}
@@ -40,7 +40,6 @@
 #include <lib.h>
 #include <proc.h>
 #include <current.h>
-#include <synch.h>
 #include <copyinout.h>
 #include <addrspace.h>
 #include <vm.h>
@@ -54,36 +53,25 @@
  * argv buffer.
  *
  * This is an abstraction that holds an argv while it's being shuffled
- * through the kernel during exec.
+ * through the kernel during exec. The strings are packed end to end
+ * into a chain of single pages allocated as needed, so a string can
+ * run from one page into the next. No exec ever needs a large
+ * contiguous block, and any number of them can be copying arguments
+ * at once.
+ *
+ * The space for the user-level argv pointers is counted against
+ * ARG_MAX along with the strings, so the whole lot always fits under
+ * the new process's stack.
  */
+#define ARGBUF_MAXPAGES	(ARG_MAX / PAGE_SIZE)
+
 struct argbuf {
-	char *data;
-	size_t len;
-	size_t max;
+	char *pages[ARGBUF_MAXPAGES];
+	unsigned npages;
+	size_t len;		/* bytes used, over all the pages */
 	int nargs;
-	bool tooksem;
 };
 
-/*
- * Throttle to limit the number of processes in exec at once. Or,
- * rather, the number trying to use large exec buffers at once. See
- * design notes for the rationale.
- */
-#define EXEC_BIGBUF_THROTTLE	1
-static struct semaphore *execthrottle;
-
-/*
- * Set things up.
- */
-void
-exec_bootstrap(void)
-{
-	execthrottle = sem_create("exec", EXEC_BIGBUF_THROTTLE);
-	if (execthrottle == NULL) {
-		panic("Cannot create exec throttle semaphore\n");
-	}
-}
-
 /*
  * Initialize an argv buffer.
  */
@@ -91,11 +79,9 @@ static
 void
 argbuf_init(struct argbuf *buf)
 {
-	buf->data = NULL;
+	buf->npages = 0;
 	buf->len = 0;
-	buf->max = 0;
 	buf->nargs = 0;
-	buf->tooksem = false;
 }
 
 /*
@@ -105,34 +91,61 @@ static
 void
 argbuf_cleanup(struct argbuf *buf)
 {
-	if (buf->data != NULL) {
-		kfree(buf->data);
-		buf->data = NULL;
+	unsigned i;
+
+	for (i=0; i<buf->npages; i++) {
+		kfree(buf->pages[i]);
+		buf->pages[i] = NULL;
 	}
+	buf->npages = 0;
 	buf->len = 0;
-	buf->max = 0;
 	buf->nargs = 0;
-	if (buf->tooksem) {
-		V(execthrottle);
-		buf->tooksem = false;
-	}
 }
 
 /*
- * Allocate the memory for an argv buffer.
+ * Space used so far, counting the argv pointers the strings will
+ * need in user space (one each plus the ending NULL).
+ */
+static
+size_t
+argbuf_used(struct argbuf *buf)
+{
+	return buf->len + (buf->nargs + 1) * sizeof(userptr_t);
+}
+
+/*
+ * Add another page to an argv buffer.
  */
 static
 int
-argbuf_allocate(struct argbuf *buf, size_t size)
+argbuf_addpage(struct argbuf *buf)
 {
-	buf->data = kmalloc(size);
-	if (buf->data == NULL) {
+	char *page;
+
+	if (buf->npages >= ARGBUF_MAXPAGES) {
+		return E2BIG;
+	}
+	page = kmalloc(PAGE_SIZE);
+	if (page == NULL) {
 		return ENOMEM;
 	}
-	buf->max = size;
+	buf->pages[buf->npages++] = page;
 	return 0;
 }
 
+/*
+ * Where the byte at offset POS lives, and how much of its page is
+ * left from there.
+ */
+static
+char *
+argbuf_ptr(struct argbuf *buf, size_t pos, size_t *room_ret)
+{
+	KASSERT(pos / PAGE_SIZE < buf->npages);
+	*room_ret = PAGE_SIZE - pos % PAGE_SIZE;
+	return buf->pages[pos / PAGE_SIZE] + pos % PAGE_SIZE;
+}
+
 /*
  * Prepare an argv buffer for runprogram, using a kernel pointer.
  *
@@ -147,18 +160,57 @@ argbuf_fromkernel(struct argbuf *buf, const char *progname)
 	int result;
 
 	len = strlen(progname) + 1;
+	if (len > PAGE_SIZE) {
+		return E2BIG;
+	}
 
-	result = argbuf_allocate(buf, len);
+	result = argbuf_addpage(buf);
 	if (result) {
 		return result;
 	}
-	strcpy(buf->data, progname);
+	strcpy(buf->pages[0], progname);
 	buf->len = len;
 	buf->nargs = 1;
 
 	return 0;
 }
 
+/*
+ * Copy one user string onto the end of an argv buffer, a page at a
+ * time. When copyinstr runs out of room it has filled the page, so we
+ * carry on from the same point in the string in a fresh page.
+ */
+static
+int
+argbuf_copyinstr(struct argbuf *buf, userptr_t str)
+{
+	size_t room, thislen;
+	char *dest;
+	int result;
+
+	while (1) {
+		if (buf->len == buf->npages * PAGE_SIZE) {
+			result = argbuf_addpage(buf);
+			if (result) {
+				return result;
+			}
+		}
+
+		dest = argbuf_ptr(buf, buf->len, &room);
+		result = copyinstr(str, dest, room, &thislen);
+		if (result == 0) {
+			/* thislen includes the \0 */
+			buf->len += thislen;
+			return 0;
+		}
+		if (result != ENAMETOOLONG) {
+			return result;
+		}
+		buf->len += room;
+		str += room;
+	}
+}
+
 /*
  * Copy an argv array into kernel space, using an argvdata buffer.
  */
@@ -167,7 +219,6 @@ int
 argbuf_copyin(struct argbuf *buf, userptr_t uargv)
 {
 	userptr_t thisarg;
-	size_t thisarglen;
 	int result;
 
 	/* loop through the argv, grabbing each arg string */
@@ -188,19 +239,18 @@ argbuf_copyin(struct argbuf *buf, userptr_t uargv)
 		}
 
 		/* Use the pointer to fetch the argument string. */
-		result = copyinstr(thisarg, buf->data + buf->len,
-				   buf->max - buf->len, &thisarglen);
-		if (result == ENAMETOOLONG) {
-			return E2BIG;
-		}
-		else if (result) {
+		result = argbuf_copyinstr(buf, thisarg);
+		if (result) {
 			return result;
 		}
 
-		/* Move ahead. Note: thisarglen includes the \0. */
-		buf->len += thisarglen;
+		/* Move ahead. */
 		uargv += sizeof(userptr_t);
 		buf->nargs++;
+
+		if (argbuf_used(buf) > ARG_MAX) {
+			return E2BIG;
+		}
 	}
 
 	return 0;
@@ -213,45 +263,20 @@ static
 int
 argbuf_fromuser(struct argbuf *buf, userptr_t uargv)
 {
-	int result;
-
-	/* try with a small buffer */
-	result = argbuf_allocate(buf, PAGE_SIZE);
-	if (result) {
-		return result;
-	}
-
-	/* do the copyin */
-	result = argbuf_copyin(buf, uargv);
-	if (result == E2BIG) {
-		/*
-		 * Try again with the full-size buffer. Just start
-		 * over instead of trying to keep the page we already
-		 * did; this is a bit inefficient but it's not that
-		 * important.
-		 */
-		argbuf_cleanup(buf);
-		argbuf_init(buf);
-
-		/* Wait on the semaphore, to throttle this allocation */
-		P(execthrottle);
-		buf->tooksem = true;
-
-		result = argbuf_allocate(buf, ARG_MAX);
-		if (result) {
-			return result;
-		}
-
-		result = argbuf_copyin(buf, uargv);
-	}
-	return result;
+	return argbuf_copyin(buf, uargv);
 }
 
 /*
  * Copy an argv out of kernel space to user space.
  *
+ * The string block goes out a page at a time, straight from the
+ * buffer pages; then one pass over the strings finds where each one
+ * starts, and the argv pointers go out in batches.
+ *
  * Note: ustackp is an in/out argument.
  */
+#define ARGBUF_PTRBATCH	64
+
 static
 int
 argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
@@ -259,18 +284,22 @@ argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
 {
 	vaddr_t ustack;
 	userptr_t ustringbase, uargvbase, uargv_i;
-	userptr_t thisarg;
-	size_t thisarglen;
-	size_t pos;
+	userptr_t ptrs[ARGBUF_PTRBATCH];
+	unsigned nptrs, i;
+	size_t pos, room, thislen;
+	const char *src;
+	bool atstart;
 	int result;
 
+	KASSERT(argbuf_used(buf) <= ARG_MAX);
+
 	/* Begin the stack at the passed in top. */
 	ustack = *ustackp;
 
 	/*
 	 * Allocate space.
 	 *
-	 * buf->pos is the amount of space used by the strings; put that
+	 * buf->len is the amount of space used by the strings; put that
 	 * first, then align the stack, then make space for the argv
 	 * pointers. Allow an extra slot for the ending NULL.
 	 */
@@ -282,36 +311,53 @@ argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
 	ustack -= (buf->nargs + 1) * sizeof(userptr_t);
 	uargvbase = (userptr_t)ustack;
 
-	/* Now copy the data out. */
-	pos = 0;
-	uargv_i = uargvbase;
-	while (pos < buf->len) {
-		/* The user address of the string will be ustringbase + pos. */
-		thisarg = ustringbase + pos;
-
-		/* Place it in the argv array. */
-		result = copyout(&thisarg, uargv_i, sizeof(thisarg));
+	/* Push out the strings. */
+	for (pos = 0; pos < buf->len; pos += thislen) {
+		src = argbuf_ptr(buf, pos, &room);
+		thislen = buf->len - pos < room ? buf->len - pos : room;
+		result = copyout(src, ustringbase + pos, thislen);
 		if (result) {
 			return result;
 		}
+	}
 
-		/* Push out the string. */
-		result = copyoutstr(buf->data + pos, thisarg,
-				    buf->len - pos, &thisarglen);
-		if (result) {
-			return result;
+	/*
+	 * Now the argv array. Each string starts at offset 0 or right
+	 * after a \0; the user address of the string will be
+	 * ustringbase + pos.
+	 */
+	uargv_i = uargvbase;
+	nptrs = 0;
+	atstart = true;
+	for (pos = 0; pos < buf->len; pos += room) {
+		src = argbuf_ptr(buf, pos, &room);
+		if (room > buf->len - pos) {
+			room = buf->len - pos;
+		}
+		for (i=0; i<room; i++) {
+			if (atstart) {
+				ptrs[nptrs++] = ustringbase + pos + i;
+			}
+			atstart = (src[i] == 0);
+
+			if (nptrs == ARGBUF_PTRBATCH) {
+				result = copyout(ptrs, uargv_i, sizeof(ptrs));
+				if (result) {
+					return result;
+				}
+				uargv_i += sizeof(ptrs);
+				nptrs = 0;
+			}
 		}
-
-		/* thisarglen includes the \0 */
-		pos += thisarglen;
-		uargv_i += sizeof(thisarg);
 	}
 	/* Should have come out even... */
-	KASSERT(pos == buf->len);
+	KASSERT(atstart || buf->len == 0);
+	KASSERT(uargv_i + nptrs * sizeof(userptr_t) ==
+		uargvbase + buf->nargs * sizeof(userptr_t));
 
-	/* Add the NULL. */
-	thisarg = NULL;
-	result = copyout(&thisarg, uargv_i, sizeof(userptr_t));
+	/* Add the NULL, and whatever's left of the pointers. */
+	ptrs[nptrs++] = NULL;
+	result = copyout(ptrs, uargv_i, nptrs * sizeof(userptr_t));
 	if (result) {
 		return result;
 	}
@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -101,6 +102,15 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* bitmap_alloc_near searches from the goal, wrapping around */
+	bitmap_unmark(b, 10);
+	bitmap_unmark(b, 300);
+	KASSERT(bitmap_alloc_near(b, 11, &x)==0);
+	KASSERT(x == 300);
+	KASSERT(bitmap_alloc_near(b, 301, &x)==0);
+	KASSERT(x == 10);
+	KASSERT(bitmap_alloc_near(b, 0, &x)==ENOSPC);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
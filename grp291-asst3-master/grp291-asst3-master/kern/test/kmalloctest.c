@@ -36,6 +36,8 @@
 #include <thread.h>
 #include <synch.h>
 #include <vm.h> /* for PAGE_SIZE */
+#include <clock.h>
+#include <kcache.h>
 #include <test.h>
 
 #include "opt-dumbvm.h"
@@ -379,3 +381,270 @@ kmalloctest4(int nargs, char **args)
 	kprintf("Multipage kmalloc test done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+// km5
+
+/*
+ * Frame allocator benchmark. Fill physical memory to 10%, 50% and
+ * 95% occupancy with single pages, then time bursts of single-page
+ * alloc_kpages/free_kpages pairs at that occupancy and report the
+ * allocation rate.
+ */
+
+#define KM5_BURST   32
+#define KM5_ROUNDS  2000
+
+static const unsigned km5_occupancy[] = { 10, 50, 95 };
+
+static
+uint64_t
+km5_nsecs(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+int
+kmalloctest5(int nargs, char **args)
+{
+#if OPT_UNSW
+	struct timespec before, after, duration;
+	vaddr_t burst[KM5_BURST];
+	vaddr_t *fill;
+	unsigned total, nfree, target, nfill, maxfill;
+	unsigned i, j, k, r;
+	uint64_t ns, rate;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting frame allocator benchmark...\n");
+
+	frame_getstats(&total, &nfree);
+	maxfill = total;
+	fill = kmalloc(maxfill * sizeof(vaddr_t));
+	if (fill == NULL) {
+		kprintf("kmalloctest5: no memory for fill array\n");
+		return ENOMEM;
+	}
+	nfill = 0;
+
+	for (i=0; i<sizeof(km5_occupancy)/sizeof(km5_occupancy[0]); i++) {
+		target = total / 100 * km5_occupancy[i];
+
+		/* top up to the target occupancy, leaving room for a burst */
+		frame_getstats(&total, &nfree);
+		while (total - nfree < target && nfree > KM5_BURST &&
+		       nfill < maxfill) {
+			fill[nfill] = alloc_kpages(1);
+			if (fill[nfill] == 0) {
+				break;
+			}
+			nfill++;
+			frame_getstats(&total, &nfree);
+		}
+
+		gettime(&before);
+		for (r=0; r<KM5_ROUNDS; r++) {
+			for (j=0; j<KM5_BURST; j++) {
+				burst[j] = alloc_kpages(1);
+				if (burst[j] == 0) {
+					panic("kmalloctest5: allocation failed "
+					      "at %u%% occupancy\n",
+					      km5_occupancy[i]);
+				}
+			}
+			for (k=0; k<KM5_BURST; k++) {
+				free_kpages(burst[k]);
+			}
+		}
+		gettime(&after);
+		timespec_sub(&after, &before, &duration);
+
+		ns = km5_nsecs(&duration);
+		if (ns == 0) {
+			ns = 1;
+		}
+		rate = (uint64_t)KM5_ROUNDS * KM5_BURST * 1000000000ULL / ns;
+		kprintf("%3u%% occupancy (%u/%u frames): %llu allocs/sec\n",
+			km5_occupancy[i], total - nfree, total,
+			(unsigned long long)rate);
+	}
+
+	for (i=0; i<nfill; i++) {
+		free_kpages(fill[i]);
+	}
+	kfree(fill);
+
+	kprintf("Frame allocator benchmark done\n");
+#else
+	(void)nargs;
+	(void)args;
+	kprintf("(This test needs the unsw frame allocator)\n");
+#endif
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// km6
+
+/*
+ * kmalloc benchmark. Time bursts of kmalloc/kfree pairs for each
+ * subpage size, first from one thread and then from NTHREADS at once
+ * (which mostly exercises the per-cpu magazines), and finally
+ * alloc/free pairs on a kcache of objects with a constructor.
+ */
+
+#define KM6_BURST   8
+#define KM6_ROUNDS  2000
+
+static const size_t km6_sizes[] = { 16, 64, 256, 1024, 2000 };
+#define NUM_KM6_SIZES (sizeof(km6_sizes) / sizeof(km6_sizes[0]))
+
+static
+void
+km6_report(const char *what, const struct timespec *before,
+	   const struct timespec *after, unsigned nallocs)
+{
+	struct timespec duration;
+	uint64_t ns;
+
+	timespec_sub(after, before, &duration);
+	ns = km5_nsecs(&duration);
+	if (ns == 0) {
+		ns = 1;
+	}
+	kprintf("%-22s %llu allocs/sec\n", what,
+		(unsigned long long)((uint64_t)nallocs * 1000000000ULL / ns));
+}
+
+/*
+ * Do KM6_ROUNDS bursts of KM6_BURST allocations of SIZE bytes.
+ */
+static
+void
+km6_bursts(size_t size)
+{
+	void *burst[KM6_BURST];
+	unsigned r, j;
+
+	for (r=0; r<KM6_ROUNDS; r++) {
+		for (j=0; j<KM6_BURST; j++) {
+			burst[j] = kmalloc(size);
+			if (burst[j] == NULL) {
+				panic("kmalloctest6: kmalloc(%zu) failed\n",
+				      size);
+			}
+		}
+		for (j=0; j<KM6_BURST; j++) {
+			kfree(burst[j]);
+		}
+	}
+}
+
+static
+void
+km6_thread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	unsigned i;
+
+	for (i=0; i<NUM_KM6_SIZES; i++) {
+		km6_bursts(km6_sizes[(i + num) % NUM_KM6_SIZES]);
+	}
+	V(sem);
+}
+
+static
+int
+km6_ctor(void *obj)
+{
+	struct semaphore **semp = obj;
+
+	*semp = sem_create("km6", 0);
+	if (*semp == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+km6_dtor(void *obj)
+{
+	struct semaphore **semp = obj;
+
+	sem_destroy(*semp);
+}
+
+int
+kmalloctest6(int nargs, char **args)
+{
+	struct timespec before, after;
+	struct semaphore *sem;
+	struct kcache *kc;
+	void *burst[KM6_BURST];
+	char name[32];
+	unsigned i, j, r;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting kmalloc benchmark...\n");
+
+	for (i=0; i<NUM_KM6_SIZES; i++) {
+		snprintf(name, sizeof(name), "%zu bytes:", km6_sizes[i]);
+		gettime(&before);
+		km6_bursts(km6_sizes[i]);
+		gettime(&after);
+		km6_report(name, &before, &after, KM6_ROUNDS * KM6_BURST);
+	}
+
+	sem = sem_create("km6sem", 0);
+	if (sem == NULL) {
+		panic("kmalloctest6: sem_create failed\n");
+	}
+	gettime(&before);
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("km6", NULL, km6_thread, sem, i);
+		if (result) {
+			panic("kmalloctest6: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+	gettime(&after);
+	sem_destroy(sem);
+	snprintf(name, sizeof(name), "all sizes, %d threads:", NTHREADS);
+	km6_report(name, &before, &after,
+		   NTHREADS * NUM_KM6_SIZES * KM6_ROUNDS * KM6_BURST);
+
+	kc = kcache_create("km6", sizeof(struct semaphore *),
+			   km6_ctor, km6_dtor);
+	if (kc == NULL) {
+		panic("kmalloctest6: kcache_create failed\n");
+	}
+	gettime(&before);
+	for (r=0; r<KM6_ROUNDS; r++) {
+		for (j=0; j<KM6_BURST; j++) {
+			burst[j] = kcache_alloc(kc);
+			if (burst[j] == NULL) {
+				panic("kmalloctest6: kcache_alloc failed\n");
+			}
+		}
+		for (j=0; j<KM6_BURST; j++) {
+			kcache_free(kc, burst[j]);
+		}
+	}
+	gettime(&after);
+	km6_report("kcache (with ctor):", &before, &after,
+		   KM6_ROUNDS * KM6_BURST);
+	kcache_printstats(kc);
+	kcache_destroy(kc);
+
+	kprintf("kmalloc benchmark done\n");
+	return 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Block copy and fill benchmark.
+ *
+ * First checks memcpy, memmove, memset and bzero against byte-at-a-
+ * time copies for every combination of small lengths and alignments,
+ * then times them (and page_copy/page_zero) on a range of sizes and
+ * alignment classes and reports MB/s.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <vm.h>
+#include <clock.h>
+#include <test.h>
+
+#define MT_MAXSIZE	65536		/* largest block timed */
+#define MT_NPAGES	(MT_MAXSIZE / PAGE_SIZE + 1)
+#define MT_BYTES	(512*1024)	/* bytes moved per measurement */
+#define MT_CHECKLEN	100		/* lengths checked, from 0 */
+
+static const size_t mt_sizes[] = { 16, 64, 256, 4096, MT_MAXSIZE };
+#define NUM_MT_SIZES (sizeof(mt_sizes) / sizeof(mt_sizes[0]))
+
+/*
+ * Alignment classes: destination and source offsets from a page
+ * boundary.
+ */
+static const struct {
+	const char *name;
+	unsigned doff, soff;
+} mt_aligns[] = {
+	{ "aligned",	0, 0 },
+	{ "unaligned",	1, 1 },
+	{ "mismatched",	0, 3 },
+};
+#define NUM_MT_ALIGNS (sizeof(mt_aligns) / sizeof(mt_aligns[0]))
+
+enum mt_op { MT_MEMCPY, MT_MEMMOVE, MT_MEMSET, MT_BZERO };
+
+static
+void
+mt_fill(unsigned char *buf, size_t len, unsigned seed)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = (unsigned char)(i * 7 + seed);
+	}
+}
+
+/*
+ * Check one operation at DOFF/SOFF/LEN against doing it by hand in
+ * REF; BUF and REF are both 2*MT_CHECKLEN bytes and start out equal.
+ */
+static
+void
+mt_checkone(enum mt_op op, unsigned char *buf, unsigned char *ref,
+	    unsigned doff, unsigned soff, size_t len)
+{
+	const char *name = "?";
+	size_t i;
+
+	switch (op) {
+	    case MT_MEMCPY:
+		/* source in the second half, so no overlap */
+		name = "memcpy";
+		memcpy(buf + doff, buf + MT_CHECKLEN + soff, len);
+		for (i=0; i<len; i++) {
+			ref[doff + i] = ref[MT_CHECKLEN + soff + i];
+		}
+		break;
+	    case MT_MEMMOVE:
+		/* overlapping, destination above the source */
+		name = "memmove";
+		memmove(buf + 8 + doff, buf + soff, len);
+		for (i=len; i>0; i--) {
+			ref[8 + doff + i - 1] = ref[soff + i - 1];
+		}
+		break;
+	    case MT_MEMSET:
+		name = "memset";
+		memset(buf + doff, 0xa5, len);
+		for (i=0; i<len; i++) {
+			ref[doff + i] = 0xa5;
+		}
+		break;
+	    case MT_BZERO:
+		name = "bzero";
+		bzero(buf + doff, len);
+		for (i=0; i<len; i++) {
+			ref[doff + i] = 0;
+		}
+		break;
+	}
+
+	for (i=0; i<2*MT_CHECKLEN; i++) {
+		if (buf[i] != ref[i]) {
+			panic("memtest: %s wrong at dst+%u src+%u len %zu\n",
+			      name, doff, soff, len);
+		}
+	}
+}
+
+static
+void
+mt_check(unsigned char *buf, unsigned char *ref)
+{
+	enum mt_op op;
+	unsigned doff, soff;
+	size_t len;
+
+	for (op = MT_MEMCPY; op <= MT_BZERO; op++) {
+		for (doff = 0; doff < 8; doff++) {
+			for (soff = 0; soff < 8; soff++) {
+				for (len = 0; len + 8 + doff < MT_CHECKLEN;
+				     len++) {
+					mt_fill(buf, 2*MT_CHECKLEN, len);
+					mt_fill(ref, 2*MT_CHECKLEN, len);
+					mt_checkone(op, buf, ref,
+						    doff, soff, len);
+				}
+			}
+		}
+	}
+	kprintf("memcpy/memmove/memset/bzero results correct\n");
+}
+
+static
+void
+mt_report(const char *op, const char *align, size_t size,
+	  const struct timespec *before, const struct timespec *after,
+	  uint64_t bytes)
+{
+	struct timespec duration;
+	uint64_t ns;
+
+	timespec_sub(after, before, &duration);
+	ns = (uint64_t)duration.tv_sec * 1000000000ULL + duration.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	kprintf("%-10s %-10s %6zu bytes: %llu MB/s\n", op, align, size,
+		(unsigned long long)(bytes * 1000 / ns));
+}
+
+/*
+ * Time ROUNDS of OP on SIZE bytes at the given offsets.
+ */
+static
+void
+mt_time(enum mt_op op, const char *opname, const char *align,
+	unsigned char *dst, unsigned char *src, size_t size)
+{
+	struct timespec before, after;
+	unsigned i, rounds;
+
+	rounds = MT_BYTES / size;
+	gettime(&before);
+	for (i=0; i<rounds; i++) {
+		switch (op) {
+		    case MT_MEMCPY:
+			memcpy(dst, src, size);
+			break;
+		    case MT_MEMMOVE:
+			memmove(dst, src, size);
+			break;
+		    case MT_MEMSET:
+			memset(dst, i, size);
+			break;
+		    case MT_BZERO:
+			bzero(dst, size);
+			break;
+		}
+	}
+	gettime(&after);
+	mt_report(opname, align, size, &before, &after,
+		  (uint64_t)rounds * size);
+}
+
+int
+memtest(int nargs, char **args)
+{
+	struct timespec before, after;
+	vaddr_t pa, pb;
+	unsigned char *a, *b;
+	unsigned i, j, rounds;
+
+	(void)nargs;
+	(void)args;
+
+	pa = alloc_kpages(MT_NPAGES);
+	pb = alloc_kpages(MT_NPAGES);
+	if (pa == 0 || pb == 0) {
+		kprintf("memtest: Out of memory\n");
+		if (pa != 0) {
+			free_kpages(pa);
+		}
+		if (pb != 0) {
+			free_kpages(pb);
+		}
+		return ENOMEM;
+	}
+	a = (unsigned char *)pa;
+	b = (unsigned char *)pb;
+
+	mt_check(a, b);
+
+	kprintf("Starting block copy benchmark...\n");
+	mt_fill(a, MT_NPAGES * PAGE_SIZE, 0);
+	for (i=0; i<NUM_MT_SIZES; i++) {
+		for (j=0; j<NUM_MT_ALIGNS; j++) {
+			mt_time(MT_MEMCPY, "memcpy", mt_aligns[j].name,
+				b + mt_aligns[j].doff, a + mt_aligns[j].soff,
+				mt_sizes[i]);
+		}
+		/* overlapping and destination above: copies backwards */
+		for (j=0; j<NUM_MT_ALIGNS; j++) {
+			mt_time(MT_MEMMOVE, "memmove", mt_aligns[j].name,
+				a + 64 + mt_aligns[j].doff,
+				a + mt_aligns[j].soff, mt_sizes[i]);
+		}
+		mt_time(MT_MEMSET, "memset", "aligned", b, NULL, mt_sizes[i]);
+		mt_time(MT_MEMSET, "memset", "unaligned", b + 1, NULL,
+			mt_sizes[i]);
+		mt_time(MT_BZERO, "bzero", "aligned", b, NULL, mt_sizes[i]);
+	}
+
+	rounds = MT_BYTES / PAGE_SIZE;
+	gettime(&before);
+	for (i=0; i<rounds; i++) {
+		page_copy(pb, pa);
+	}
+	gettime(&after);
+	mt_report("page_copy", "aligned", PAGE_SIZE, &before, &after,
+		  (uint64_t)rounds * PAGE_SIZE);
+
+	gettime(&before);
+	for (i=0; i<rounds; i++) {
+		page_zero(pb);
+	}
+	gettime(&after);
+	mt_report("page_zero", "aligned", PAGE_SIZE, &before, &after,
+		  (uint64_t)rounds * PAGE_SIZE);
+
+	free_kpages(pa);
+	free_kpages(pb);
+	kprintf("Block copy benchmark done\n");
+	return 0;
+}
@@ -52,7 +52,11 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <vm.h>
 #include <pid.h>
+#include <kcache.h>
+#include <kstat.h>
+#include <clock.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -72,6 +76,31 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Stacks of exited threads, kept for reuse. */
+static struct kcache *stack_cache;
+
+/*
+ * Scheduler tuning. A thread at run queue level L gets a time slice
+ * of SCHED_QUANTUM << L hardclocks; if it uses it all up it moves
+ * down a level. Every SCHED_BOOST_HARDCLOCKS everything is moved back
+ * up, so nothing starves.
+ */
+#define SCHED_QUANTUM		1U
+#define SCHED_BOOST_HARDCLOCKS	HZ	/* multiple of SCHEDULE_HARDCLOCKS */
+
+/* Frames an idle cpu zeroes (frame_prezero) per wakeup. */
+#define IDLE_PREZERO_BATCH	4
+
+/* Hardclocks since boot, as counted by cpu 0; for accounting. */
+static volatile unsigned thread_now;
+
+/* Accounting totals for exited threads. */
+static struct spinlock thread_stats_lock = SPINLOCK_INITIALIZER;
+static unsigned thread_stats_count;
+static uint64_t thread_stats_turnaround;
+static uint64_t thread_stats_response;
+static uint64_t thread_stats_cputicks;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -150,6 +179,15 @@ thread_create(const char *name)
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduler fields */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_nice = 0;
+	thread->t_cputicks = 0;
+	thread->t_created = thread_now;
+	thread->t_firstrun = 0;
+	thread->t_hasrun = false;
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -168,6 +206,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -184,7 +223,9 @@ cpu_create(unsigned hardware_number)
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<CPU_NRUNQUEUES; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -195,6 +236,7 @@ cpu_create(unsigned hardware_number)
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	kstat_cpu_init(c->c_number);
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -278,7 +320,7 @@ thread_destroy(struct thread *thread)
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
 	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
+		kcache_free(stack_cache, thread->t_stack);
 	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
@@ -317,6 +359,9 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	struct threadlist *rq;
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -331,9 +376,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = &curcpu->c_runqueue.tl_tail;
-	curcpu->c_runqueue.tl_tail.tln_prev = &curcpu->c_runqueue.tl_head;
+	for (i=0; i<CPU_NRUNQUEUES; i++) {
+		rq = &curcpu->c_runqueue[i];
+		rq->tl_count = 0;
+		rq->tl_head.tln_next = &rq->tl_tail;
+		rq->tl_tail.tln_prev = &rq->tl_head;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -376,6 +424,15 @@ thread_bootstrap(void)
 {
 	cpuarray_init(&allcpus);
 
+	/*
+	 * Stacks from cpu_create come from kmalloc directly, which
+	 * is fine: the cache is just STACK_SIZE blocks.
+	 */
+	stack_cache = kcache_create("thread stacks", STACK_SIZE, NULL, NULL);
+	if (stack_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -445,6 +502,66 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Highest level thread T may be at.
+ */
+static
+unsigned
+thread_minlevel(struct thread *t)
+{
+	return t->t_nice * (CPU_NRUNQUEUES - 1) / NICE_MAX;
+}
+
+/*
+ * Number of threads ready to run on cpu C. Call with the run queue
+ * lock held (or accept a racy answer).
+ */
+static
+unsigned
+thread_runcount(struct cpu *c)
+{
+	unsigned i, n;
+
+	n = 0;
+	for (i=0; i<CPU_NRUNQUEUES; i++) {
+		n += c->c_runqueue[i].tl_count;
+	}
+	return n;
+}
+
+/*
+ * Take the next thread to run off cpu C's run queues.
+ */
+static
+struct thread *
+thread_nextready(struct cpu *c)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (i=0; i<CPU_NRUNQUEUES; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			return threadlist_remhead(&c->c_runqueue[i]);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Move a thread that's waking up after sleeping up a level, with a
+ * fresh time slice. The caller has it off all lists.
+ */
+static
+void
+thread_wakeboost(struct thread *t)
+{
+	if (t->t_priority > thread_minlevel(t)) {
+		t->t_priority--;
+	}
+	t->t_ticks = 0;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -469,7 +586,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	threadlist_addtail(&targetcpu->c_runqueue[target->t_priority], target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -509,7 +626,7 @@ thread_fork(const char *name,
 	}
 
 	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	newthread->t_stack = kcache_alloc(stack_cache);
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -523,6 +640,10 @@ thread_fork(const char *name,
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
 
+	/* Scheduler fields: keep the parent's niceness */
+	newthread->t_nice = curthread->t_nice;
+	newthread->t_priority = thread_minlevel(newthread);
+
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
 		proc = curthread->t_proc;
@@ -565,6 +686,7 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *cur, *next;
+	unsigned prezeroed;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -591,7 +713,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && thread_runcount(curcpu) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -643,16 +765,40 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	prezeroed = 0;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = thread_nextready(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/*
+			 * Zero a few frames for the VM system before
+			 * sleeping, looking at the runqueue again after
+			 * each. Interrupts are off meanwhile, so stop
+			 * after IDLE_PREZERO_BATCH and let cpu_idle take
+			 * them.
+			 */
+			if (prezeroed < IDLE_PREZERO_BATCH && frame_prezero()) {
+				prezeroed++;
+			}
+			else {
+				cpu_idle();
+				prezeroed = 0;
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	if (next != cur) {
+		kstat_count(KSTAT_CSWITCH);
+	}
+
+	/* Note when it first got the cpu, for accounting */
+	if (!next->t_hasrun) {
+		next->t_firstrun = thread_now;
+		next->t_hasrun = true;
+	}
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -797,6 +943,14 @@ thread_exit(void)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/* Add to the accounting totals */
+	spinlock_acquire(&thread_stats_lock);
+	thread_stats_count++;
+	thread_stats_turnaround += thread_now - cur->t_created;
+	thread_stats_response += cur->t_firstrun - cur->t_created;
+	thread_stats_cputicks += cur->t_cputicks;
+	spinlock_release(&thread_stats_lock);
+
 	/* Interrupts off on this processor */
         splhigh();
 
@@ -821,17 +975,159 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each cpu has CPU_NRUNQUEUES
+ * run queues, and always runs the first thread in the highest-priority
+ * (lowest-numbered) queue that isn't empty; threads in the same queue
+ * take turns.
+ *
+ *   - A thread that uses up its time slice at a level is moved down
+ *     one (thread_tick), so CPU-bound threads sink. Lower levels get
+ *     longer time slices.
+ *   - A thread that wakes up after sleeping is moved up one
+ *     (wchan_wakeone/wchan_wakeall), so interactive threads float.
+ *   - A thread is preempted at the next tick if something of higher
+ *     priority is ready on its cpu.
+ *   - Periodically everything is moved back to the top (schedule),
+ *     so CPU-bound threads don't starve.
+ *
+ * The nice value sets how high a thread can go: nicer threads start
+ * on, and are boosted back to, lower levels.
  */
 
+/*
+ * Periodic aging: every SCHED_BOOST_HARDCLOCKS, move every thread on
+ * this cpu back to the highest level its nice value allows.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+	unsigned i;
+
+	if (curcpu->c_hardclocks % SCHED_BOOST_HARDCLOCKS != 0) {
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<CPU_NRUNQUEUES; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+		       != NULL) {
+			t->t_priority = thread_minlevel(t);
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[t->t_priority],
+					   t);
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = thread_minlevel(curthread);
+		curthread->t_ticks = 0;
+	}
+}
+
+bool
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	bool expired, preempt;
+	unsigned i;
+
+	if (curcpu->c_number == 0) {
+		thread_now++;
+	}
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	cur->t_cputicks++;
+	cur->t_ticks++;
+	expired = cur->t_ticks >= (SCHED_QUANTUM << cur->t_priority);
+	if (expired) {
+		if (cur->t_priority < CPU_NRUNQUEUES - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		return true;
+	}
+
+	/* Anything more important waiting? (Racy, but only a hint.) */
+	preempt = false;
+	for (i=0; i<cur->t_priority; i++) {
+		if (curcpu->c_runqueue[i].tl_count > 0) {
+			preempt = true;
+			break;
+		}
+	}
+	return preempt;
+}
+
+int
+thread_nice(int incr)
+{
+	struct thread *cur = curthread;
+	int nice;
+
+	/* clamp the user's incr first, so the sum can't overflow */
+	if (incr < -NICE_MAX) {
+		incr = -NICE_MAX;
+	}
+	if (incr > NICE_MAX) {
+		incr = NICE_MAX;
+	}
+	nice = cur->t_nice + incr;
+	if (nice < 0) {
+		nice = 0;
+	}
+	if (nice > NICE_MAX) {
+		nice = NICE_MAX;
+	}
+	cur->t_nice = nice;
+	if (cur->t_priority < thread_minlevel(cur)) {
+		cur->t_priority = thread_minlevel(cur);
+		cur->t_ticks = 0;
+	}
+	return nice;
+}
+
+void
+thread_printstats(bool reset)
+{
+	unsigned count, i, numcpus, level;
+	uint64_t turnaround, response, cputicks;
+	struct cpu *c;
+
+	spinlock_acquire(&thread_stats_lock);
+	count = thread_stats_count;
+	turnaround = thread_stats_turnaround;
+	response = thread_stats_response;
+	cputicks = thread_stats_cputicks;
+	if (reset) {
+		thread_stats_count = 0;
+		thread_stats_turnaround = 0;
+		thread_stats_response = 0;
+		thread_stats_cputicks = 0;
+	}
+	spinlock_release(&thread_stats_lock);
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u: ready by level:", c->c_number);
+		spinlock_acquire(&c->c_runqueue_lock);
+		for (level=0; level<CPU_NRUNQUEUES; level++) {
+			kprintf(" %u", c->c_runqueue[level].tl_count);
+		}
+		spinlock_release(&c->c_runqueue_lock);
+		kprintf("\n");
+	}
+
+	/* ticks are 1000/HZ ms */
+	kprintf("%u threads exited; average turnaround %llu ms, "
+		"response %llu ms, cpu %llu ms\n", count,
+		count ? (unsigned long long)(turnaround * 1000 / HZ / count) : 0,
+		count ? (unsigned long long)(response * 1000 / HZ / count) : 0,
+		count ? (unsigned long long)(cputicks * 1000 / HZ / count) : 0);
 }
 
 /*
@@ -855,7 +1151,7 @@ void
 thread_consider_migration(void)
 {
 	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
+	unsigned i, numcpus, level;
 	struct cpu *c;
 	struct threadlist victims;
 	struct thread *t;
@@ -865,9 +1161,9 @@ thread_consider_migration(void)
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
 		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += thread_runcount(c);
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = thread_runcount(c);
 		}
 		spinlock_release(&c->c_runqueue_lock);
 	}
@@ -880,8 +1176,14 @@ thread_consider_migration(void)
 	to_send = my_count - one_share;
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
+	/* Send the least important ones */
+	level = CPU_NRUNQUEUES - 1;
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		while (threadlist_isempty(&curcpu->c_runqueue[level])) {
+			KASSERT(level > 0);
+			level--;
+		}
+		t = threadlist_remtail(&curcpu->c_runqueue[level]);
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -892,7 +1194,7 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (thread_runcount(c) < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -923,7 +1225,7 @@ thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			threadlist_addtail(&c->c_runqueue[t->t_priority], t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -947,7 +1249,8 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			threadlist_addtail(&curcpu->c_runqueue[t->t_priority],
+					   t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1045,6 +1348,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_switch.
 	 */
 
+	thread_wakeboost(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1075,6 +1379,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_wakeboost(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1143,23 +1448,20 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	while (target->c_numshootdown == TLBSHOOTDOWN_MAX) {
 		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
+		 * Wait for the target to empty its queue, which it
+		 * does from its IPI handler. That is only safe with
+		 * our own interrupts on: two CPUs waiting on each
+		 * other with interrupts off would never get there.
 		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		KASSERT(curthread->t_iplhigh_count == 0);
+		spinlock_release(&target->c_ipi_lock);
+		spinlock_acquire(&target->c_ipi_lock);
 	}
+	n = target->c_numshootdown;
+	target->c_shootdown[n] = *mapping;
+	target->c_numshootdown = n+1;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
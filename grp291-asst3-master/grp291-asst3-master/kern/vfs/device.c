@@ -242,9 +242,12 @@ null_fsync(struct vnode *v)
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, off_t offset, bool write, paddr_t *frame)
 {
 	(void)v;
+	(void)offset;
+	(void)write;
+	(void)frame;
 	return ENOSYS;
 }
 
@@ -83,23 +83,35 @@ vopfail_uio_nosys(struct vnode *vn, struct uio *uio)
 // mmap
 
 int
-vopfail_mmap_isdir(struct vnode *vn /*add stuff */)
+vopfail_mmap_isdir(struct vnode *vn, off_t offset, bool write,
+		paddr_t *frame)
 {
 	(void)vn;
+	(void)offset;
+	(void)write;
+	(void)frame;
 	return EISDIR;
 }
 
 int
-vopfail_mmap_perm(struct vnode *vn /*add stuff */)
+vopfail_mmap_perm(struct vnode *vn, off_t offset, bool write,
+		paddr_t *frame)
 {
 	(void)vn;
+	(void)offset;
+	(void)write;
+	(void)frame;
 	return EPERM;
 }
 
 int
-vopfail_mmap_nosys(struct vnode *vn /*add stuff */)
+vopfail_mmap_nosys(struct vnode *vn, off_t offset, bool write,
+		paddr_t *frame)
 {
 	(void)vn;
+	(void)offset;
+	(void)write;
+	(void)frame;
 	return ENOSYS;
 }
 
@@ -190,6 +190,30 @@ vfs_sync(void)
 	return 0;
 }
 
+/*
+ * Print statistics for every device with devop_printstats.
+ */
+void
+vfs_printdevstats(void)
+{
+	struct knowndev *kd;
+	struct device *dev;
+	unsigned i, num;
+
+	vfs_biglock_acquire();
+
+	num = knowndevarray_num(knowndevs);
+	for (i=0; i<num; i++) {
+		kd = knowndevarray_get(knowndevs, i);
+		dev = kd->kd_device;
+		if (dev != NULL && dev->d_ops->devop_printstats != NULL) {
+			dev->d_ops->devop_printstats(dev, kd->kd_name);
+		}
+	}
+
+	vfs_biglock_release();
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
@@ -249,11 +249,17 @@ vfs_lookparent(char *path, struct vnode **retval,
 	vfs_biglock_acquire();
 
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
+	/*
+	 * The big lock only protects the device list and the boot and
+	 * current directories; file systems lock their own vnodes, and
+	 * our reference to STARTVN keeps its file system mounted. So
+	 * the lookup itself runs without it.
+	 */
 	if (strlen(path)==0) {
 		/*
 		 * It does not make sense to use just a device name in
@@ -268,7 +274,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -281,20 +286,19 @@ vfs_lookup(char *path, struct vnode **retval)
 	vfs_biglock_acquire();
 
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
+	/* As in vfs_lookparent, the lookup runs without the big lock */
 	result = VOP_LOOKUP(startvn, path, retval);
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
@@ -37,6 +37,10 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <synch.h>
+#include <vnode.h>
+#include <kern/stat.h>
+#include <swap.h>
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
@@ -46,47 +50,62 @@
  * part of the VM subsystem.
  *
  */
-int copy_pagetable(paddr_t ***old, paddr_t ***new);
+int copy_pagetable(struct addrspace *old, struct addrspace *new);
+static int region_insert(struct addrspace *as, vaddr_t base, size_t npages,
+			 struct region **ret);
+static void region_remove(struct addrspace *as, struct region *region);
 
-int copy_pagetable(paddr_t ***old, paddr_t ***new){
+/*
+ * Copy-on-write: the new page table points at the same frames as the
+ * old one and every shared frame gains an owner. Neither side gets a
+ * dirty TLB entry for a shared frame, so the first write to it traps
+ * as VM_FAULT_READONLY and vm_fault gives the writer a private copy.
+ *
+ * Only the populated range of each populated leaf is visited. On
+ * failure the new table holds the leaves copied so far, so as_destroy
+ * can release whatever was shared.
+ */
+int copy_pagetable(struct addrspace *old, struct addrspace *new){
 	if (new == NULL || old == NULL) {
 		return EFAULT;
 	}
-	// traverse root nodes
-	for (int i = 0; i < PT_ROOT_SIZE; i++){
-		if (old[i] == NULL){
-			new[i] = NULL;
-			continue;
+	if (old->pt_nleaves == 0) {
+		return 0;
+	}
+	new->pt_leaves = kmalloc(sizeof(struct pt_leaf) * old->pt_nleaves);
+	if (new->pt_leaves == NULL) {
+		return ENOMEM;
+	}
+	new->pt_maxleaves = old->pt_nleaves;
+
+	for (unsigned i = 0; i < old->pt_nleaves; i++) {
+		struct pt_leaf *rec = &old->pt_leaves[i];
+		paddr_t *from = old->pt_dir[rec->dir];
+		paddr_t *to = pt_alloc_leaf();
+		if (to == NULL) {
+			return ENOMEM;
 		}
-		new[i] = kmalloc(sizeof(paddr_t *) * PT_NODE_SIZE);
-		if (new[i] == NULL){ return ENOMEM; }
 
-		// traverse second level nodes
-		for (int j = 0; j < PT_NODE_SIZE; j++){
-			if (old[i][j] == NULL){
-				new[i][j] = NULL;
+		// share each frame or swap slot
+		for (unsigned k = rec->lo; k < rec->hi; k++) {
+			paddr_t pte = from[k];
+			while (pte & PTE_BUSY) {
+				// wait until the slot's contents are settled
+				swap_wait();
+				pte = from[k];
+			}
+			to[k] = pte;
+			if (pte == 0) {
 				continue;
 			}
-			new[i][j] = kmalloc(sizeof(paddr_t) * PT_NODE_SIZE);
-			if (new[i][j] == NULL){ return ENOMEM; }
-
-			// traverse leaf nodes
-			for (int k = 0; k < PT_NODE_SIZE; k++){
-				if (old[i][j][k] == 0) {
-					new[i][j][k] = 0;
-					continue;
-				}
-
-				// allocate a physical frame
-				vaddr_t kern_addr = alloc_kpages(1);
-				if (kern_addr == 0){ return ENOMEM; }
-				paddr_t frame_addr = KVADDR_TO_PADDR(kern_addr);
-				new[i][j][k] = frame_addr;
-
-				// copy over the content
-				memcpy((void *)kern_addr, (const void *)PADDR_TO_KVADDR(old[i][j][k]), PAGE_SIZE);
+			if (PTE_IS_SWAPPED(pte)) {
+				swap_incref(PTE_SWAP_SLOT(pte));
+			} else {
+				frame_incref(pte & PTE_FRAME);
 			}
 		}
+		new->pt_dir[rec->dir] = to;
+		new->pt_leaves[new->pt_nleaves++] = *rec;
 	}
 	return 0;
 }
@@ -105,15 +124,32 @@ as_create(void)
 	 * Initialize as needed.
 	 */
 	as->stack = USERSTACK;
-	as->head = NULL;
+	as->regions = NULL;
+	as->nregions = 0;
+	as->maxregions = 0;
+	as->heap.base = 0;
+	as->heap.size = 0;
+	as->heap.flag = READ_FLAG | WRITE_FLAG;
+	as->heap.vnode = NULL;
+	as->heap.file_offset = 0;
+	as->heap.file_vaddr = 0;
+	as->heap.file_size = 0;
+	as->heap_break = 0;
+	as->asid = 0;
+	as->asid_gen = 0; // no ASID until first activated
+	as->asid_cpu = NULL;
 
-	as->pagetable = kmalloc(sizeof(paddr_t **) * PT_ROOT_SIZE);
-	if (as->pagetable == NULL) {
+	as->pt_dir = kmalloc(sizeof(paddr_t *) * PT_DIR_SIZE);
+	if (as->pt_dir == NULL) {
+		kfree(as);
 		return NULL;
 	}
-	for (int i = 0; i < PT_ROOT_SIZE; ++i) {
-		as->pagetable[i] = NULL;
+	for (int i = 0; i < PT_DIR_SIZE; ++i) {
+		as->pt_dir[i] = NULL;
 	}
+	as->pt_leaves = NULL;
+	as->pt_nleaves = 0;
+	as->pt_maxleaves = 0;
 	return as;
 }
 
@@ -127,35 +163,40 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	// copy old region list
-	struct region_list *cur = newas->head;
-	struct region_list *tmp;
-	struct region_list *old_cur = old->head;
-	while(old_cur != NULL) {
-		tmp = kmalloc(sizeof(struct region_list));
-		if (tmp == NULL) {
+	// copy old region array
+	if (old->nregions > 0) {
+		newas->regions = kmalloc(sizeof(struct region) * old->nregions);
+		if (newas->regions == NULL) {
+			as_destroy(newas);
 			return ENOMEM;
 		}
-		tmp->size = old_cur->size;
-		tmp->base = old_cur->base;
-		tmp->flag = old_cur->flag;
-		tmp->next = NULL;
-
-		if (newas->head == NULL) {
-			newas->head = tmp;
-			cur = tmp;
-		} else {
-			cur->next = tmp;
-			cur = tmp;
+		memcpy(newas->regions, old->regions,
+		       sizeof(struct region) * old->nregions);
+		newas->nregions = old->nregions;
+		newas->maxregions = old->nregions;
+		for (unsigned i = 0; i < newas->nregions; i++) {
+			if (newas->regions[i].vnode != NULL) {
+				VOP_INCREF(newas->regions[i].vnode);
+			}
 		}
-		old_cur = old_cur->next;
 	}
 
-	// copy the old pagetable
-	int err = copy_pagetable(old->pagetable, newas->pagetable);
+	newas->heap = old->heap;
+	newas->heap_break = old->heap_break;
+
+	// share the old pagetable's frames copy-on-write
+	lock_acquire(vm_lock);
+	int err = copy_pagetable(old, newas);
+	lock_release(vm_lock);
 	if (err) {
+		as_destroy(newas);
 		return ENOMEM;
 	}
+
+	// the old address space may still hold writable TLB entries for
+	// frames that are now shared
+	vm_tlb_unmap_all(old);
+
 	*ret = newas;
 	return 0;
 }
@@ -166,43 +207,51 @@ as_destroy(struct addrspace *as)
 	/*
 	 * Clean up as needed.
 	 */
-	// destroy linked list
-
-	if (as->head != NULL) {
-		struct region_list *tmp;
-		struct region_list *cur = as->head;
-		while (cur != NULL) {
-			tmp = cur->next;
-			kfree(cur);
-			cur = tmp;
+	// destroy the populated leaves of the page table
+	lock_acquire(vm_lock);
+	for (unsigned i = 0; i < as->pt_nleaves; i++) {
+		struct pt_leaf *rec = &as->pt_leaves[i];
+		paddr_t *leaf = as->pt_dir[rec->dir];
+		for (unsigned k = rec->lo; k < rec->hi; k++) {
+			paddr_t pte = leaf[k];
+			while (pte & PTE_BUSY) {
+				// the evictor still has to update this PTE
+				swap_wait();
+				pte = leaf[k];
+			}
+			if (pte == 0) {
+				continue;
+			}
+			if (PTE_IS_SWAPPED(pte)) {
+				swap_free(PTE_SWAP_SLOT(pte));
+			} else {
+				free_kpages(PADDR_TO_KVADDR(pte & PTE_FRAME));
+			}
 		}
+		free_kpages((vaddr_t)leaf);
 	}
-	// destroy 3 level page table
-	if (as->pagetable != NULL) {
-		for (int i = 0 ; i < PT_ROOT_SIZE; ++i) {
-			if (as->pagetable[i] != NULL) {
-				for (int j = 0; j < PT_NODE_SIZE; ++j) {
-					if (as->pagetable[i][j] != NULL) {
-						for (int k = 0; k < PT_NODE_SIZE ; ++k) {
-							if (as->pagetable[i][j][k] != 0) {
-								free_kpages(PADDR_TO_KVADDR(as->pagetable[i][j][k]));
-							}
-						}
-						kfree(as->pagetable[i][j]);
-					}
-				}
-				kfree(as->pagetable[i]);
+	lock_release(vm_lock);
+	kfree(as->pt_leaves);
+	kfree(as->pt_dir);
+
+	// destroy region array. The page table is gone, so mmapped pages
+	// are no longer mapped here and fsync writes back and releases them
+	for (unsigned i = 0; i < as->nregions; i++) {
+		struct region *region = &as->regions[i];
+		if (region->vnode != NULL) {
+			if (region->flag & SHARED_FLAG) {
+				VOP_FSYNC(region->vnode);
 			}
+			VOP_DECREF(region->vnode);
 		}
-		kfree(as->pagetable);
 	}
+	kfree(as->regions);
 	kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -213,15 +262,9 @@ as_activate(void)
 		 */
 		return;
 	}
-	
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
 
-	splx(spl);
+	// entries are tagged with the ASID, so nothing needs flushing
+	vm_tlb_activate(as);
 }
 
 void
@@ -234,6 +277,71 @@ as_deactivate(void)
 	 */
 }
 
+/*
+ * Add an anonymous region of NPAGES pages at BASE to the sorted region
+ * array, failing if it would overlap a neighbour. The caller fills in
+ * the flags.
+ */
+static int
+region_insert(struct addrspace *as, vaddr_t base, size_t npages,
+	      struct region **ret)
+{
+	unsigned pos = 0;
+	while (pos < as->nregions && as->regions[pos].base < base) {
+		pos++;
+	}
+	if (pos > 0) {
+		struct region *prev = &as->regions[pos - 1];
+		if (prev->base + prev->size * PAGE_SIZE > base) {
+			return EINVAL;
+		}
+	}
+	if (pos < as->nregions &&
+	    as->regions[pos].base < base + npages * PAGE_SIZE) {
+		return EINVAL;
+	}
+
+	if (as->nregions == as->maxregions) {
+		unsigned max = as->maxregions ? as->maxregions * 2 : 4;
+		struct region *regions = kmalloc(sizeof(struct region) * max);
+		if (regions == NULL) {
+			return ENOMEM;
+		}
+		if (as->nregions > 0) {
+			memcpy(regions, as->regions,
+			       sizeof(struct region) * as->nregions);
+		}
+		kfree(as->regions);
+		as->regions = regions;
+		as->maxregions = max;
+	}
+	memmove(&as->regions[pos + 1], &as->regions[pos],
+		sizeof(struct region) * (as->nregions - pos));
+	as->nregions++;
+
+	struct region *region = &as->regions[pos];
+	region->base = base;
+	region->size = npages;
+	region->flag = 0;
+	region->vnode = NULL;
+	region->file_offset = 0;
+	region->file_vaddr = 0;
+	region->file_size = 0;
+	*ret = region;
+	return 0;
+}
+
+static void
+region_remove(struct addrspace *as, struct region *region)
+{
+	unsigned pos = region - as->regions;
+
+	KASSERT(pos < as->nregions);
+	as->nregions--;
+	memmove(&as->regions[pos], &as->regions[pos + 1],
+		sizeof(struct region) * (as->nregions - pos));
+}
+
 /*
  * Set up a segment at virtual address VADDR of size MEMSIZE. The
  * segment in memory extends from VADDR up to (but not including)
@@ -254,13 +362,23 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 	if (as == NULL) {
 		return EFAULT;
 	}
-	struct region_list *new_region = kmalloc(sizeof(struct region_list));
-	if (new_region == NULL) {
-		return ENOMEM;
+	// keep user regions out of kernel space
+	if (vaddr >= USERSPACETOP || memsize > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
+	// regions cover whole pages
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+	size_t npages = ROUNDUP(memsize, PAGE_SIZE) / PAGE_SIZE;
+	if (npages == 0) {
+		return EINVAL;
 	}
 
-	new_region->base = vaddr;
-	new_region->size = memsize;
+	struct region *new_region;
+	int result = region_insert(as, vaddr, npages, &new_region);
+	if (result) {
+		return result;
+	}
 	int flag_val = 0;
 	if (readable) {
 	 	flag_val = flag_val | READ_FLAG;
@@ -272,49 +390,77 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
 		flag_val = flag_val | EXEC_FLAG;
 	}
 	new_region->flag = flag_val;
-	new_region->next = as->head;
-	as->head = new_region;
 	return 0;
 }
 
+/*
+ * Back the region containing VADDR with FILESIZE bytes of V starting
+ * at file offset OFFSET, to appear at VADDR. Nothing is read now;
+ * vm_fault reads each page in on first touch. The region keeps a
+ * reference to V.
+ */
 int
-as_prepare_load(struct addrspace *as)
+as_define_backing(struct addrspace *as, vaddr_t vaddr, struct vnode *v,
+		  off_t offset, size_t filesize)
 {
+	struct region *region;
+	struct stat st;
+	int result;
+
 	if (as == NULL) {
 		return EFAULT;
 	}
-	// if change read_only regions to RW region and set 0x8 to be true
-	struct region_list *cur = as->head;
-	while (cur != NULL) {
-		if (cur->flag == READ_FLAG) {
-			cur->flag = cur->flag | LOAD_FLAG;
-			cur->flag = cur->flag | WRITE_FLAG;
-		}
-		cur = cur->next;
+	region = find_region(as, vaddr);
+	if (region == NULL || region->vnode != NULL) {
+		return EINVAL;
+	}
+	if (filesize > 0 &&
+	    vaddr + filesize > region->base + region->size * PAGE_SIZE) {
+		return ENOEXEC;
+	}
+
+	// a truncated file would only show up at fault time; catch it now
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
 	}
+	if (offset + (off_t)filesize > st.st_size) {
+		kprintf("ELF: segment past end of file - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	VOP_INCREF(v);
+	region->vnode = v;
+	region->file_offset = offset;
+	region->file_vaddr = vaddr;
+	region->file_size = filesize;
 	return 0;
 }
 
 int
-as_complete_load(struct addrspace *as)
+as_prepare_load(struct addrspace *as)
 {
-	// if 0x8 mask is true, change it to read_only
-	struct region_list *cur = as->head;
-	while (cur != NULL) {
-		if (cur->flag & LOAD_FLAG) {
-			cur->flag = READ_FLAG;
-		}
-		cur = cur->next;
+	if (as == NULL) {
+		return EFAULT;
 	}
-	
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	int spl = splhigh();
+	// segments are paged in through kernel addresses by vm_fault, so
+	// read-only regions no longer need to be writable while loading
+	return 0;
+}
 
-	for (int i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+int
+as_complete_load(struct addrspace *as)
+{
+	if (as == NULL) {
+		return EFAULT;
 	}
-
-	splx(spl);
+	// the heap starts out empty, just past the last segment
+	if (as->nregions > 0) {
+		struct region *last = &as->regions[as->nregions - 1];
+		as->heap.base = last->base + last->size * PAGE_SIZE;
+	}
+	as->heap.size = 0;
+	as->heap_break = as->heap.base;
 	return 0;
 }
 
@@ -325,10 +471,157 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	 * Write this.
 	 */
 	vaddr_t stack_base = USERSTACK - STACK_PAGE * PAGE_SIZE;
-	as_define_region(as, stack_base, STACK_PAGE, 1, 1, 0);
+	int result = as_define_region(as, stack_base, STACK_PAGE * PAGE_SIZE, 1, 1, 0);
+	if (result) {
+		return result;
+	}
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
 
 	return 0;
 }
 
+/*
+ * Move the break. New heap pages are zero-filled by vm_fault when
+ * first touched; pages given up by shrinking are freed (or their swap
+ * slots released) right away. The heap may grow up to the next region,
+ * which is normally the stack.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	vaddr_t newbreak, oldtop, newtop, limit;
+
+	if (as == NULL) {
+		return EFAULT;
+	}
+	if (amount < 0 && (vaddr_t)-amount > as->heap_break - as->heap.base) {
+		return EINVAL;
+	}
+
+	limit = USERSPACETOP;
+	for (unsigned i = 0; i < as->nregions; i++) {
+		if (as->regions[i].base >= as->heap.base) {
+			limit = as->regions[i].base;
+			break;
+		}
+	}
+	if (amount > 0 && (vaddr_t)amount > limit - as->heap_break) {
+		return ENOMEM;
+	}
+
+	newbreak = as->heap_break + amount;
+	oldtop = as->heap.base + as->heap.size * PAGE_SIZE;
+	newtop = ROUNDUP(newbreak, PAGE_SIZE);
+	if (newtop < oldtop) {
+		lock_acquire(vm_lock);
+		pt_unmap_range(as, newtop, oldtop);
+		lock_release(vm_lock);
+	}
+
+	*oldbreak = as->heap_break;
+	as->heap_break = newbreak;
+	as->heap.size = (newtop - as->heap.base) / PAGE_SIZE;
+	return 0;
+}
+
+/*
+ * Map a file shared. The mapping goes in the highest gap below the
+ * stack that fits and lies above the heap; the heap can then only
+ * grow up to it. Pages are mapped in from the file's page cache by
+ * vm_fault.
+ */
+int
+as_mmap(struct addrspace *as, struct vnode *v, size_t len, bool writeable,
+	off_t offset, vaddr_t *addr)
+{
+	vaddr_t floor, top, base;
+	size_t npages;
+	struct region *region;
+	int result;
+
+	if (as == NULL) {
+		return EFAULT;
+	}
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+
+	// can this file be mapped at all?
+	result = VOP_MMAP(v, offset, writeable, NULL);
+	if (result) {
+		return result;
+	}
+
+	npages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+	floor = as->heap.base + as->heap.size * PAGE_SIZE;
+	top = USERSPACETOP;
+	base = 0;
+	for (unsigned i = as->nregions; i-- > 0; ) {
+		struct region *r = &as->regions[i];
+		vaddr_t end = r->base + r->size * PAGE_SIZE;
+		if (end <= floor) {
+			break;
+		}
+		if (top - end >= npages * PAGE_SIZE) {
+			base = top - npages * PAGE_SIZE;
+			break;
+		}
+		top = r->base;
+	}
+	if (base == 0) {
+		if (top < floor || top - floor < npages * PAGE_SIZE) {
+			return ENOMEM;
+		}
+		base = top - npages * PAGE_SIZE;
+	}
+
+	result = region_insert(as, base, npages, &region);
+	if (result) {
+		return result;
+	}
+	region->flag = READ_FLAG | SHARED_FLAG | (writeable ? WRITE_FLAG : 0);
+	VOP_INCREF(v);
+	region->vnode = v;
+	region->file_offset = offset;
+	region->file_vaddr = base;
+	region->file_size = len;
+
+	*addr = base;
+	return 0;
+}
+
+/*
+ * Remove an mmapped region. Dropping the page table entries releases
+ * our references to the cached frames; fsync then writes back what
+ * was changed and drops pages nobody maps any more.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t addr)
+{
+	struct region *region;
+	struct vnode *v;
+	int result;
+
+	if (as == NULL) {
+		return EFAULT;
+	}
+	region = find_region(as, addr);
+	if (region == NULL || region->base != addr ||
+	    !(region->flag & SHARED_FLAG)) {
+		return EINVAL;
+	}
+
+	lock_acquire(vm_lock);
+	pt_unmap_range(as, region->base, region->base + region->size * PAGE_SIZE);
+	lock_release(vm_lock);
+
+	v = region->vnode;
+	region_remove(as, region);
+	result = VOP_FSYNC(v);
+	VOP_DECREF(v);
+	return result;
+}
@@ -0,0 +1,126 @@
+/*
+ * Object caches. See kcache.h.
+ *
+ * Each cache is a small stack of free, constructed objects under a
+ * spinlock; everything else goes to kmalloc and kfree. (kmalloc
+ * already keeps per-cpu magazines of raw blocks; what this adds is
+ * skipping the constructor and destructor, and caching objects too
+ * big for the subpage allocator.)
+ */
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <kcache.h>
+
+#define KCACHE_MAX	16	/* free objects kept per cache */
+
+struct kcache {
+	char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+	struct spinlock kc_lock;	/* protects the rest */
+	unsigned kc_nfree;
+	void *kc_free[KCACHE_MAX];
+	unsigned kc_hits;		/* allocs served from kc_free */
+	unsigned kc_misses;		/* allocs that went to kmalloc */
+};
+
+struct kcache *
+kcache_create(const char *name, size_t size,
+	      int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kcache *kc;
+
+	kc = kmalloc(sizeof(struct kcache));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+	kc->kc_size = size;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+	spinlock_init(&kc->kc_lock);
+	kc->kc_nfree = 0;
+	kc->kc_hits = 0;
+	kc->kc_misses = 0;
+	return kc;
+}
+
+void *
+kcache_alloc(struct kcache *kc)
+{
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nfree > 0) {
+		obj = kc->kc_free[--kc->kc_nfree];
+		kc->kc_hits++;
+		spinlock_release(&kc->kc_lock);
+		return obj;
+	}
+	kc->kc_misses++;
+	spinlock_release(&kc->kc_lock);
+
+	obj = kmalloc(kc->kc_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	if (kc->kc_ctor != NULL && kc->kc_ctor(obj) != 0) {
+		kfree(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+void
+kcache_free(struct kcache *kc, void *obj)
+{
+	spinlock_acquire(&kc->kc_lock);
+	if (kc->kc_nfree < KCACHE_MAX) {
+		kc->kc_free[kc->kc_nfree++] = obj;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (kc->kc_dtor != NULL) {
+		kc->kc_dtor(obj);
+	}
+	kfree(obj);
+}
+
+void
+kcache_destroy(struct kcache *kc)
+{
+	unsigned i;
+
+	for (i=0; i<kc->kc_nfree; i++) {
+		if (kc->kc_dtor != NULL) {
+			kc->kc_dtor(kc->kc_free[i]);
+		}
+		kfree(kc->kc_free[i]);
+	}
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_name);
+	kfree(kc);
+}
+
+void
+kcache_printstats(struct kcache *kc)
+{
+	unsigned hits, misses, nfree;
+
+	spinlock_acquire(&kc->kc_lock);
+	hits = kc->kc_hits;
+	misses = kc->kc_misses;
+	nfree = kc->kc_nfree;
+	spinlock_release(&kc->kc_lock);
+
+	kprintf("kcache %s: %u hits, %u misses, %u free\n", kc->kc_name,
+		hits, misses, nfree);
+}
@@ -30,6 +30,10 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <membar.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
 
 /*
@@ -160,10 +164,9 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the page lists. Most allocations and frees
+ * don't get that far, though; they are served from per-cpu magazines
+ * of free blocks (see below).
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -347,6 +350,129 @@ static struct pageref *allbase;
 
 ////////////////////////////////////////
 
+/*
+ * kfree has to find the pageref for the page a block is on. Rather
+ * than walking allbase, heap pages are entered in a hash table on
+ * their address (open addressing with linear probing). It is only
+ * changed with kmalloc_spinlock held, but is read without it so that
+ * kfree can get to the per-cpu magazines without taking the lock:
+ * pagehash_seq is odd while an entry is being removed (which moves
+ * other entries), and readers that see it change try again.
+ *
+ * There are never more than TOTAL_PAGEREFS pages, so the table can't
+ * fill up.
+ */
+
+#define PAGEHASH_SIZE (2 * TOTAL_PAGEREFS)
+
+static struct pageref *volatile pagehash[PAGEHASH_SIZE];
+static volatile unsigned pagehash_seq;
+
+static
+inline
+unsigned
+pagehash_bucket(vaddr_t page)
+{
+	return (page / PAGE_SIZE) % PAGEHASH_SIZE;
+}
+
+/*
+ * Find the pageref for heap page PAGE, or NULL if it isn't one.
+ * Needs no lock, but the answer for a page can only be relied on
+ * while the caller owns a block on it.
+ */
+static
+struct pageref *
+pagehash_lookup(vaddr_t page)
+{
+	struct pageref *pr;
+	unsigned seq, i, n;
+
+ again:
+	seq = pagehash_seq;
+	membar_load_load();
+	if (seq & 1) {
+		goto again;
+	}
+
+	i = pagehash_bucket(page);
+	for (n = 0; n < PAGEHASH_SIZE; n++) {
+		pr = pagehash[i];
+		if (pr == NULL || PR_PAGEADDR(pr) == page) {
+			break;
+		}
+		i = (i + 1) % PAGEHASH_SIZE;
+	}
+	if (n == PAGEHASH_SIZE) {
+		pr = NULL;
+	}
+
+	membar_load_load();
+	if (pagehash_seq != seq) {
+		goto again;
+	}
+	return pr;
+}
+
+static
+void
+pagehash_insert(struct pageref *pr)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	i = pagehash_bucket(PR_PAGEADDR(pr));
+	while (pagehash[i] != NULL) {
+		i = (i + 1) % PAGEHASH_SIZE;
+	}
+	pagehash[i] = pr;
+}
+
+static
+void
+pagehash_remove(struct pageref *pr)
+{
+	unsigned i, j, home;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	i = pagehash_bucket(PR_PAGEADDR(pr));
+	while (pagehash[i] != pr) {
+		KASSERT(pagehash[i] != NULL);
+		i = (i + 1) % PAGEHASH_SIZE;
+	}
+
+	pagehash_seq++;
+	membar_store_store();
+
+	/*
+	 * Empty the slot, then move back any later entries in the same
+	 * run that can no longer be reached from their home bucket.
+	 */
+	pagehash[i] = NULL;
+	j = i;
+	while (1) {
+		j = (j + 1) % PAGEHASH_SIZE;
+		if (pagehash[j] == NULL) {
+			break;
+		}
+		home = pagehash_bucket(PR_PAGEADDR(pagehash[j]));
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+			/* still reachable */
+			continue;
+		}
+		pagehash[i] = pagehash[j];
+		pagehash[j] = NULL;
+		i = j;
+	}
+
+	membar_store_store();
+	pagehash_seq++;
+}
+
+////////////////////////////////////////
+
 #ifdef GUARDS
 
 /* Space returned to the client is filled with GUARD_RETBYTE */
@@ -812,6 +938,23 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+#ifdef KMAGAZINES
+	{
+		unsigned i, j, n;
+
+		/* (other cpus may be changing these; it's only a hint) */
+		kprintf("Blocks in per-cpu magazines:");
+		for (i=0; i<NSIZES; i++) {
+			n = 0;
+			for (j=0; j<MAXCPUS; j++) {
+				n += kmags[j][i].km_count;
+			}
+			kprintf(" %lu:%u", (unsigned long)sizes[i], n);
+		}
+		kprintf("\n");
+	}
+#endif
 }
 
 ////////////////////////////////////////
@@ -867,49 +1010,19 @@ int blocktype(size_t clientsz)
 }
 
 /*
- * Allocate a block of size SZ, where SZ is not large enough to
- * warrant a whole-page allocation.
+ * Take a free block off the first page of type BLKTYPE that has one.
+ * Returns 0 if none of them do.
  */
 static
-void *
-subpage_kmalloc(size_t sz
-#ifdef LABELS
-		, vaddr_t label
-#endif
-	)
+vaddr_t
+subpage_takeblock(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
-
-	volatile int i;
-
-#ifdef GUARDS
-	size_t clientsz;
-#endif
-
-#ifdef GUARDS
-	clientsz = sz;
-	sz += GUARD_OVERHEAD;
-#endif
-#ifdef LABELS
-#ifdef GUARDS
-	/* Include the label in what GUARDS considers the client data. */
-	clientsz += LABEL_PTROFFSET;
-#endif
-	sz += LABEL_PTROFFSET;
-#endif
-	blktype = blocktype(sz);
-#ifdef GUARDS
-	sz = sizes[blktype];
-#endif
-
-	spinlock_acquire(&kmalloc_spinlock);
+	struct freelist *fl;	// free list entry
 
-	checksubpages();
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
 
@@ -918,57 +1031,51 @@ subpage_kmalloc(size_t sz
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
 			KASSERT(pr->freelist_offset < PAGE_SIZE);
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
+			fl = ((struct freelist *)fla)->next;
 			pr->nfree--;
 
 			if (fl != NULL) {
 				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
+				KASSERT((vaddr_t)fl - prpage < PAGE_SIZE);
+				pr->freelist_offset = (vaddr_t)fl - prpage;
 			}
 			else {
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-#ifdef GUARDS
-			retptr = establishguardband(retptr, clientsz, sz);
-#endif
-#ifdef LABELS
-			retptr = establishlabel(retptr, label);
-#endif
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
+			return fla;
 		}
 	}
+	return 0;
+}
 
-	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
+/*
+ * Get a fresh page and make it a page of free blocks of type BLKTYPE.
+ * Called with kmalloc_spinlock held; returns false if out of memory.
+ *
+ * We release the spinlock while calling alloc_kpages. This avoids
+ * deadlock if alloc_kpages needs to come back here. Note that this
+ * means things can change behind our back...
+ */
+static
+bool
+subpage_addpage(unsigned blktype)
+{
+	struct pageref *pr;
+	vaddr_t prpage, fla;
+	struct freelist *volatile fl;
+	volatile int i;
 
 	spinlock_release(&kmalloc_spinlock);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
-		return NULL;
+		spinlock_acquire(&kmalloc_spinlock);
+		return false;
 	}
 	KASSERT(prpage % PAGE_SIZE == 0);
 #ifdef CHECKBEEF
@@ -983,7 +1090,8 @@ subpage_kmalloc(size_t sz
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
-		return NULL;
+		spinlock_acquire(&kmalloc_spinlock);
+		return false;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -1013,8 +1121,303 @@ subpage_kmalloc(size_t sz
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	pagehash_insert(pr);
+	return true;
+}
+
+/*
+ * Put the block at PTRADDR back on its page PR. If that makes the
+ * whole page free, the page is taken off the lists and its address
+ * returned, for the caller to free_kpages once it has released
+ * kmalloc_spinlock; otherwise returns 0.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, vaddr_t ptraddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t offset;		// offset into page
+	struct freelist *fl;	// free list entry
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	checksubpage(pr);
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fl = (struct freelist *)ptraddr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+
+		/* this block should not already be on the free list! */
+#ifdef SLOW
+		{
+			struct freelist *fl2;
+
+			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
+				KASSERT(fl2 != fl);
+			}
+		}
+#else
+		/* check just the head */
+		KASSERT(fl != fl->next);
+#endif
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		pagehash_remove(pr);
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
+
+////////////////////////////////////////
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps a small stack (a "magazine") of free blocks of each
+ * size, so most kmalloc and kfree calls never touch kmalloc_spinlock
+ * or the page lists. An empty magazine is refilled with half its
+ * capacity from the pages in one go, and a full one gives half back
+ * in one go. Blocks sitting in magazines count as allocated as far as
+ * their pages are concerned.
+ *
+ * The magazines are only touched by their own cpu, at splhigh so an
+ * interrupt handler calling kmalloc can't get in the middle.
+ *
+ * GUARDS and LABELS need to see every allocation, so they turn the
+ * magazines off.
+ */
+
+#if !defined(GUARDS) && !defined(LABELS)
+#define KMAGAZINES
+#endif
+
+#ifdef KMAGAZINES
+
+#define KMAG_ROUNDS	16	/* magazine capacity for small blocks */
+
+struct kmag {
+	unsigned km_count;
+	vaddr_t km_blocks[KMAG_ROUNDS];
+};
+
+static struct kmag kmags[MAXCPUS][NSIZES];
+
+/*
+ * Capacity of the magazines for block type BLKTYPE: KMAG_ROUNDS, but
+ * no more than a page's worth, so big blocks don't pile up unused.
+ */
+static
+inline
+unsigned
+kmag_rounds(unsigned blktype)
+{
+	unsigned n = PAGE_SIZE / sizes[blktype];
+
+	return n < KMAG_ROUNDS ? n : KMAG_ROUNDS;
+}
+
+/*
+ * This cpu's magazine for BLKTYPE, or NULL if it doesn't have one.
+ * Call at splhigh.
+ */
+static
+struct kmag *
+kmag_mine(unsigned blktype)
+{
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	return &kmags[curcpu->c_number][blktype];
+}
+
+/*
+ * Get a block of type BLKTYPE from this cpu's magazine, refilling it
+ * if it's empty. Returns 0 if there are no free blocks of the type
+ * anywhere; the caller then gets a new page the slow way.
+ */
+static
+vaddr_t
+kmag_get(unsigned blktype)
+{
+	struct kmag *km;
+	vaddr_t fla, ret;
+	int s;
+
+	s = splhigh();
+	km = kmag_mine(blktype);
+	if (km == NULL) {
+		splx(s);
+		return 0;
+	}
+
+	if (km->km_count == 0) {
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		while (km->km_count < kmag_rounds(blktype) / 2) {
+			fla = subpage_takeblock(blktype);
+			if (fla == 0) {
+				break;
+			}
+			km->km_blocks[km->km_count++] = fla;
+		}
+		spinlock_release(&kmalloc_spinlock);
+	}
+
+	ret = 0;
+	if (km->km_count > 0) {
+		ret = km->km_blocks[--km->km_count];
+	}
+	splx(s);
+	return ret;
+}
+
+/*
+ * Put a freed block of type BLKTYPE in this cpu's magazine, first
+ * giving the older half back to the pages if it's full. Returns false
+ * if this cpu has no magazines.
+ */
+static
+bool
+kmag_put(unsigned blktype, vaddr_t block)
+{
+	struct kmag *km;
+	struct pageref *pr;
+	vaddr_t freepages[KMAG_ROUNDS];
+	unsigned i, n, nfreepages;
+	int s;
+
+	nfreepages = 0;
+
+	s = splhigh();
+	km = kmag_mine(blktype);
+	if (km == NULL) {
+		splx(s);
+		return false;
+	}
+
+	if (km->km_count == kmag_rounds(blktype)) {
+		n = km->km_count / 2;
+		spinlock_acquire(&kmalloc_spinlock);
+		checksubpages();
+		for (i=0; i<n; i++) {
+			pr = pagehash_lookup(km->km_blocks[i] & PAGE_FRAME);
+			KASSERT(pr != NULL);
+			freepages[nfreepages] =
+				subpage_putblock(pr, km->km_blocks[i]);
+			if (freepages[nfreepages] != 0) {
+				nfreepages++;
+			}
+		}
+		spinlock_release(&kmalloc_spinlock);
+		km->km_count -= n;
+		memmove(&km->km_blocks[0], &km->km_blocks[n],
+			km->km_count * sizeof(vaddr_t));
+	}
+	km->km_blocks[km->km_count++] = block;
+	splx(s);
+
+	/* Call free_kpages without kmalloc_spinlock (or splhigh). */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+	return true;
+}
+
+#endif /* KMAGAZINES */
+
+////////////////////////////////////////
+
+/*
+ * Allocate a block of size SZ, where SZ is not large enough to
+ * warrant a whole-page allocation.
+ */
+static
+void *
+subpage_kmalloc(size_t sz
+#ifdef LABELS
+		, vaddr_t label
+#endif
+	)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	vaddr_t fla;		// free list entry address
+	void *retptr;		// our result
+
+#ifdef GUARDS
+	size_t clientsz;
+#endif
+
+#ifdef GUARDS
+	clientsz = sz;
+	sz += GUARD_OVERHEAD;
+#endif
+#ifdef LABELS
+#ifdef GUARDS
+	/* Include the label in what GUARDS considers the client data. */
+	clientsz += LABEL_PTROFFSET;
+#endif
+	sz += LABEL_PTROFFSET;
+#endif
+	blktype = blocktype(sz);
+#ifdef GUARDS
+	sz = sizes[blktype];
+#endif
+
+#ifdef KMAGAZINES
+	fla = kmag_get(blktype);
+	if (fla != 0) {
+		return (void *)fla;
+	}
+#endif
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	fla = subpage_takeblock(blktype);
+	if (fla == 0) {
+		/*
+		 * No page of the right size available.
+		 * Make a new one.
+		 */
+		if (!subpage_addpage(blktype)) {
+			spinlock_release(&kmalloc_spinlock);
+			return NULL;
+		}
+		fla = subpage_takeblock(blktype);
+		KASSERT(fla != 0);
+	}
+
+	retptr = (void *)fla;
+#ifdef GUARDS
+	retptr = establishguardband(retptr, clientsz, sz);
+#endif
+#ifdef LABELS
+	retptr = establishlabel(retptr, label);
+#endif
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return retptr;
 }
 
 /*
@@ -1029,9 +1432,8 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t freepage;	// page to give back, if now all free
 #ifdef GUARDS
 	size_t blocksize, smallerblocksize;
 #endif
@@ -1061,34 +1463,19 @@ subpage_kfree(void *ptr)
 	ptraddr -= LABEL_PTROFFSET;
 #endif
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	/* Silence warnings with gcc 4.8 -Og (but not -O2) */
-	prpage = 0;
-	blktype = 0;
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-		KASSERT(blktype >= 0 && blktype < NSIZES);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	/*
+	 * Find the page. This needs no lock: if the block really is
+	 * allocated, its page can't go away under us.
+	 */
+	pr = pagehash_lookup(ptraddr & PAGE_FRAME);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype>=0 && blktype<NSIZES);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -1108,46 +1495,20 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef((void *)ptraddr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-
-		/* this block should not already be on the free list! */
-#ifdef SLOW
-		{
-			struct freelist *fl2;
-
-			for (fl2 = fl->next; fl2 != NULL; fl2 = fl2->next) {
-				KASSERT(fl2 != fl);
-			}
-		}
-#else
-		/* check just the head */
-		KASSERT(fl != fl->next);
-#endif
+#ifdef KMAGAZINES
+	if (kmag_put(blktype, ptraddr)) {
+		return 0;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
+#endif
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	freepage = subpage_putblock(pr, ptraddr);
+	spinlock_release(&kmalloc_spinlock);
+
+	if (freepage != 0) {
 		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -0,0 +1,65 @@
+/*
+ * Whole-page zero and copy, for the VM system.
+ *
+ * Pages are always page-aligned, so unlike memset and memcpy these
+ * have no head or tail to deal with and can go straight to moving a
+ * cache line's worth of words per step. The copy loads a whole line
+ * into registers before storing any of it, so the loads of one line
+ * aren't held up behind the stores of the last.
+ */
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+
+#define LINE_WORDS	8	/* words per cache line */
+
+void
+page_zero(vaddr_t kvaddr)
+{
+	unsigned long *p = (unsigned long *)kvaddr;
+	unsigned long *end = p + PAGE_SIZE / sizeof(*p);
+
+	KASSERT(kvaddr % PAGE_SIZE == 0);
+
+	for (; p < end; p += LINE_WORDS) {
+		p[0] = 0;
+		p[1] = 0;
+		p[2] = 0;
+		p[3] = 0;
+		p[4] = 0;
+		p[5] = 0;
+		p[6] = 0;
+		p[7] = 0;
+	}
+}
+
+void
+page_copy(vaddr_t dst, vaddr_t src)
+{
+	unsigned long *d = (unsigned long *)dst;
+	const unsigned long *s = (const unsigned long *)src;
+	const unsigned long *end = s + PAGE_SIZE / sizeof(*s);
+	unsigned long w0, w1, w2, w3, w4, w5, w6, w7;
+
+	KASSERT(dst % PAGE_SIZE == 0);
+	KASSERT(src % PAGE_SIZE == 0);
+
+	for (; s < end; s += LINE_WORDS, d += LINE_WORDS) {
+		w0 = s[0];
+		w1 = s[1];
+		w2 = s[2];
+		w3 = s[3];
+		w4 = s[4];
+		w5 = s[5];
+		w6 = s[6];
+		w7 = s[7];
+		d[0] = w0;
+		d[1] = w1;
+		d[2] = w2;
+		d[3] = w3;
+		d[4] = w4;
+		d[5] = w5;
+		d[6] = w6;
+		d[7] = w7;
+	}
+}
@@ -0,0 +1,252 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <swap.h>
+
+/*
+ * Swap slot allocation. swap_map marks slots in use and swap_refs
+ * counts the page tables referencing each one; both are protected by
+ * swap_spinlock. swap_vnode is NULL if no swap disk was found, in
+ * which case running out of frames is fatal to the faulting process
+ * as before.
+ */
+static struct vnode *swap_vnode;
+static struct bitmap *swap_map;
+static uint16_t *swap_refs;
+static unsigned swap_nslots;
+static unsigned swap_used;
+static struct spinlock swap_spinlock = SPINLOCK_INITIALIZER;
+
+// signalled, with vm_lock, whenever a PTE_BUSY transfer finishes
+static struct cv *swap_cv;
+
+/* statistics */
+static unsigned swap_ins;
+static unsigned swap_outs;
+static unsigned swap_evict_fails;
+static unsigned swap_unmaps;
+
+void swap_bootstrap(void){
+    char path[] = SWAP_DEVICE;
+    struct stat st;
+    int result;
+
+    swap_cv = cv_create("swap");
+    if (swap_cv == NULL) {
+        panic("swap: cv_create failed\n");
+    }
+
+    result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+    if (result) {
+        kprintf("swap: %s: %s, swapping disabled\n", SWAP_DEVICE,
+                strerror(result));
+        swap_vnode = NULL;
+        return;
+    }
+
+    result = VOP_STAT(swap_vnode, &st);
+    if (result) {
+        panic("swap: stat of %s failed: %s\n", SWAP_DEVICE, strerror(result));
+    }
+    swap_nslots = st.st_size / PAGE_SIZE;
+
+    swap_map = bitmap_create(swap_nslots);
+    swap_refs = kmalloc(swap_nslots * sizeof(uint16_t));
+    if (swap_map == NULL || swap_refs == NULL) {
+        panic("swap: out of memory for %u slots\n", swap_nslots);
+    }
+    for (unsigned i = 0; i < swap_nslots; i++) {
+        swap_refs[i] = 0;
+    }
+    kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+static int swap_alloc(unsigned *slot){
+    int result;
+
+    spinlock_acquire(&swap_spinlock);
+    result = bitmap_alloc(swap_map, slot);
+    if (result == 0) {
+        swap_refs[*slot] = 1;
+        swap_used++;
+    }
+    spinlock_release(&swap_spinlock);
+    return result;
+}
+
+void swap_incref(unsigned slot){
+    spinlock_acquire(&swap_spinlock);
+    KASSERT(slot < swap_nslots && swap_refs[slot] > 0);
+    swap_refs[slot]++;
+    spinlock_release(&swap_spinlock);
+}
+
+void swap_free(unsigned slot){
+    spinlock_acquire(&swap_spinlock);
+    KASSERT(slot < swap_nslots && swap_refs[slot] > 0);
+    swap_refs[slot]--;
+    if (swap_refs[slot] == 0) {
+        bitmap_unmark(swap_map, slot);
+        swap_used--;
+    }
+    spinlock_release(&swap_spinlock);
+}
+
+// move one page between a frame and a swap slot
+static int swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw){
+    struct iovec iov;
+    struct uio ku;
+    int result;
+
+    uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+              (off_t)slot * PAGE_SIZE, rw);
+    if (rw == UIO_READ) {
+        result = VOP_READ(swap_vnode, &ku);
+    } else {
+        result = VOP_WRITE(swap_vnode, &ku);
+    }
+    if (result == 0 && ku.uio_resid != 0) {
+        result = EIO;
+    }
+    return result;
+}
+
+void swap_wait(void){
+    KASSERT(lock_do_i_hold(vm_lock));
+    cv_wait(swap_cv, vm_lock);
+}
+
+/*
+ * Page VADDR in AS back in to the frame at PADDR, which is not in any
+ * page table yet. Only the address space's own thread changes a
+ * swapped PTE, so the one the fault saw is still there. It is marked
+ * busy for the read, so the TLB refill fast path and fork leave it
+ * alone while vm_lock is dropped.
+ */
+int swap_in(struct addrspace *as, vaddr_t vaddr, paddr_t paddr){
+    int result;
+
+    KASSERT(swap_vnode != NULL);
+    KASSERT(lock_do_i_hold(vm_lock));
+
+    paddr_t pte = get_frame(vaddr, as);
+    KASSERT(PTE_IS_SWAPPED(pte) && !(pte & PTE_BUSY));
+    unsigned slot = PTE_SWAP_SLOT(pte);
+
+    result = add_PTE(vaddr, pte | PTE_BUSY, as);
+    KASSERT(result == 0); // the PTE already exists, nothing is allocated
+
+    lock_release(vm_lock);
+    result = swap_io(slot, paddr, UIO_READ);
+    lock_acquire(vm_lock);
+
+    if (result) {
+        add_PTE(vaddr, pte, as);
+    } else {
+        add_PTE(vaddr, paddr | (pte & PTE_FLAGS), as);
+        swap_free(slot);
+        swap_ins++;
+    }
+    cv_broadcast(swap_cv, vm_lock);
+    return result;
+}
+
+/*
+ * Free one frame by writing an unshared user page to swap. The victim
+ * comes from the clock in the frame table; its owner's PTE becomes a
+ * busy swapped entry before the write starts, so the TLB refill fast
+ * path cannot map the frame again, and the owner waits for the write
+ * before faulting the page back in, forking or tearing down its page
+ * table. Nothing else can reach the frame, so vm_lock is dropped for
+ * the write and other faults go on meanwhile.
+ *
+ * The victim may instead be a page of a mapped file, which needs no
+ * swap: the mapping is dropped and the frame stays in the file's page
+ * cache for the next fault to map again. That frees nothing yet; the
+ * cache gives up pages nobody maps when the file is synced.
+ */
+int swap_evict(void){
+    struct addrspace *as;
+    vaddr_t vaddr;
+    paddr_t paddr;
+    unsigned slot;
+    int result;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+
+    paddr = frame_pick_victim(swap_vnode == NULL, &as, &vaddr);
+    if (paddr == 0) {
+        swap_evict_fails++;
+        return ENOMEM;
+    }
+
+    paddr_t pte = get_frame(vaddr, as);
+    KASSERT((pte & PTE_FRAME) == paddr && !PTE_IS_SWAPPED(pte));
+
+    if (pte & PTE_SHARED) {
+        result = add_PTE(vaddr, 0, as);
+        KASSERT(result == 0); // the PTE already exists
+        vm_tlb_unmap(as, vaddr);
+        free_kpages(PADDR_TO_KVADDR(paddr));
+        swap_unmaps++;
+        return 0;
+    }
+
+    result = swap_alloc(&slot);
+    if (result) {
+        frame_touch(paddr, as, vaddr);
+        swap_evict_fails++;
+        return ENOMEM;
+    }
+
+    // the page keeps its protection while it is out
+    paddr_t swapped = PTE_MAKE_SWAPPED(slot) | (pte & PTE_PROT_MASK);
+    result = add_PTE(vaddr, swapped | PTE_BUSY, as);
+    KASSERT(result == 0); // the PTE already exists, nothing is allocated
+
+    // no stale TLB entry, here or on the CPU AS runs on, may write to
+    // the frame while it is copied out; this waits for that CPU's ack
+    vm_tlb_unmap(as, vaddr);
+
+    lock_release(vm_lock);
+    result = swap_io(slot, paddr, UIO_WRITE);
+    lock_acquire(vm_lock);
+
+    if (result) {
+        add_PTE(vaddr, pte, as);
+        swap_free(slot);
+        frame_touch(paddr, as, vaddr);
+        swap_evict_fails++;
+    } else {
+        add_PTE(vaddr, swapped, as);
+        free_kpages(PADDR_TO_KVADDR(paddr));
+        swap_outs++;
+    }
+    cv_broadcast(swap_cv, vm_lock);
+    return result;
+}
+
+void swap_printstats(void){
+    if (swap_vnode == NULL) {
+        kprintf("swap: disabled, %u mapped file pages unmapped\n",
+                swap_unmaps);
+        return;
+    }
+    spinlock_acquire(&swap_spinlock);
+    kprintf("swap: %u/%u slots in use on %s\n", swap_used, swap_nslots,
+            SWAP_DEVICE);
+    spinlock_release(&swap_spinlock);
+    kprintf("swap: %u pages swapped in, %u swapped out, "
+            "%u failed evictions\n", swap_ins, swap_outs, swap_evict_fails);
+    kprintf("swap: %u mapped file pages unmapped\n", swap_unmaps);
+}
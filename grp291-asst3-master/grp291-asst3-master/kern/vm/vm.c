@@ -7,143 +7,760 @@
 #include <machine/tlb.h>
 #include <proc.h>
 #include <spl.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <swap.h>
+#include <kstat.h>
+#include <current.h>
+#include <cpu.h>
+#include <membar.h>
+
+struct lock *vm_lock;
+
+/*
+ * Address space IDs. Every address space is tagged with a MIPS ASID so
+ * its TLB entries survive context switches. TLBs are per CPU, so are
+ * the IDs: each CPU hands out its own in generations, and once all
+ * NUM_ASID - 1 are used (0 is never handed out) it advances its
+ * generation, flushes its own TLB and every address space picks up a
+ * fresh ID the next time it is activated there. An address space holds
+ * one ID, for the CPU it last ran on (as->asid_cpu); moving to another
+ * CPU takes a new ID there, so the entries left behind on the old CPU
+ * are never matched again. The state is only touched by its own CPU
+ * with interrupts off, so it needs no lock.
+ */
+struct asid_state {
+    uint32_t generation;
+    uint32_t next;
+    uint32_t cur;       // the ID currently loaded
+};
+
+static struct asid_state asid_states[MAXCPUS];
+
+/*
+ * The zero frame: a frame of zeroes mapped on read faults to untouched
+ * anonymous pages, so reading BSS, heap or stack nobody has written
+ * costs no memory. The VM keeps its own reference to it, so it always
+ * looks shared copy-on-write: it never gets the TLB dirty bit, is
+ * never picked for eviction, and the first write to a page mapping it
+ * gets a private frame in break_share.
+ */
+static paddr_t zero_frame;
 
 /* Place your page table functions here */
-paddr_t get_frame(vaddr_t page_addr, struct addrspace *as);
-int add_PTE(vaddr_t page_addr, paddr_t frame_addr, struct addrspace *as);
-int in_valid_region(struct addrspace *as, vaddr_t page_addr);
+static int load_page(struct region *region, vaddr_t page_addr, vaddr_t kern_addr);
+static vaddr_t alloc_user_page(void);
+static vaddr_t alloc_zeroed_user_page(void);
+static int break_share(vaddr_t page_addr, paddr_t *frame_addr, paddr_t prot, struct addrspace *as);
+static int fault_shared(struct addrspace *as, struct region *region, vaddr_t page_addr, paddr_t prot, paddr_t *frame_addr);
+static void tlb_load(uint32_t ehi, uint32_t elo);
+static void tlb_flush_all(void);
+static void map_page(struct addrspace *as, vaddr_t page_addr, paddr_t frame_addr, paddr_t prot);
+static bool tlb_refill(struct addrspace *as, int faulttype, vaddr_t faultaddress);
+static bool page_is_anon(struct region *region, vaddr_t page_addr);
+static int fault_in(struct addrspace *as, int faulttype, vaddr_t faultaddress);
 
-// get physical address stored on corresponding leaf node
+// get the PTE (frame address and flags) stored on corresponding leaf node
 paddr_t get_frame(vaddr_t page_addr, struct addrspace *as){
-    vaddr_t root_page = (page_addr & ROOT_PAGE) >> 24;
-    if (as->pagetable[root_page] == NULL){ return 0; }
-    
-    vaddr_t sec_page = (page_addr & SEC_LVL_PAGE) >> 18;
-    if (as->pagetable[root_page][sec_page] == NULL){ return 0; }
+    paddr_t *leaf = as->pt_dir[PT_DIR_INDEX(page_addr)];
+    if (leaf == NULL){ return 0; }
+    return leaf[PT_LEAF_INDEX(page_addr)];
+}
+
+// the record for directory slot DIR, or where it would be inserted
+static unsigned pt_leaf_search(struct addrspace *as, unsigned dir){
+    unsigned lo = 0, hi = as->pt_nleaves;
+    while (lo < hi){
+        unsigned mid = (lo + hi) / 2;
+        if (as->pt_leaves[mid].dir < dir){
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
-    vaddr_t leaf_page = (page_addr & LEAF_PAGE) >> 12;
-    return as->pagetable[root_page][sec_page][leaf_page];
+// leaves are whole frames and never evicted themselves
+paddr_t *pt_alloc_leaf(void){
+    vaddr_t kern_addr = alloc_zeroed_user_page();
+    if (kern_addr == 0){ return NULL; }
+    return (paddr_t *)kern_addr;
 }
 
 int add_PTE(vaddr_t page_addr, paddr_t frame_addr, struct addrspace *as) {
-    vaddr_t root_page = (page_addr & ROOT_PAGE) >> 24;
-    if (as->pagetable[root_page] == NULL){ // need a new root page
-        as->pagetable[root_page] = kmalloc(PT_NODE_SIZE * sizeof(paddr_t *));
-        for (int i = 0; i < PT_NODE_SIZE; i++){
-            as->pagetable[root_page][i] = NULL;
+    unsigned dir = PT_DIR_INDEX(page_addr);
+    unsigned idx = PT_LEAF_INDEX(page_addr);
+    unsigned pos = pt_leaf_search(as, dir);
+    struct pt_leaf *rec;
+
+    if (pos == as->pt_nleaves || as->pt_leaves[pos].dir != dir){
+        // need a new leaf
+        if (as->pt_nleaves == as->pt_maxleaves){
+            unsigned max = as->pt_maxleaves ? as->pt_maxleaves * 2 : 4;
+            struct pt_leaf *leaves = kmalloc(max * sizeof(struct pt_leaf));
+            if (leaves == NULL){ return ENOMEM; }
+            if (as->pt_nleaves > 0){
+                memcpy(leaves, as->pt_leaves, as->pt_nleaves * sizeof(struct pt_leaf));
+            }
+            kfree(as->pt_leaves);
+            as->pt_leaves = leaves;
+            as->pt_maxleaves = max;
+        }
+        paddr_t *leaf = pt_alloc_leaf();
+        if (leaf == NULL){ return ENOMEM; }
+        memmove(&as->pt_leaves[pos + 1], &as->pt_leaves[pos],
+                (as->pt_nleaves - pos) * sizeof(struct pt_leaf));
+        as->pt_nleaves++;
+        as->pt_leaves[pos].dir = dir;
+        as->pt_leaves[pos].lo = idx;
+        as->pt_leaves[pos].hi = idx + 1;
+        as->pt_dir[dir] = leaf;
+    }
+    rec = &as->pt_leaves[pos];
+    if (idx < rec->lo){ rec->lo = idx; }
+    if (idx >= rec->hi){ rec->hi = idx + 1; }
+    as->pt_dir[dir][idx] = frame_addr;
+    return 0;
+}
+
+// release every page in [START, END), called with vm_lock held. The
+// populated range of each leaf shrinks to what is still mapped, and a
+// leaf left empty is freed.
+void pt_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end){
+    vaddr_t va = start & PAGE_FRAME;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+    while (va < end){
+        unsigned dir = PT_DIR_INDEX(va);
+        vaddr_t leaf_end = (vaddr_t)(dir + 1) << 22;
+        if (leaf_end > end){ leaf_end = end; }
+
+        unsigned pos = pt_leaf_search(as, dir);
+        if (pos < as->pt_nleaves && as->pt_leaves[pos].dir == dir){
+            struct pt_leaf *rec = &as->pt_leaves[pos];
+            paddr_t *leaf = as->pt_dir[dir];
+            unsigned k = PT_LEAF_INDEX(va);
+            unsigned top = k + (ROUNDUP(leaf_end, PAGE_SIZE) - va) / PAGE_SIZE;
+            if (k < rec->lo){ k = rec->lo; }
+            if (top > rec->hi){ top = rec->hi; }
+
+            for (; k < top; k++){
+                paddr_t pte = leaf[k];
+                while (pte & PTE_BUSY){
+                    // on its way out to swap; the evictor still has
+                    // to update this PTE
+                    swap_wait();
+                    pte = leaf[k];
+                }
+                if (pte == 0){
+                    continue;
+                }
+                leaf[k] = 0;
+                if (PTE_IS_SWAPPED(pte)){
+                    swap_free(PTE_SWAP_SLOT(pte));
+                } else {
+                    vm_tlb_unmap(as, ((vaddr_t)dir << 22) | (k << 12));
+                    free_kpages(PADDR_TO_KVADDR(pte & PTE_FRAME));
+                }
+            }
+
+            while (rec->lo < rec->hi && leaf[rec->lo] == 0){ rec->lo++; }
+            while (rec->hi > rec->lo && leaf[rec->hi - 1] == 0){ rec->hi--; }
+            if (rec->lo == rec->hi){
+                as->pt_dir[dir] = NULL;
+                free_kpages((vaddr_t)leaf);
+                as->pt_nleaves--;
+                memmove(&as->pt_leaves[pos], &as->pt_leaves[pos + 1],
+                        (as->pt_nleaves - pos) * sizeof(struct pt_leaf));
+            }
         }
+        va = leaf_end;
+    }
+}
+
+// regions are sorted and disjoint, so a binary search finds the one;
+// the heap is kept apart from them
+struct region *find_region(struct addrspace *as, vaddr_t addr){
+    unsigned lo = 0, hi = as->nregions;
+
+    if (addr >= as->heap.base &&
+        addr < as->heap.base + as->heap.size * PAGE_SIZE){
+        return &as->heap;
     }
-    vaddr_t sec_page = (page_addr & SEC_LVL_PAGE) >> 18;
-    if (as->pagetable[root_page][sec_page] == NULL){
-        as->pagetable[root_page][sec_page] = kmalloc(PT_NODE_SIZE * sizeof(paddr_t));
-        for (int i = 0; i < PT_NODE_SIZE; i++){
-            as->pagetable[root_page][sec_page][i] = 0;
+    while (lo < hi){
+        unsigned mid = (lo + hi) / 2;
+        struct region *region = &as->regions[mid];
+        if (addr < region->base){
+            hi = mid;
+        } else if (addr >= region->base + region->size * PAGE_SIZE){
+            lo = mid + 1;
+        } else {
+            return region;
         }
     }
-    vaddr_t leaf_page = (page_addr & LEAF_PAGE) >> 12;
-    as->pagetable[root_page][sec_page][leaf_page] = frame_addr;
+    return NULL;
+}
+
+// read the file-backed part of PAGE_ADDR in REGION into the zeroed
+// page at KERN_ADDR
+static int load_page(struct region *region, vaddr_t page_addr, vaddr_t kern_addr){
+    struct iovec iov;
+    struct uio ku;
+    int res;
+
+    vaddr_t start = region->file_vaddr;
+    vaddr_t end = region->file_vaddr + region->file_size;
+    if (start < page_addr){ start = page_addr; }
+    if (end > page_addr + PAGE_SIZE){ end = page_addr + PAGE_SIZE; }
+    if (region->file_size == 0 || start >= end){
+        // all bss
+        return 0;
+    }
+
+    uio_kinit(&iov, &ku, (void *)(kern_addr + (start - page_addr)),
+              end - start,
+              region->file_offset + (start - region->file_vaddr),
+              UIO_READ);
+    res = VOP_READ(region->vnode, &ku);
+    if (res){
+        return res;
+    }
+    if (ku.uio_resid != 0){
+        // the executable shrank under us
+        return EIO;
+    }
     return 0;
 }
 
-int in_valid_region(struct addrspace *as, vaddr_t page_addr){
-    struct region_list *region = as->head;
-    while (region != NULL){
-        vaddr_t vbase = region->base;
-        vaddr_t vtop = region->base + region->size * PAGE_SIZE;
-        if (page_addr >= vbase && page_addr < vtop){
+// true if the first touch of PAGE_ADDR in REGION just zeroes it: the
+// region has no file behind it, or the page lies wholly outside the
+// file-backed part (the BSS)
+static bool page_is_anon(struct region *region, vaddr_t page_addr){
+    if (region->vnode == NULL || region->file_size == 0) {
+        return true;
+    }
+    return region->file_vaddr >= page_addr + PAGE_SIZE ||
+           region->file_vaddr + region->file_size <= page_addr;
+}
+
+// allocate a frame for a user page, paging another one out if memory is full
+static vaddr_t alloc_user_page(void){
+    vaddr_t kern_addr = alloc_kpages(1);
+    while (kern_addr == 0) {
+        if (swap_evict()) {
             return 0;
         }
-        region = region->next;
+        kern_addr = alloc_kpages(1);
+    }
+    return kern_addr;
+}
+
+// as alloc_user_page, but zeroed: from the pool idle CPUs keep
+// topped up if possible, so the fault path rarely clears a page itself
+static vaddr_t alloc_zeroed_user_page(void){
+    vaddr_t kern_addr = alloc_zeroed_kpage();
+    if (kern_addr == 0) {
+        kern_addr = alloc_user_page();
+        if (kern_addr != 0) {
+            page_zero(kern_addr);
+        }
+    }
+    return kern_addr;
+}
+
+// give the faulting address space a private copy of a copy-on-write frame
+static int break_share(vaddr_t page_addr, paddr_t *frame_addr, paddr_t prot, struct addrspace *as){
+    if (frame_refcount(*frame_addr) == 1) {
+        // the other owners already broke away, the frame is ours
+        return 0;
+    }
+
+    vaddr_t kern_addr;
+    if (*frame_addr == zero_frame) {
+        kern_addr = alloc_zeroed_user_page();
+        if (kern_addr == 0) {
+            return ENOMEM;
+        }
+        kstat_count(KSTAT_FAULT_ZEROCOPY);
+    } else {
+        kern_addr = alloc_user_page();
+        if (kern_addr == 0) {
+            return ENOMEM;
+        }
+        page_copy(kern_addr, PADDR_TO_KVADDR(*frame_addr));
+    }
+    kstat_count(KSTAT_FAULT_COW);
+
+    // drop our share of the old frame
+    free_kpages(PADDR_TO_KVADDR(*frame_addr));
+
+    *frame_addr = KVADDR_TO_PADDR(kern_addr);
+    return add_PTE(page_addr, *frame_addr | prot, as);
+}
+
+// first touch of a page of an mmapped file: the frame comes from the
+// file's page cache, which keeps the zeroed spare we hand it if the
+// page is not cached yet. vm_lock is dropped around the file system
+// calls, as for load_page. Eviction unmaps cached pages but leaves
+// them in the cache, so memory can fill up with pages of this file
+// nobody maps any more; if there is no spare, syncing the file drops
+// those, and we try once more.
+static int fault_shared(struct addrspace *as, struct region *region, vaddr_t page_addr, paddr_t prot, paddr_t *frame_addr){
+    vaddr_t spare = alloc_zeroed_user_page();
+    if (spare == 0) {
+        lock_release(vm_lock);
+        VOP_FSYNC(region->vnode);
+        lock_acquire(vm_lock);
+        spare = alloc_zeroed_user_page();
+        if (spare == 0) {
+            return ENOMEM;
+        }
+    }
+
+    paddr_t frame = KVADDR_TO_PADDR(spare);
+    off_t offset = region->file_offset + (page_addr - region->base);
+    lock_release(vm_lock);
+    int res = VOP_MMAP(region->vnode, offset, (region->flag & WRITE_FLAG) != 0, &frame);
+    lock_acquire(vm_lock);
+    if (res) {
+        free_kpages(spare);
+        return res;
+    }
+    if (frame != KVADDR_TO_PADDR(spare)) {
+        free_kpages(spare);
+    }
+
+    res = add_PTE(page_addr, frame | prot, as);
+    if (res) {
+        free_kpages(PADDR_TO_KVADDR(frame));
+        return res;
+    }
+    *frame_addr = frame;
+    return 0;
+}
+
+// write a TLB entry, replacing any existing entry for the same page;
+// EHI carries the current ASID
+static void tlb_load(uint32_t ehi, uint32_t elo){
+    int spl = splhigh();
+    int index = tlb_probe(ehi, 0);
+    if (index >= 0) {
+        tlb_write(ehi, elo, index);
+    } else {
+        tlb_random(ehi, elo);
+    }
+    splx(spl);
+}
+
+// this CPU's ASID state; called with interrupts off
+static struct asid_state *asid_here(void){
+    KASSERT(curcpu->c_number < MAXCPUS);
+    return &asid_states[curcpu->c_number];
+}
+
+// AS's ASID on this CPU, or 0 if it has none there (it last ran
+// elsewhere, or its ID is from an old generation and has no entries
+// left in this TLB); called with interrupts off
+static uint32_t asid_lookup(struct addrspace *as){
+    struct asid_state *st = asid_here();
+
+    if (as->asid_cpu != curcpu->c_self || as->asid_gen != st->generation) {
+        return 0;
+    }
+    return as->asid;
+}
+
+// invalidate every entry, whatever its ASID; called with interrupts off
+static void tlb_flush_all(void){
+    for (int i=0; i<NUM_TLB; i++) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    tlb_setasid(TLBHI_ASID(asid_here()->cur));
+}
+
+// drop AS's entry for VADDR from this CPU's TLB
+static void tlb_unmap_here(struct addrspace *as, vaddr_t vaddr){
+    int spl = splhigh();
+    uint32_t asid = asid_lookup(as);
+    if (asid != 0) {
+        int index = tlb_probe((vaddr & PAGE_FRAME) | TLBHI_ASID(asid), 0);
+        if (index >= 0) {
+            tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(), index);
+        }
+        tlb_setasid(TLBHI_ASID(asid_here()->cur));
     }
-    return 1;
+    splx(spl);
+}
+
+// drop all of AS's entries from this CPU's TLB
+static void tlb_unmap_all_here(struct addrspace *as){
+    uint32_t ehi, elo;
+
+    int spl = splhigh();
+    uint32_t asid = asid_lookup(as);
+    if (asid != 0) {
+        for (int i=0; i<NUM_TLB; i++) {
+            tlb_read(&ehi, &elo, i);
+            if ((elo & TLBLO_VALID) &&
+                (ehi & TLBHI_PID) == TLBHI_ASID(asid)) {
+                tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+            }
+        }
+        tlb_setasid(TLBHI_ASID(asid_here()->cur));
+    }
+    splx(spl);
+}
+
+// drop AS's entry for VADDR, or all its entries for TLBSHOOTDOWN_ALL,
+// from the one TLB that can hold live ones: as->asid_cpu's. If that is
+// another CPU, shoot it down and wait for the ack, so on return no CPU
+// can reach the old frame through the TLB. The caller has changed the
+// PTE already; the barrier pairs with the one in vm_tlb_activate, so
+// either we see AS's new CPU or that CPU sees the new PTE. Waiting
+// needs interrupts on, so the caller must not hold a spinlock.
+static void tlb_shootdown(struct addrspace *as, vaddr_t vaddr){
+    struct tlbshootdown ts;
+    volatile int done = 0;
+
+    KASSERT(curthread->t_iplhigh_count == 0);
+    membar_any_any();
+
+    int spl = splhigh();
+    struct cpu *target = as->asid_cpu;
+    if (target == curcpu->c_self) {
+        if (vaddr == TLBSHOOTDOWN_ALL) {
+            tlb_unmap_all_here(as);
+        } else {
+            tlb_unmap_here(as, vaddr);
+        }
+        target = NULL;
+    }
+    splx(spl);
+
+    if (target == NULL) {
+        return;
+    }
+    ts.ts_as = as;
+    ts.ts_vaddr = vaddr;
+    ts.ts_done = &done;
+    ipi_tlbshootdown(target, &ts);
+    while (done == 0) {
+        membar_load_load();
+    }
+    kstat_count(KSTAT_TLB_SHOOTDOWN);
+}
+
+void vm_tlb_unmap(struct addrspace *as, vaddr_t vaddr){
+    tlb_shootdown(as, vaddr & PAGE_FRAME);
+}
+
+// drop all of AS's TLB entries, e.g. when fork makes its frames shared
+void vm_tlb_unmap_all(struct addrspace *as){
+    tlb_shootdown(as, TLBSHOOTDOWN_ALL);
+}
+
+// only this CPU's entry, and no waiting, so it may be called with a
+// spinlock held; for hints such as clearing a referenced bit
+void vm_tlb_unmap_local(struct addrspace *as, vaddr_t vaddr){
+    tlb_unmap_here(as, vaddr);
+}
+
+// make AS the address space the TLB matches user accesses against,
+// giving it a new ASID unless it already has a current one here
+void vm_tlb_activate(struct addrspace *as){
+    int spl = splhigh();
+    struct asid_state *st = asid_here();
+    if (asid_lookup(as) == 0) {
+        if (st->next == 0 || st->next == NUM_ASID) {
+            // first use of this CPU, or its IDs ran out
+            st->generation++;
+            st->next = 1;
+            tlb_flush_all();
+        }
+        as->asid = st->next++;
+        as->asid_gen = st->generation;
+        as->asid_cpu = curcpu->c_self;
+        // publish the CPU before any PTE is read into this TLB; pairs
+        // with the barrier in tlb_shootdown
+        membar_any_any();
+    }
+    st->cur = as->asid;
+    tlb_setasid(TLBHI_ASID(st->cur));
+    splx(spl);
 }
 
 void vm_bootstrap(void)
 {
-    /* Initialise any global components of your VM sub-system here.  
-     *  
-     * You may or may not need to add anything here depending what's
-     * provided or required by the assignment spec.
-     */
+    vm_lock = lock_create("vm_lock");
+    if (vm_lock == NULL) {
+        panic("vm_bootstrap: lock_create failed\n");
+    }
+    vaddr_t zero_page = alloc_kpages(1);
+    if (zero_page == 0) {
+        panic("vm_bootstrap: no memory for the zero frame\n");
+    }
+    page_zero(zero_page);
+    zero_frame = KVADDR_TO_PADDR(zero_page);
+    swap_bootstrap();
 }
 
-int
-vm_fault(int faulttype, vaddr_t faultaddress)
-{
-    (void) faulttype;
-    (void) faultaddress;
+// load the TLB entry for a resident page. Only writable, unshared pages
+// get the dirty bit: read-only pages trap writes as VM_FAULT_READONLY
+// and copy-on-write frames break the share there. Pages of a shared
+// file mapping are shared on purpose and written in place. (The MIPS TLB has no
+// execute permission, so EXEC_FLAG is recorded in the PTE but
+// instruction fetch is checked as a read.)
+static void map_page(struct addrspace *as, vaddr_t page_addr, paddr_t frame_addr, paddr_t prot){
+	uint32_t ehi, elo;
+    unsigned refs = frame_touch(frame_addr, as, page_addr);
+	elo = frame_addr | TLBLO_VALID;
+    if ((PTE_PROT(prot) & WRITE_FLAG) && (refs == 1 || (prot & PTE_SHARED))) {
+        elo |= TLBLO_DIRTY;
+    }
+    // AS is running here, so it has an ID on this CPU; interrupts stay
+    // off so the thread can't move to another CPU before the load
+    int spl = splhigh();
+    uint32_t asid = asid_lookup(as);
+    KASSERT(asid != 0);
+    ehi = page_addr | TLBHI_ASID(asid);
+    tlb_load(ehi, elo);
+    splx(spl);
+}
 
-    if (faultaddress == 0x0){
-        return EFAULT;
+// TLB refill fast path: a miss on a resident page just reloads the
+// PTE, without vm_lock or a region lookup. An evictor on another CPU
+// may change the PTE at any point here; it marks the PTE swapped, then
+// shoots down AS's entry on as->asid_cpu (this CPU) and waits for the
+// ack before it writes the page out. Interrupts stay off between
+// reading the PTE and loading the TLB, so that shootdown is handled
+// after the load and removes whatever we loaded.
+// Anything else falls through to fault_in.
+static bool tlb_refill(struct addrspace *as, int faulttype, vaddr_t faultaddress){
+    bool done = false;
+
+    if (faulttype == VM_FAULT_READONLY) {
+        return false;
     }
-	faultaddress &= PAGE_FRAME;
 
-    if (faulttype == VM_FAULT_READONLY){ 
-        return EFAULT; 
+    int spl = splhigh();
+    paddr_t pte = get_frame(faultaddress, as);
+    if (pte != 0 && !PTE_IS_SWAPPED(pte) &&
+        (faulttype == VM_FAULT_READ || (PTE_PROT(pte) & WRITE_FLAG))) {
+        paddr_t frame_addr = pte & PTE_FRAME;
+        // a write to a copy-on-write frame needs the full fault path
+        if (faulttype == VM_FAULT_READ || (pte & PTE_SHARED) ||
+            frame_refcount(frame_addr) == 1) {
+            map_page(as, faultaddress, frame_addr, pte & PTE_FLAGS);
+            done = true;
+        }
     }
+    splx(spl);
+    return done;
+}
 
-	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+// fault statistics come from the kstat counters, summed over CPUs
+void vm_printstats(void){
+    struct kstat *ks = kmalloc(sizeof(*ks));
+    if (ks == NULL) {
+        kprintf("vm: Out of memory\n");
+        return;
+    }
+    kstat_snapshot(ks);
 
-    struct addrspace *as = proc_getas();
-    if (as == NULL) {
-		return EFAULT;
-	}
+    uint64_t refills = ks->ks_counters[KSTAT_TLB_REFILL];
+    uint64_t faults = ks->ks_counters[KSTAT_FAULT_READ] +
+                      ks->ks_counters[KSTAT_FAULT_WRITE] +
+                      ks->ks_counters[KSTAT_FAULT_READONLY];
+    kprintf("vm: %llu TLB refills, avg %llu cycles\n",
+            (unsigned long long)refills, (unsigned long long)(refills ?
+            ks->ks_counters[KSTAT_TLB_REFILL_CYCLES] / refills : 0));
+    kprintf("vm: %llu full faults, avg %llu cycles\n",
+            (unsigned long long)faults, (unsigned long long)(faults ?
+            ks->ks_counters[KSTAT_FAULT_CYCLES] / faults : 0));
+    kprintf("vm: zero frame: %llu read faults, %llu later written, "
+            "%u pages mapping it now (frames saved)\n",
+            (unsigned long long)ks->ks_counters[KSTAT_FAULT_ZEROPAGE],
+            (unsigned long long)ks->ks_counters[KSTAT_FAULT_ZEROCOPY],
+            frame_refcount(zero_frame) - 1);
+    kfree(ks);
+    frame_printstats();
+    kprintf("vm: ASID generation %u on cpu%u\n",
+            asid_states[curcpu->c_number].generation, curcpu->c_number);
+}
 
-    paddr_t frame_addr = get_frame(faultaddress, as);
+// make FAULTADDRESS accessible in AS, called with vm_lock held
+static int fault_in(struct addrspace *as, int faulttype, vaddr_t faultaddress){
+    paddr_t pte = get_frame(faultaddress, as);
+    paddr_t frame_addr;
+    paddr_t prot;
+    vaddr_t kern_addr;
+    int res;
+
+    // the page is being written out to swap; wait for that to finish
+    while (pte & PTE_BUSY) {
+        swap_wait();
+        pte = get_frame(faultaddress, as);
+    }
 
-    // if no mapping found in page table
-    if (frame_addr == 0){
-        int valid = in_valid_region(as, faultaddress);
-        if (valid == 1) { // region invalid
+    if (pte == 0){
+        // if no mapping found in page table
+        struct region *region = find_region(as, faultaddress);
+        if (region == NULL) { // region invalid
             return EFAULT; 
         } 
+        // the region's permissions become the page's
+        prot = PTE_MAKE_PROT(region->flag);
+        if (faulttype == VM_FAULT_WRITE && !(region->flag & WRITE_FLAG)) {
+            return EFAULT;
+        }
+
+        if (region->flag & SHARED_FLAG) {
+            prot |= PTE_SHARED;
+            res = fault_shared(as, region, faultaddress, prot, &frame_addr);
+            if (res) {
+                return res;
+            }
+            kstat_count(KSTAT_FAULT_SHARED);
+            map_page(as, faultaddress, frame_addr, prot);
+            return 0;
+        }
+
+        // a read of an untouched anonymous page maps the zero frame
+        if (faulttype == VM_FAULT_READ && page_is_anon(region, faultaddress)) {
+            frame_incref(zero_frame);
+            res = add_PTE(faultaddress, zero_frame | prot, as);
+            if (res) {
+                free_kpages(PADDR_TO_KVADDR(zero_frame));
+                return res;
+            }
+            kstat_count(KSTAT_FAULT_ZEROPAGE);
+            map_page(as, faultaddress, zero_frame, prot);
+            return 0;
+        }
 
         // allocate a frame
-        vaddr_t kern_addr = alloc_kpages(1);
+        kern_addr = alloc_zeroed_user_page();
         if (kern_addr == 0) { 
             return ENOMEM;
         }
         frame_addr = KVADDR_TO_PADDR(kern_addr); 
-        bzero((void *)kern_addr, PAGE_SIZE);
-        int res = add_PTE(faultaddress, frame_addr, as); // add a new entry to page table
+
+        // first touch of a demand-loaded segment page. The frame is not
+        // in any page table yet, so it cannot be evicted, and only this
+        // thread changes this page table; drop vm_lock for the read so
+        // a filesystem blocked in copyout on vm_lock cannot deadlock us.
+        if (region->vnode != NULL) {
+            lock_release(vm_lock);
+            res = load_page(region, faultaddress, kern_addr);
+            lock_acquire(vm_lock);
+            if (res) {
+                free_kpages(kern_addr);
+                return res;
+            }
+        }
+        kstat_count(region->vnode != NULL ? KSTAT_FAULT_FILE : KSTAT_FAULT_ZERO);
+
+        res = add_PTE(faultaddress, frame_addr | prot, as); // add a new entry to page table
         if (res) {
-            return EFAULT;
+            free_kpages(kern_addr);
+            return res;
         }
     }
+    else {
+        prot = pte & PTE_FLAGS;
+        if (faulttype != VM_FAULT_READ &&
+            !(PTE_PROT(pte) & WRITE_FLAG)) {
+            // write to read-only text or data
+            return EFAULT;
+        }
 
-    // insert into TLB, FRAME_ADDR would be valid now 
-	uint32_t ehi, elo;
-    int spl = splhigh();
+        if (PTE_IS_SWAPPED(pte)){
+            // page it back in from swap
+            kern_addr = alloc_user_page();
+            if (kern_addr == 0) {
+                return ENOMEM;
+            }
+            frame_addr = KVADDR_TO_PADDR(kern_addr);
+            res = swap_in(as, faultaddress, frame_addr);
+            if (res) {
+                free_kpages(kern_addr);
+                return res;
+            }
+            kstat_count(KSTAT_FAULT_SWAPIN);
+        }
+        else {
+            frame_addr = pte & PTE_FRAME;
 
-	// for (int i=0; i<NUM_TLB; i++) {
-	// 	tlb_read(&ehi, &elo, i);
-	// 	if (elo & TLBLO_VALID) {
-	// 		continue;
-	// 	}
-	// 	ehi = faultaddress;
-	// 	elo = frame_addr | TLBLO_DIRTY | TLBLO_VALID;
-	// 	tlb_write(ehi, elo, i);
-	// 	splx(spl);
-	// 	return 0;
-	// }
-
-    // if TLB is full
-    ehi = faultaddress;
-	elo = frame_addr | TLBLO_DIRTY | TLBLO_VALID;
-    tlb_random(ehi, elo);
-	splx(spl);
-    
+            // write to a copy-on-write frame (or the zero frame); a
+            // TLB miss on a write breaks the share straight away
+            // rather than mapping the frame read-only to fault again
+            if (faulttype != VM_FAULT_READ && !(pte & PTE_SHARED)){
+                res = break_share(faultaddress, &frame_addr, prot, as);
+                if (res) {
+                    return res;
+                }
+            }
+        }
+    }
+
+    // insert into TLB, FRAME_ADDR would be valid now
+    map_page(as, faultaddress, frame_addr, prot);
     return 0;
 }
 
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+    if (faultaddress == 0x0){
+        return EFAULT;
+    }
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+    struct addrspace *as = proc_getas();
+    if (as == NULL) {
+		return EFAULT;
+	}
+
+    // a full fault may sleep and finish on another CPU, whose cycle
+    // counter needn't agree; such faults are timed only roughly
+    uint32_t start = cpu_cycles();
+
+    if (tlb_refill(as, faulttype, faultaddress)) {
+        kstat_count(KSTAT_TLB_REFILL);
+        kstat_add(KSTAT_TLB_REFILL_CYCLES, cpu_cycles() - start);
+        return 0;
+    }
+
+    // the KSTAT_FAULT_* type counters are in VM_FAULT_* order
+    kstat_count(KSTAT_FAULT_READ + faulttype);
+
+    lock_acquire(vm_lock);
+    int res = fault_in(as, faulttype, faultaddress);
+    lock_release(vm_lock);
+
+    kstat_add(KSTAT_FAULT_CYCLES, cpu_cycles() - start);
+    return res;
+}
+
 /*
- * SMP-specific functions.  Unused in our UNSW configuration.
+ * SMP-specific functions.
  */
 
+// a shootdown sent by tlb_shootdown on another CPU; runs in the IPI
+// handler with interrupts off
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+    if (ts->ts_vaddr == TLBSHOOTDOWN_ALL) {
+        tlb_unmap_all_here(ts->ts_as);
+    } else {
+        tlb_unmap_here(ts->ts_as, ts->ts_vaddr);
+    }
+    // the sender's frame goes away once it sees this
+    membar_any_store();
+    *ts->ts_done = 1;
 }
-
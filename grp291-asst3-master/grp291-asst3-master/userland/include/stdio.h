@@ -41,6 +41,54 @@
 /* Constant returned by a bunch of stdio functions on error */
 #define EOF (-1)
 
+/* Default buffer size */
+#define BUFSIZ 1024
+
+/* Buffering modes for setvbuf */
+#define _IOFBF 0	/* fully buffered */
+#define _IOLBF 1	/* line buffered */
+#define _IONBF 2	/* unbuffered */
+
+/*
+ * Standard I/O stream. There are only the three standard ones, on
+ * file handles 0-2. By default stdout is line buffered if it's the
+ * console and fully buffered otherwise, stdin is buffered, and stderr
+ * is unbuffered. Output still in a buffer is written out by fflush,
+ * exit, fork, and execv.
+ *
+ * The fields are for libc internal use only.
+ */
+typedef struct __file {
+	int f_fd;			/* file handle */
+	int f_flags;			/* __SRD etc. below */
+	int f_mode;			/* _IOFBF etc.; -1 until first use */
+	unsigned char *f_buf;		/* buffer */
+	size_t f_bufsize;		/* size of buffer */
+	size_t f_pos;			/* reading: next byte in buffer */
+	size_t f_len;			/* bytes in buffer */
+	unsigned char *f_defbuf;	/* buffer to go back to */
+	unsigned char f_ch;		/* buffer when unbuffered */
+} FILE;
+
+#define __SRD	0x1	/* stream is for reading */
+#define __SWR	0x2	/* stream is for writing */
+#define __SEOF	0x4	/* end of file seen */
+#define __SERR	0x8	/* error seen */
+
+extern FILE __stdin, __stdout, __stderr;
+#define stdin  (&__stdin)
+#define stdout (&__stdout)
+#define stderr (&__stderr)
+
+/*
+ * Buffer management (for libc internal use only): pick the buffering
+ * mode on first use; write out or refill the buffer. Return 0 or -1
+ * (with errno set); __stdio_fill also returns -1 at end of file.
+ */
+void __stdio_setup(FILE *f);
+int __stdio_flush(FILE *f);
+int __stdio_fill(FILE *f);
+
 /*
  * The actual guts of printf
  * (for libc internal use only)
@@ -69,4 +117,28 @@ int putchar(int);
 /* Reads one character (0-255) or returns EOF on error. */
 int getchar(void);
 
+/* Stream versions of the above. */
+int fprintf(FILE *f, const char *fmt, ...);
+int vfprintf(FILE *f, const char *fmt, __va_list ap);
+int fputs(const char *, FILE *f);
+int fputc(int, FILE *f);
+int fgetc(FILE *f);
+#define putc(c, f) fputc(c, f)
+#define getc(f) fgetc(f)
+
+/* Block I/O. Return the number of items transferred. */
+size_t fwrite(const void *ptr, size_t size, size_t nitems, FILE *f);
+size_t fread(void *ptr, size_t size, size_t nitems, FILE *f);
+
+/* Write out buffered output (for all streams if F is NULL). */
+int fflush(FILE *f);
+
+/* Set the buffer and buffering mode. Returns 0 or -1 on error. */
+int setvbuf(FILE *f, char *buf, int mode, size_t size);
+
+/* Error and end-of-file state. */
+int ferror(FILE *f);
+int feof(FILE *f);
+void clearerr(FILE *f);
+
 #endif /* _STDIO_H_ */
@@ -28,8 +28,6 @@
  */
 
 #include <stdio.h>
-#include <string.h>
-#include <unistd.h>
 
 /*
  * Nonstandard (hence the __) version of puts that doesn't append
@@ -41,13 +39,5 @@
 int
 __puts(const char *str)
 {
-	size_t len;
-	ssize_t ret;
-
-	len = strlen(str);
-	ret = write(STDOUT_FILENO, str, len);
-	if (ret == -1) {
-		return EOF;
-	}
-	return len;
+	return fputs(str, stdout);
 }
@@ -0,0 +1,184 @@
+/*
+ * Standard I/O streams and their buffers.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+static unsigned char __stdinbuf[BUFSIZ];
+static unsigned char __stdoutbuf[BUFSIZ];
+
+FILE __stdin = {
+	STDIN_FILENO, __SRD, -1, __stdinbuf, BUFSIZ, 0, 0, __stdinbuf, 0
+};
+FILE __stdout = {
+	STDOUT_FILENO, __SWR, -1, __stdoutbuf, BUFSIZ, 0, 0, __stdoutbuf, 0
+};
+FILE __stderr = {
+	STDERR_FILENO, __SWR, _IONBF, &__stderr.f_ch, 1, 0, 0, NULL, 0
+};
+
+/*
+ * Choose the buffering mode for a stream on first use: line buffered
+ * for the console, fully buffered for anything else.
+ */
+void
+__stdio_setup(FILE *f)
+{
+	struct stat st;
+
+	if (f->f_mode != -1) {
+		return;
+	}
+	if (fstat(f->f_fd, &st) < 0 || S_ISCHR(st.st_mode)) {
+		f->f_mode = _IOLBF;
+	}
+	else {
+		f->f_mode = _IOFBF;
+	}
+}
+
+/*
+ * Write out what's in the buffer of an output stream.
+ */
+int
+__stdio_flush(FILE *f)
+{
+	size_t done;
+	ssize_t ret;
+
+	done = 0;
+	while (done < f->f_len) {
+		ret = write(f->f_fd, f->f_buf + done, f->f_len - done);
+		if (ret < 0) {
+			/* keep what didn't get written */
+			memmove(f->f_buf, f->f_buf + done, f->f_len - done);
+			f->f_len -= done;
+			f->f_flags |= __SERR;
+			return -1;
+		}
+		done += ret;
+	}
+	f->f_len = 0;
+	return 0;
+}
+
+/*
+ * Refill the (empty) buffer of an input stream. Reading from the
+ * console first writes out any pending line-buffered output, so that
+ * prompts appear.
+ *
+ * The console hands over raw keystrokes without echoing them, and
+ * programs such as the shell echo each one as it arrives, so console
+ * input is read a character at a time rather than a line at a time.
+ */
+int
+__stdio_fill(FILE *f)
+{
+	size_t len;
+	ssize_t ret;
+
+	__stdio_setup(f);
+	len = f->f_bufsize;
+	if (f->f_mode != _IOFBF) {
+		if (stdout->f_len > 0) {
+			__stdio_flush(stdout);
+		}
+		len = 1;
+	}
+
+	ret = read(f->f_fd, f->f_buf, len);
+	if (ret < 0) {
+		f->f_flags |= __SERR;
+		return -1;
+	}
+	if (ret == 0) {
+		f->f_flags |= __SEOF;
+		return -1;
+	}
+	f->f_pos = 0;
+	f->f_len = ret;
+	return 0;
+}
+
+/*
+ * C standard I/O function - write out buffered output.
+ */
+int
+fflush(FILE *f)
+{
+	if (f == NULL) {
+		return (fflush(stdout) < 0 || fflush(stderr) < 0) ? EOF : 0;
+	}
+	if ((f->f_flags & __SWR) == 0) {
+		/* nothing to do for input */
+		return 0;
+	}
+	return __stdio_flush(f) < 0 ? EOF : 0;
+}
+
+/*
+ * C standard I/O function - choose buffering. BUF may be NULL to use
+ * the stream's own buffer. Any output already buffered is written
+ * out first; buffered input would be lost, so that's an error.
+ */
+int
+setvbuf(FILE *f, char *buf, int mode, size_t size)
+{
+	if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((f->f_flags & __SRD) && f->f_pos < f->f_len) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((f->f_flags & __SWR) && __stdio_flush(f) < 0) {
+		return -1;
+	}
+
+	if (mode == _IONBF) {
+		f->f_buf = &f->f_ch;
+		f->f_bufsize = 1;
+	}
+	else if (buf != NULL && size > 0) {
+		f->f_buf = (unsigned char *)buf;
+		f->f_bufsize = size;
+	}
+	else if (f->f_defbuf != NULL) {
+		f->f_buf = f->f_defbuf;
+		f->f_bufsize = BUFSIZ;
+	}
+	else if (f->f_buf == &f->f_ch) {
+		/* stderr has no buffer of its own */
+		errno = EINVAL;
+		return -1;
+	}
+	f->f_mode = mode;
+	f->f_pos = f->f_len = 0;
+	return 0;
+}
+
+/*
+ * C standard I/O functions - error and end-of-file indicators.
+ */
+int
+ferror(FILE *f)
+{
+	return (f->f_flags & __SERR) != 0;
+}
+
+int
+feof(FILE *f)
+{
+	return (f->f_flags & __SEOF) != 0;
+}
+
+void
+clearerr(FILE *f)
+{
+	f->f_flags &= ~(__SERR | __SEOF);
+}
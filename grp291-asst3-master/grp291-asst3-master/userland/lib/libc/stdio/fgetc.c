@@ -0,0 +1,17 @@
+/*
+ * C standard I/O function - read one character (0-255) from a
+ * stream, or return EOF on end of file or error.
+ */
+
+#include <stdio.h>
+
+int
+fgetc(FILE *f)
+{
+	unsigned char c;
+
+	if (fread(&c, 1, 1, f) != 1) {
+		return EOF;
+	}
+	return c;
+}
@@ -0,0 +1,50 @@
+/*
+ * fprintf - C standard I/O function.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+
+/*
+ * Function passed to __vprintf to do the actual output.
+ */
+static
+void
+__fprintf_send(void *mydata, const char *data, size_t len)
+{
+	FILE *f = mydata;
+
+	fwrite(data, 1, len, f);
+}
+
+/* fprintf: hand off to vfprintf */
+int
+fprintf(FILE *f, const char *fmt, ...)
+{
+	int chars;
+	va_list ap;
+
+	va_start(ap, fmt);
+	chars = vfprintf(f, fmt, ap);
+	va_end(ap);
+	return chars;
+}
+
+/* vfprintf: call __vprintf to do the work. */
+int
+vfprintf(FILE *f, const char *fmt, va_list ap)
+{
+	int chars, olderr;
+
+	olderr = ferror(f);
+	clearerr(f);
+	chars = __vprintf(__fprintf_send, f, fmt, ap);
+	if (ferror(f)) {
+		return -1;
+	}
+	if (olderr) {
+		f->f_flags |= __SERR;
+	}
+	return chars;
+}
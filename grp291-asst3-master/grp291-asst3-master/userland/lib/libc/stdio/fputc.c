@@ -0,0 +1,16 @@
+/*
+ * C standard I/O function - write one character to a stream.
+ */
+
+#include <stdio.h>
+
+int
+fputc(int ch, FILE *f)
+{
+	unsigned char c = ch;
+
+	if (fwrite(&c, 1, 1, f) != 1) {
+		return EOF;
+	}
+	return c;
+}
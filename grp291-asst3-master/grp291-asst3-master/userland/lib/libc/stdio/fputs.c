@@ -0,0 +1,19 @@
+/*
+ * C standard I/O function - write a string (without a newline) to a
+ * stream. Returns the length written, or EOF on error.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+int
+fputs(const char *str, FILE *f)
+{
+	size_t len;
+
+	len = strlen(str);
+	if (fwrite(str, 1, len, f) != len) {
+		return EOF;
+	}
+	return len;
+}
@@ -0,0 +1,45 @@
+/*
+ * C standard I/O function - read NITEMS items of SIZE bytes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+size_t
+fread(void *ptr, size_t size, size_t nitems, FILE *f)
+{
+	unsigned char *data = ptr;
+	size_t total, done, n;
+
+	if ((f->f_flags & __SRD) == 0) {
+		errno = EBADF;
+		f->f_flags |= __SERR;
+		return 0;
+	}
+	if (size == 0 || nitems == 0) {
+		return 0;
+	}
+	if (nitems > (size_t)-1 / size) {
+		/* size * nitems doesn't fit in a size_t */
+		errno = EINVAL;
+		f->f_flags |= __SERR;
+		return 0;
+	}
+	total = size * nitems;
+
+	done = 0;
+	while (done < total) {
+		if (f->f_pos == f->f_len && __stdio_fill(f) < 0) {
+			break;
+		}
+		n = f->f_len - f->f_pos;
+		if (n > total - done) {
+			n = total - done;
+		}
+		memcpy(data + done, f->f_buf + f->f_pos, n);
+		f->f_pos += n;
+		done += n;
+	}
+	return done / size;
+}
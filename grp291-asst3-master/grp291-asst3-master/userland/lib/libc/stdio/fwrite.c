@@ -0,0 +1,69 @@
+/*
+ * C standard I/O function - write NITEMS items of SIZE bytes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+size_t
+fwrite(const void *ptr, size_t size, size_t nitems, FILE *f)
+{
+	const unsigned char *data = ptr;
+	size_t total, done, n, i;
+	ssize_t ret;
+
+	if ((f->f_flags & __SWR) == 0) {
+		errno = EBADF;
+		f->f_flags |= __SERR;
+		return 0;
+	}
+	if (size == 0 || nitems == 0) {
+		return 0;
+	}
+	if (nitems > (size_t)-1 / size) {
+		/* size * nitems doesn't fit in a size_t */
+		errno = EINVAL;
+		f->f_flags |= __SERR;
+		return 0;
+	}
+	total = size * nitems;
+	__stdio_setup(f);
+
+	done = 0;
+	while (done < total) {
+		if (f->f_len == 0 &&
+		    (f->f_mode == _IONBF || total - done >= f->f_bufsize)) {
+			/* nothing buffered and it won't fit; skip the copy */
+			ret = write(f->f_fd, data + done, total - done);
+			if (ret < 0) {
+				f->f_flags |= __SERR;
+				break;
+			}
+			done += ret;
+			continue;
+		}
+
+		n = f->f_bufsize - f->f_len;
+		if (n > total - done) {
+			n = total - done;
+		}
+		memcpy(f->f_buf + f->f_len, data + done, n);
+		f->f_len += n;
+		done += n;
+		if (f->f_len == f->f_bufsize && __stdio_flush(f) < 0) {
+			break;
+		}
+	}
+
+	if (f->f_mode == _IOLBF && f->f_len > 0) {
+		for (i=0; i<done; i++) {
+			if (data[i] == '\n') {
+				__stdio_flush(f);
+				break;
+			}
+		}
+	}
+	return done / size;
+}
@@ -16,6 +16,10 @@ awk '
     # And, do not read lines that do not match the approximate right pattern.
     look && /^#define SYS_/ && NF==3 {
 	sub("^SYS_", "", $2);
+	# fork and execv are wrapped in unix/ to flush stdio first.
+	if ($2 == "fork" || $2 == "execv") {
+		$2 = "__" $2;
+	}
 	# print the name of the call and the number.
 	print $2, $3;
     }
@@ -0,0 +1,14 @@
+/*
+ * execv: write out stdio buffers first, since they are lost along with
+ * the rest of the old image if the exec succeeds.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+int
+execv(const char *prog, char *const *args)
+{
+	fflush(NULL);
+	return __execv(prog, args);
+}
@@ -0,0 +1,14 @@
+/*
+ * fork: write out stdio buffers first, so that output buffered before
+ * the fork isn't printed by both processes.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+pid_t
+fork(void)
+{
+	fflush(NULL);
+	return __fork();
+}
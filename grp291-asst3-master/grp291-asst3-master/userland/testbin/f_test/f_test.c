@@ -91,6 +91,8 @@ forkoff(void (*func)(void))
 		return -1;
 	    case 0:
 		func();
+		/* _exit doesn't flush stdio */
+		fflush(stdout);
 		_exit(0);
 	    default: break;
 	}
@@ -142,6 +144,7 @@ big_file(int size)
 
 		if (!(i % (10 * BUFFER_SIZE))) {
 			printf("\rBW : %d", i);
+			fflush(stdout);
 		}
 	}
 
@@ -165,6 +168,7 @@ big_file(int size)
 
 	if (!(i % (10 * BUFFER_SIZE))) {
 		printf("\rBR : %d", i);
+		fflush(stdout);
 	}
 
 	/* Check to see that the data is consistent : */
@@ -0,0 +1,236 @@
+/*
+ * Test for readv/writev and pread/pwrite.
+ *
+ * writev and readv are run with more iovecs than the kernel copies
+ * onto its stack, so the kmalloc'd array is used, and the data is
+ * checked against plain read and write.
+ *
+ * pread and pwrite pass their 64-bit position on the stack. We write
+ * at a small offset and then pread at the same offset plus 2^32: if
+ * the position were truncated to 32 bits on the way in we'd read our
+ * own data back instead of EOF. Neither call may move the seek
+ * position.
+ *
+ * Finally the error cases: ESPIPE for pread on the console, and EINVAL
+ * for a negative position and for iovcnt 0 or past IOV_MAX.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <errno.h>
+
+#define TESTFILE "rwvtestfile"
+
+#define NIOV 20			/* more than the kernel's on-stack 8 */
+#define CHUNK 37		/* odd-sized, so pieces straddle blocks */
+#define TOTAL (NIOV * CHUNK)
+
+#define POS ((off_t)0x1000LL)
+#define BIGPOS ((off_t)0x100001000LL)	/* POS plus 2^32 */
+
+static char wbuf[TOTAL];
+static char rbuf[TOTAL];
+static struct iovec iov[IOV_MAX + 1];
+
+static
+void
+fill(char *buf, size_t len, unsigned seed)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = 'a' + (i * 7 + seed) % 26;
+	}
+}
+
+static
+void
+check(const char *what, const char *buf, const char *expected, size_t len)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		if (buf[i] != expected[i]) {
+			errx(1, "%s: byte %zu was 0x%x, expected 0x%x", what,
+			     i, (unsigned char)buf[i],
+			     (unsigned char)expected[i]);
+		}
+	}
+}
+
+/* split BUF into NIOV pieces of CHUNK bytes */
+static
+void
+setup_iov(char *buf)
+{
+	unsigned i;
+
+	for (i=0; i<NIOV; i++) {
+		iov[i].iov_base = buf + i * CHUNK;
+		iov[i].iov_len = CHUNK;
+	}
+}
+
+static
+void
+checkpos(int fd, off_t expected, const char *after)
+{
+	off_t pos;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos == -1) {
+		err(1, "lseek");
+	}
+	if (pos != expected) {
+		errx(1, "%s moved the seek position to 0x%llx, expected 0x%llx",
+		     after, pos, expected);
+	}
+}
+
+static
+void
+expect_error(ssize_t r, int expected, const char *what)
+{
+	if (r >= 0) {
+		errx(1, "%s: expected failure but got %zd", what, r);
+	}
+	if (errno != expected) {
+		err(1, "%s: wrong error (expected %s)", what,
+		    strerror(expected));
+	}
+}
+
+static
+void
+test_vectors(int fd)
+{
+	ssize_t r;
+
+	printf("writev with %d iovecs\n", NIOV);
+	fill(wbuf, TOTAL, 0);
+	setup_iov(wbuf);
+	r = writev(fd, iov, NIOV);
+	if (r < 0) {
+		err(1, "writev");
+	}
+	if (r != TOTAL) {
+		errx(1, "writev: wrote %zd bytes, expected %d", r, TOTAL);
+	}
+	checkpos(fd, TOTAL, "writev");
+
+	printf("Checking it with read\n");
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		err(1, "lseek");
+	}
+	r = read(fd, rbuf, TOTAL);
+	if (r != TOTAL) {
+		errx(1, "read: got %zd bytes, expected %d", r, TOTAL);
+	}
+	check("read after writev", rbuf, wbuf, TOTAL);
+
+	printf("readv with %d iovecs\n", NIOV);
+	if (lseek(fd, 0, SEEK_SET) == -1) {
+		err(1, "lseek");
+	}
+	memset(rbuf, 0, TOTAL);
+	setup_iov(rbuf);
+	r = readv(fd, iov, NIOV);
+	if (r < 0) {
+		err(1, "readv");
+	}
+	if (r != TOTAL) {
+		errx(1, "readv: got %zd bytes, expected %d", r, TOTAL);
+	}
+	check("readv", rbuf, wbuf, TOTAL);
+	checkpos(fd, TOTAL, "readv");
+}
+
+static
+void
+test_positioned(int fd)
+{
+	ssize_t r;
+
+	printf("pwrite at 0x%llx\n", POS);
+	fill(wbuf, TOTAL, 1);
+	r = pwrite(fd, wbuf, TOTAL, POS);
+	if (r < 0) {
+		err(1, "pwrite");
+	}
+	if (r != TOTAL) {
+		errx(1, "pwrite: wrote %zd bytes, expected %d", r, TOTAL);
+	}
+	checkpos(fd, TOTAL, "pwrite");
+
+	printf("pread at 0x%llx\n", POS);
+	memset(rbuf, 0, TOTAL);
+	r = pread(fd, rbuf, TOTAL, POS);
+	if (r != TOTAL) {
+		errx(1, "pread: got %zd bytes, expected %d", r, TOTAL);
+	}
+	check("pread", rbuf, wbuf, TOTAL);
+	checkpos(fd, TOTAL, "pread");
+
+	printf("pread at 0x%llx (should get EOF)\n", BIGPOS);
+	r = pread(fd, rbuf, TOTAL, BIGPOS);
+	if (r < 0) {
+		err(1, "pread");
+	}
+	if (r != 0) {
+		errx(1, "pread at 0x%llx: got %zd bytes; position truncated?",
+		     BIGPOS, r);
+	}
+	checkpos(fd, TOTAL, "pread");
+}
+
+static
+void
+test_errors(int fd)
+{
+	char c;
+	int confd;
+
+	printf("Checking error cases\n");
+
+	confd = open("con:", O_RDWR);
+	if (confd < 0) {
+		err(1, "con:");
+	}
+	expect_error(pread(confd, &c, 1, 0), ESPIPE, "pread on con:");
+	expect_error(pwrite(confd, &c, 1, 0), ESPIPE, "pwrite on con:");
+	close(confd);
+
+	expect_error(pread(fd, &c, 1, -1), EINVAL, "pread at -1");
+	expect_error(pwrite(fd, &c, 1, -1), EINVAL, "pwrite at -1");
+
+	setup_iov(rbuf);
+	expect_error(readv(fd, iov, 0), EINVAL, "readv with 0 iovecs");
+	expect_error(writev(fd, iov, -1), EINVAL, "writev with -1 iovecs");
+	expect_error(readv(fd, iov, IOV_MAX + 1), EINVAL,
+		     "readv with IOV_MAX + 1 iovecs");
+}
+
+int
+main(void)
+{
+	int fd;
+
+	fd = open(TESTFILE, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", TESTFILE);
+	}
+
+	test_vectors(fd);
+	test_positioned(fd);
+	test_errors(fd);
+
+	close(fd);
+	remove(TESTFILE);
+	printf("Passed rwvtest.\n");
+	return 0;
+}
@@ -53,7 +53,8 @@
 
 /*
  * Print to the console, one character at a time to encourage
- * interleaving if the semaphores aren't working.
+ * interleaving if the semaphores aren't working. Each one is flushed
+ * right away: stdout is buffered, and the children leave with _exit.
  */
 static
 void
@@ -63,6 +64,7 @@ say(const char *str)
 
 	for (i=0; str[i]; i++) {
 		putchar(str[i]);
+		fflush(stdout);
 	}
 }
 